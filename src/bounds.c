@@ -0,0 +1,331 @@
+#include "bounds.h"
+#include "opt.h"
+
+typedef struct bounds {
+    ir_function_t* function;
+    call_summary_t* summary;
+    int vars;
+
+    bounds_state_t* in;
+    bounds_state_t state;
+
+    // Which variable a value was loaded from or stored to in the current block
+    ir_id_t* current;
+    int* stamp;
+    int block_stamp;
+    ir_var_t* var_of;
+    char* nonneg;
+} bounds_t;
+
+static void ir_bounds_alloc(bounds_state_t* state, int vars) {
+    state->nonneg = calloc(vars, 1);
+    state->below = malloc(sizeof(int) * vars);
+    state->top = 1;
+    if (!state->nonneg || !state->below) panic("Failed to allocate memory for bounds analysis");
+}
+
+static void ir_bounds_unknown(bounds_state_t* state, int vars) {
+    memset(state->nonneg, 0, vars);
+    for (int v = 0; v < vars; v++) {
+        state->below[v] = -1;
+    }
+
+    state->top = 0;
+}
+
+/* Meet into a successor's entry state, returns whether it changed */
+static int ir_bounds_meet(bounds_state_t* into, bounds_state_t* from, int vars) {
+    if (into->top) {
+        memcpy(into->nonneg, from->nonneg, vars);
+        memcpy(into->below, from->below, sizeof(int) * vars);
+        into->top = 0;
+        return 1;
+    }
+
+    int changed = 0;
+    for (int v = 0; v < vars; v++) {
+        if (into->nonneg[v] && !from->nonneg[v]) {
+            into->nonneg[v] = 0;
+            changed = 1;
+        }
+
+        if (into->below[v] != -1 && into->below[v] != from->below[v]) {
+            into->below[v] = -1;
+            changed = 1;
+        }
+    }
+
+    return changed;
+}
+
+static ir_var_t ir_bounds_var(bounds_t* b, ir_id_t value) {
+    if (value < 0 || value >= b->function->next_value_id) return -1;
+
+    ir_var_t var = b->var_of[value];
+    if (var < 0 || b->stamp[var] != b->block_stamp || b->current[var] != value) return -1;
+
+    return var;
+}
+
+static void ir_bounds_kill(bounds_t* b, ir_var_t var) {
+    b->state.nonneg[var] = 0;
+    b->state.below[var] = -1;
+    b->stamp[var] = 0;
+
+    for (int v = 0; v < b->vars; v++) {
+        if (b->state.below[v] == var) b->state.below[v] = -1;
+    }
+}
+
+static int ir_bounds_nonneg(bounds_t* b, ir_id_t value) {
+    if (value < 0 || value >= b->function->next_value_id) return 0;
+    return b->nonneg[value];
+}
+
+static int ir_bounds_value(bounds_t* b, ir_instruction_t* instr) {
+    ir_function_t* function = b->function;
+    if (instr->type != IR_TYPE_NUMBER) return 0;
+
+    switch (instr->op) {
+        case IR_CONST_NUMBER:
+            return (v_number_t) instr->constant.value >= 0;
+        case IR_LENGTH:
+            return 1;
+        case IR_LOAD:
+            return b->state.nonneg[instr->var.var_id];
+        case IR_ADD: case IR_MUL: case IR_DIV: case IR_MOD: {
+            ir_instruction_t* r = ir_fetch(function, instr->generic.operands[1]);
+            return r && r->type == IR_TYPE_NUMBER
+                && ir_bounds_nonneg(b, instr->generic.operands[0])
+                && ir_bounds_nonneg(b, instr->generic.operands[1]);
+        }
+        case IR_PHI:
+            for (int k = 0; k < instr->phi.phi_count; k++) {
+                if (!ir_bounds_nonneg(b, instr->phi.phi_values[k])) return 0;
+            }
+            return instr->phi.phi_count > 0;
+        default:
+            return 0;
+    }
+}
+
+static int ir_bounds_constant(ir_function_t* function, ir_id_t value, v_number_t* number) {
+    ir_instruction_t* def = ir_fetch(function, value);
+    if (!def || def->op != IR_CONST_NUMBER) return 0;
+
+    *number = (v_number_t) def->constant.value >> 3;
+    return 1;
+}
+
+/* Whether GET or SET at this point reads within the bounds of its value */
+static int ir_bounds_access(bounds_t* b, ir_instruction_t* instr) {
+    ir_function_t* function = b->function;
+    ir_instruction_t* index = ir_fetch(function, instr->generic.operands[1]);
+    v_number_t range;
+
+    if (!index || index->type != IR_TYPE_NUMBER) return 0;
+    if (!ir_bounds_constant(function, instr->generic.operands[2], &range) || range < 0 || range > 1) return 0;
+
+    ir_var_t var = ir_bounds_var(b, instr->generic.operands[0]);
+    ir_var_t i = ir_bounds_var(b, instr->generic.operands[1]);
+    if (var < 0 || i < 0) return 0;
+
+    return b->state.nonneg[i] && b->state.below[i] == var;
+}
+
+/*
+ * Refine the state along a branch edge. Only comparisons of a variable
+ * against the LENGTH of another variable or against a constant help.
+ */
+static void ir_bounds_refine(bounds_t* b, ir_instruction_t* branch, int truthy, bounds_state_t* out) {
+    ir_function_t* function = b->function;
+    ir_instruction_t* condition = ir_fetch(function, branch->branch.condition);
+    if (!condition || (condition->op != IR_LT && condition->op != IR_GT)) return;
+
+    ir_id_t small = condition->generic.operands[condition->op == IR_LT ? 0 : 1];
+    ir_id_t large = condition->generic.operands[condition->op == IR_LT ? 1 : 0];
+
+    ir_instruction_t* small_def = ir_fetch(function, small);
+    if (!small_def || small_def->type != IR_TYPE_NUMBER) return;
+
+    ir_var_t i = ir_bounds_var(b, small);
+    ir_instruction_t* length = ir_fetch(function, large);
+    v_number_t number;
+
+    if (truthy && i >= 0 && length && length->op == IR_LENGTH) {
+        ir_var_t var = ir_bounds_var(b, length->generic.operands[0]);
+        if (var >= 0) out->below[i] = var;
+    }
+
+    // > i k with k >= -1 and ! < i k with k >= 0 both leave i non-negative
+    ir_var_t var = ir_bounds_var(b, condition->generic.operands[0]);
+    ir_instruction_t* left = ir_fetch(function, condition->generic.operands[0]);
+    if (var < 0 || !left || left->type != IR_TYPE_NUMBER) return;
+    if (!ir_bounds_constant(function, condition->generic.operands[1], &number)) return;
+
+    if ((condition->op == IR_GT && truthy && number >= -1) || (condition->op == IR_LT && !truthy && number >= 0)) {
+        out->nonneg[var] = 1;
+    }
+}
+
+/* Walk a block from its entry state, returns whether a successor changed */
+static int ir_bounds_block(bounds_t* b, ir_block_t* block, int mark) {
+    ir_function_t* function = b->function;
+    bounds_state_t* in = &b->in[block->order];
+
+    memcpy(b->state.nonneg, in->nonneg, b->vars);
+    memcpy(b->state.below, in->below, sizeof(int) * b->vars);
+    b->state.top = 0;
+    b->block_stamp++;
+
+    for (int i = 0; i < block->instruction_count; i++) {
+        ir_instruction_t* instr = &block->instructions[i];
+        b->nonneg[instr->result] = ir_bounds_value(b, instr);
+
+        switch (instr->op) {
+            case IR_LOAD: {
+                ir_var_t var = instr->var.var_id;
+                if (b->stamp[var] != b->block_stamp) {
+                    b->stamp[var] = b->block_stamp;
+                    b->current[var] = instr->result;
+                }
+
+                b->var_of[instr->result] = var;
+                break;
+            }
+            case IR_STORE: {
+                ir_var_t var = instr->var.var_id;
+                ir_id_t value = instr->var.value;
+                ir_var_t from = ir_bounds_var(b, value);
+                int below = from >= 0 && from != var ? b->state.below[from] : -1;
+
+                ir_bounds_kill(b, var);
+                b->state.nonneg[var] = ir_bounds_nonneg(b, value);
+                b->state.below[var] = below == var ? -1 : below;
+
+                if (value >= 0 && value < function->next_value_id) {
+                    b->stamp[var] = b->block_stamp;
+                    b->current[var] = value;
+                    if (from < 0) b->var_of[value] = var;
+                }
+                break;
+            }
+            case IR_CALL: {
+                uint64_t* writes = ir_call_effect(b->summary, instr->result)->writes;
+
+                for (int v = 0; v < b->vars; v++) {
+                    if ((writes[v / 64] >> (v % 64)) & 1) ir_bounds_kill(b, v);
+                }
+                break;
+            }
+            case IR_GET:
+            case IR_SET:
+                if (mark && ir_bounds_access(b, instr)) instr->flags |= IR_FLAG_IN_BOUNDS;
+                break;
+            default:
+                break;
+        }
+    }
+
+    ir_instruction_t* terminator = ir_terminator(block);
+    if (!terminator || terminator->op == IR_RETURN || mark) return 0;
+
+    int changed = 0;
+    if (terminator->op == IR_JUMP) {
+        ir_block_t* next = terminator->jump.block;
+        if (next->order >= 0 && next->region) changed |= ir_bounds_meet(&b->in[next->order], &b->state, b->vars);
+        return changed;
+    }
+
+    bounds_state_t out;
+    ir_bounds_alloc(&out, b->vars);
+
+    for (int t = 0; t < 2; t++) {
+        ir_block_t* next = t ? terminator->branch.truthy : terminator->branch.falsey;
+        if (next->order < 0 || !next->region) continue;
+
+        memcpy(out.nonneg, b->state.nonneg, b->vars);
+        memcpy(out.below, b->state.below, sizeof(int) * b->vars);
+        if (terminator->branch.truthy != terminator->branch.falsey) ir_bounds_refine(b, terminator, t, &out);
+
+        changed |= ir_bounds_meet(&b->in[next->order], &out, b->vars);
+    }
+
+    free(out.nonneg);
+    free(out.below);
+
+    return changed;
+}
+
+/*
+ * Mark GET and SET whose index is a non-negative number proven below the
+ * LENGTH of the value being indexed, with a range of 0 or 1, so the VM
+ * can skip coercion and bounds checks. The facts come from a forward
+ * dataflow over variables, refined by the comparisons that guard loops.
+ */
+void ir_bounds(ir_function_t* function, call_summary_t* summary) {
+    ir_types(function);
+    ir_cfg_order(function);
+
+    int n = function->next_value_id;
+    bounds_t b = {
+        .function = function,
+        .summary = summary,
+        .vars = function->var_id + 1,
+        .in = malloc(sizeof(bounds_state_t) * (function->order_count + 1)),
+        .current = malloc(sizeof(ir_id_t) * (function->var_id + 1)),
+        .stamp = calloc(function->var_id + 1, sizeof(int)),
+        .block_stamp = 0,
+        .var_of = malloc(sizeof(ir_var_t) * (n + 1)),
+        .nonneg = calloc(n + 1, 1),
+    };
+
+    if (!b.in || !b.current || !b.stamp || !b.var_of || !b.nonneg) {
+        panic("Failed to allocate memory for bounds analysis");
+    }
+
+    for (int i = 0; i < n; i++) {
+        b.var_of[i] = -1;
+    }
+
+    ir_bounds_alloc(&b.state, b.vars);
+    for (int o = 0; o < function->order_count; o++) {
+        ir_block_t* block = function->order[o];
+        ir_bounds_alloc(&b.in[o], b.vars);
+
+        // The program and every BLOCK body can start with anything in its variables
+        if (block->region == block) ir_bounds_unknown(&b.in[o], b.vars);
+    }
+
+    int converged = 0;
+    for (int round = 0; round < BOUNDS_ROUNDS && !converged; round++) {
+        converged = 1;
+
+        for (int o = 0; o < function->order_count; o++) {
+            ir_block_t* block = function->order[o];
+            if (!block->region || b.in[o].top) continue;
+
+            if (ir_bounds_block(&b, block, 0)) converged = 0;
+        }
+    }
+
+    if (converged) {
+        for (int o = 0; o < function->order_count; o++) {
+            ir_block_t* block = function->order[o];
+            if (block->region && !b.in[o].top) ir_bounds_block(&b, block, 1);
+        }
+    }
+
+    for (int o = 0; o < function->order_count; o++) {
+        free(b.in[o].nonneg);
+        free(b.in[o].below);
+    }
+
+    free(b.in);
+    free(b.state.nonneg);
+    free(b.state.below);
+    free(b.current);
+    free(b.stamp);
+    free(b.var_of);
+    free(b.nonneg);
+}
@@ -0,0 +1,21 @@
+#ifndef BOUNDS_H
+#define BOUNDS_H
+
+#include "ir.h"
+#include "call.h"
+
+#define BOUNDS_ROUNDS 32
+
+/*
+ * What is known about a variable at a program point: whether it holds a
+ * non-negative number, and the variable whose LENGTH it is below, or -1.
+ */
+typedef struct bounds_state {
+    char* nonneg;
+    int* below;
+    int top;
+} bounds_state_t;
+
+void ir_bounds(ir_function_t* function, call_summary_t* summary);
+
+#endif
@@ -0,0 +1,529 @@
+#include "call.h"
+#include "cfg.h"
+#include "opt.h"
+
+call_info_t* ir_call_info(ir_function_t* function) {
+    call_info_t* info = calloc(1, sizeof(call_info_t));
+    if (!info) panic("Failed to allocate memory for call analysis");
+
+    int vars = function->var_id + 1;
+    info->store_count = calloc(vars, sizeof(int));
+    info->store = malloc(sizeof(ir_id_t) * vars);
+    info->ready = malloc(vars);
+    info->calls = malloc(sizeof(ir_id_t) * 8);
+    info->call_capacity = 8;
+
+    if (!info->store_count || !info->store || !info->ready || !info->calls) {
+        panic("Failed to allocate memory for call analysis");
+    }
+
+    memset(info->ready, -1, vars);
+
+    for (int b = 0; b < function->block_count; b++) {
+        ir_block_t* block = function->blocks[b];
+
+        for (int i = 0; i < block->instruction_count; i++) {
+            ir_instruction_t* instr = &block->instructions[i];
+
+            if (instr->op == IR_STORE) {
+                info->store_count[instr->var.var_id]++;
+                info->store[instr->var.var_id] = instr->result;
+            } else if (instr->op == IR_CALL && block->region == function->block) {
+                if (info->call_count >= info->call_capacity) {
+                    info->call_capacity *= 2;
+                    info->calls = realloc(info->calls, sizeof(ir_id_t) * info->call_capacity);
+                    if (!info->calls) panic("Failed to allocate memory for call analysis");
+                }
+
+                info->calls[info->call_count++] = instr->result;
+            }
+        }
+    }
+
+    return info;
+}
+
+void ir_call_info_free(call_info_t* info) {
+    if (!info) return;
+
+    free(info->store_count);
+    free(info->store);
+    free(info->ready);
+    free(info->calls);
+    free(info);
+}
+
+static int ir_instr_dominates(ir_function_t* function, ir_id_t a, ir_id_t b) {
+    ir_block_t* ablock = function->index->owners[a];
+    ir_block_t* bblock = function->index->owners[b];
+
+    if (ablock == bblock) {
+        return ir_fetch(function, a) < ir_fetch(function, b);
+    }
+
+    return ir_dominates(ablock, bblock);
+}
+
+/*
+ * A BLOCK body can only start running from a CALL in the main program,
+ * so a variable whose only store dominates every such CALL is always
+ * assigned by the time any body reads it.
+ */
+static int ir_call_ready(ir_function_t* function, call_info_t* info, ir_var_t var) {
+    if (info->ready[var] != -1) return info->ready[var];
+
+    info->ready[var] = 1;
+    for (int i = 0; i < info->call_count; i++) {
+        if (!ir_instr_dominates(function, info->store[var], info->calls[i])) {
+            info->ready[var] = 0;
+            break;
+        }
+    }
+
+    return info->ready[var];
+}
+
+static ir_block_t* ir_call_resolve(ir_function_t* function, call_info_t* info, ir_id_t value, int depth) {
+    ir_instruction_t* instr = ir_fetch(function, value);
+    if (!instr || depth > 8) return NULL;
+
+    switch (instr->op) {
+        case IR_BLOCK:
+            return instr->block.function;
+        case IR_LOAD: {
+            ir_var_t var = instr->var.var_id;
+            if (info->store_count[var] != 1) return NULL;
+
+            ir_id_t store = info->store[var];
+            ir_block_t* load_block = function->index->owners[value];
+            ir_block_t* store_block = function->index->owners[store];
+            if (!load_block->region || !store_block->region) return NULL;
+
+            if (load_block->region == store_block->region) {
+                if (!ir_instr_dominates(function, store, value)) return NULL;
+            } else if (store_block->region != function->block || load_block->region == function->block) {
+                return NULL;
+            } else if (!ir_call_ready(function, info, var)) {
+                return NULL;
+            }
+
+            return ir_call_resolve(function, info, ir_fetch(function, store)->var.value, depth + 1);
+        }
+        case IR_PHI: {
+            ir_block_t* target = NULL;
+            for (int k = 0; k < instr->phi.phi_count; k++) {
+                ir_block_t* resolved = ir_call_resolve(function, info, instr->phi.phi_values[k], depth + 1);
+                if (!resolved || (target && resolved != target)) return NULL;
+                target = resolved;
+            }
+
+            return target;
+        }
+        default:
+            return NULL;
+    }
+}
+
+/*
+ * Statically resolve the BLOCK a CALL operand evaluates to, following
+ * variables that are assigned exactly once and PHIs that agree.
+ * Requires the CFG order and dominators to be up to date.
+ */
+ir_block_t* ir_call_target(ir_function_t* function, call_info_t* info, ir_id_t value) {
+    return ir_call_resolve(function, info, value, 0);
+}
+
+static void ir_inline_copy(
+    ir_function_t* function, ir_instruction_t* copy, ir_instruction_t* instr,
+    ir_id_t* values, ir_block_t** clones, ir_block_t* tail
+) {
+    if (instr->op != IR_RETURN) {
+        ir_clone_instruction(function, copy, instr, values, clones);
+        return;
+    }
+
+    ir_id_t result = copy->result;
+    *copy = *instr;
+    copy->result = result;
+    copy->op = IR_JUMP;
+    copy->jump.block = tail;
+}
+
+/*
+ * Replace the CALL at index i of block with a copy of the callee's
+ * blocks. The block is split after the call, every RETURN in the copy
+ * jumps to the continuation, and uses of the call result are rewritten
+ * to the returned value (or a PHI of them).
+ */
+static int ir_inline_call(ir_function_t* function, ir_block_t* block, int i, ir_block_t* callee, ir_id_t* values, int* budget) {
+    int size = 0;
+    int returns = 0;
+    int first = -1;
+
+    for (int o = 0; o < function->order_count; o++) {
+        ir_block_t* cb = function->order[o];
+        if (cb->region != callee) continue;
+
+        if (first == -1) first = o;
+        size += cb->instruction_count;
+
+        ir_instruction_t* terminator = ir_terminator(cb);
+        if (terminator && terminator->op == IR_RETURN) returns++;
+    }
+
+    if (!returns || size > INLINE_SIZE || size > *budget) return 0;
+    *budget -= size;
+
+    int start = i > 0 && block->instructions[i - 1].op == IR_SAVE ? i - 1 : i;
+    int end = i + 1 < block->instruction_count && block->instructions[i + 1].op == IR_RESTORE ? i + 2 : i + 1;
+    ir_id_t call = block->instructions[i].result;
+
+    ir_block_t* tail = ir_block_split(function, block, end);
+    for (int k = start; k < end; k++) {
+        ir_index_remove(function, &block->instructions[k]);
+    }
+    block->instruction_count = start;
+
+    int table = function->next_block_id;
+    ir_block_t** clones = calloc(table + 1, sizeof(ir_block_t*));
+    ir_block_t** originals = malloc(sizeof(ir_block_t*) * (function->order_count + 1));
+    ir_id_t* results = malloc(sizeof(ir_id_t) * (returns + 1));
+    ir_block_t** exits = malloc(sizeof(ir_block_t*) * (returns + 1));
+    if (!clones || !originals || !results || !exits) panic("Failed to allocate memory for inlining");
+
+    int count = 0;
+    for (int o = first; o < function->order_count && function->order[o]->region == callee; o++) {
+        ir_block_t* cb = function->order[o];
+        ir_block_t* clone = ir_create_block(function);
+
+        originals[count++] = cb;
+        clones[cb->id] = clone;
+
+        for (int k = 0; k < cb->instruction_count; k++) {
+            ir_instruction_t* instr = &cb->instructions[k];
+            ir_instruction_t* copy = ir_emit(instr->op == IR_RETURN ? IR_JUMP : instr->op, function, clone);
+            values[instr->result] = copy->result;
+        }
+    }
+
+    int exit_count = 0;
+    for (int c = 0; c < count; c++) {
+        ir_block_t* cb = originals[c];
+        ir_block_t* clone = clones[cb->id];
+
+        for (int k = 0; k < cb->instruction_count; k++) {
+            ir_instruction_t* instr = &cb->instructions[k];
+            ir_inline_copy(function, &clone->instructions[k], instr, values, clones, tail);
+
+            if (instr->op == IR_RETURN) {
+                results[exit_count] = ir_clone_value(values, instr->generic.operands[0]);
+                exits[exit_count++] = clone;
+            }
+        }
+
+        for (int k = 0; k < clone->instruction_count; k++) {
+            ir_index_add(function, clone, &clone->instructions[k]);
+        }
+    }
+
+    ir_instruction_t* jump = ir_emit(IR_JUMP, function, block);
+    jump->jump.block = clones[callee->id];
+    ir_index_add(function, block, jump);
+
+    ir_id_t returned = results[0];
+    if (exit_count > 1) {
+        ir_instruction_t* phi = ir_emit(IR_PHI, function, tail);
+        phi->phi.phi_count = exit_count;
+        phi->phi.phi_capacity = exit_count;
+        phi->phi.phi_values = arena_alloc(function->arena, sizeof(ir_id_t) * exit_count);
+        phi->phi.phi_blocks = arena_alloc(function->arena, sizeof(ir_block_t*) * exit_count);
+
+        for (int k = 0; k < exit_count; k++) {
+            phi->phi.phi_values[k] = results[k];
+            phi->phi.phi_blocks[k] = exits[k];
+        }
+
+        ir_instruction_t moved = *phi;
+        memmove(tail->instructions + 1, tail->instructions, sizeof(ir_instruction_t) * (tail->instruction_count - 1));
+        tail->instructions[0] = moved;
+
+        ir_index_block(function, tail);
+        ir_index_add(function, tail, &tail->instructions[0]);
+        returned = moved.result;
+    }
+
+    ir_replace_uses(function, call, returned);
+
+    for (int c = 0; c < count; c++) {
+        ir_block_t* cb = originals[c];
+        for (int k = 0; k < cb->instruction_count; k++) {
+            values[cb->instructions[k].result] = -1;
+        }
+    }
+
+    free(clones);
+    free(originals);
+    free(results);
+    free(exits);
+
+    return 1;
+}
+
+static void ir_inline_prepare(ir_function_t* function) {
+    ir_cfg_build(function);
+    ir_cfg_order(function);
+    ir_cfg_dominators(function);
+}
+
+void ir_inline(ir_function_t* function) {
+    int budget = INLINE_BUDGET;
+
+    for (int round = 0; round < INLINE_ROUNDS && budget > 0; round++) {
+        ir_inline_prepare(function);
+        call_info_t* info = ir_call_info(function);
+
+        int n = function->next_value_id;
+        ir_id_t* values = malloc(sizeof(ir_id_t) * (n + 1));
+        if (!values) panic("Failed to allocate memory for inlining");
+
+        for (int i = 0; i < n; i++) {
+            values[i] = -1;
+        }
+
+        int inlined = 0;
+        int blocks = function->block_count;
+
+        // Regions changed this round are not in the block order, so they are not copied until the next one
+        char* modified = calloc(function->next_block_id + 1, 1);
+        if (!modified) panic("Failed to allocate memory for inlining");
+
+        for (int b = 0; b < blocks; b++) {
+            ir_block_t* block = function->blocks[b];
+            if (!block->region) continue;
+
+            for (int i = 0; i < block->instruction_count; i++) {
+                ir_instruction_t* instr = &block->instructions[i];
+                if (instr->op != IR_CALL) continue;
+
+                ir_block_t* callee = ir_call_target(function, info, instr->generic.operands[0]);
+                if (!callee || callee == block->region || !callee->region || modified[callee->id]) continue;
+
+                // Only one call per block and round, the rest moved to the continuation
+                if (ir_inline_call(function, block, i, callee, values, &budget)) {
+                    modified[block->region->id] = 1;
+                    inlined++;
+                    break;
+                }
+            }
+        }
+
+        free(values);
+        free(modified);
+        ir_call_info_free(info);
+
+        if (!inlined) break;
+    }
+
+    ir_cfg_build(function);
+}
+
+static void ir_effect_init(call_effect_t* effect, int var_words, int region_words) {
+    effect->reads = calloc(var_words, sizeof(uint64_t));
+    effect->writes = calloc(var_words, sizeof(uint64_t));
+    effect->regions = calloc(region_words, sizeof(uint64_t));
+    effect->io = 0;
+
+    if (!effect->reads || !effect->writes || !effect->regions) {
+        panic("Failed to allocate memory for call summary");
+    }
+}
+
+static int ir_effect_merge(call_effect_t* into, call_effect_t* from, int var_words, int region_words) {
+    int changed = from->io && !into->io;
+    into->io |= from->io;
+
+    for (int w = 0; w < var_words; w++) {
+        uint64_t reads = into->reads[w] | from->reads[w];
+        uint64_t writes = into->writes[w] | from->writes[w];
+
+        changed |= reads != into->reads[w] || writes != into->writes[w];
+        into->reads[w] = reads;
+        into->writes[w] = writes;
+    }
+
+    for (int w = 0; w < region_words; w++) {
+        uint64_t regions = into->regions[w] | from->regions[w];
+
+        changed |= regions != into->regions[w];
+        into->regions[w] = regions;
+    }
+
+    return changed;
+}
+
+static inline int ir_effect_io(ir_instruction_t* instr) {
+    return instr->op == IR_OUTPUT || instr->op == IR_DUMP || instr->op == IR_PROMPT
+        || instr->op == IR_QUIT || instr->op == IR_RANDOM;
+}
+
+/*
+ * Mod/ref summary of every BLOCK body, closed over the calls it makes.
+ * A CALL that cannot be resolved may run any body, so it gets the union
+ * of all of them. Requires the CFG order and dominators to be up to date.
+ */
+call_summary_t* ir_call_summary(ir_function_t* function) {
+    call_summary_t* summary = calloc(1, sizeof(call_summary_t));
+    if (!summary) panic("Failed to allocate memory for call summary");
+
+    summary->index_size = function->next_block_id + 1;
+    summary->index = malloc(sizeof(int) * summary->index_size);
+    summary->roots = malloc(sizeof(ir_block_t*) * (function->order_count + 1));
+    summary->target_size = function->next_value_id;
+    summary->targets = malloc(sizeof(int) * (summary->target_size + 1));
+
+    if (!summary->index || !summary->roots || !summary->targets) {
+        panic("Failed to allocate memory for call summary");
+    }
+
+    for (int i = 0; i < summary->index_size; i++) {
+        summary->index[i] = -1;
+    }
+
+    for (int i = 0; i < summary->target_size; i++) {
+        summary->targets[i] = -1;
+    }
+
+    for (int o = 0; o < function->order_count; o++) {
+        ir_block_t* block = function->order[o];
+        if (block->region != block) continue;
+
+        summary->index[block->id] = summary->region_count;
+        summary->roots[summary->region_count++] = block;
+    }
+
+    int regions = summary->region_count;
+    summary->var_words = (function->var_id + 64) / 64;
+    summary->region_words = (regions + 63) / 64 + 1;
+
+    int var_words = summary->var_words;
+    int region_words = summary->region_words;
+
+    summary->effects = malloc(sizeof(call_effect_t) * (regions + 1));
+    uint64_t* callees = calloc((size_t) region_words * (regions + 1), sizeof(uint64_t));
+    char* unknown = calloc(regions + 1, 1);
+    if (!summary->effects || !callees || !unknown) panic("Failed to allocate memory for call summary");
+
+    for (int r = 0; r < regions; r++) {
+        ir_effect_init(&summary->effects[r], var_words, region_words);
+        summary->effects[r].regions[r / 64] |= 1ULL << (r % 64);
+    }
+
+    call_info_t* info = ir_call_info(function);
+
+    for (int o = 0; o < function->order_count; o++) {
+        ir_block_t* block = function->order[o];
+        if (!block->region) continue;
+
+        int r = summary->index[block->region->id];
+        call_effect_t* effect = &summary->effects[r];
+
+        for (int i = 0; i < block->instruction_count; i++) {
+            ir_instruction_t* instr = &block->instructions[i];
+
+            if (instr->op == IR_LOAD) {
+                effect->reads[instr->var.var_id / 64] |= 1ULL << (instr->var.var_id % 64);
+            } else if (instr->op == IR_STORE) {
+                effect->writes[instr->var.var_id / 64] |= 1ULL << (instr->var.var_id % 64);
+            } else if (instr->op == IR_CALL) {
+                ir_block_t* callee = ir_call_target(function, info, instr->generic.operands[0]);
+                int t = callee && callee->id < summary->index_size ? summary->index[callee->id] : -1;
+
+                summary->targets[instr->result] = t;
+                if (t < 0) {
+                    unknown[r] = 1;
+                } else {
+                    callees[(size_t) r * region_words + t / 64] |= 1ULL << (t % 64);
+                }
+            } else if (ir_effect_io(instr)) {
+                effect->io = 1;
+            }
+        }
+    }
+
+    ir_call_info_free(info);
+
+    // The main program is never called, every other region may be
+    ir_effect_init(&summary->any, var_words, region_words);
+    for (int r = 1; r < regions; r++) {
+        ir_effect_merge(&summary->any, &summary->effects[r], var_words, region_words);
+    }
+
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+
+        for (int r = 0; r < regions; r++) {
+            call_effect_t* effect = &summary->effects[r];
+
+            if (unknown[r]) {
+                changed |= ir_effect_merge(effect, &summary->any, var_words, region_words);
+            }
+
+            for (int t = 0; t < regions; t++) {
+                if (!ir_effect_has(&callees[(size_t) r * region_words], t)) continue;
+                changed |= ir_effect_merge(effect, &summary->effects[t], var_words, region_words);
+            }
+
+            if (r > 0) {
+                changed |= ir_effect_merge(&summary->any, effect, var_words, region_words);
+            }
+        }
+    }
+
+    free(callees);
+    free(unknown);
+
+    return summary;
+}
+
+void ir_call_summary_free(call_summary_t* summary) {
+    if (!summary) return;
+
+    for (int r = 0; r < summary->region_count; r++) {
+        free(summary->effects[r].reads);
+        free(summary->effects[r].writes);
+        free(summary->effects[r].regions);
+    }
+
+    free(summary->any.reads);
+    free(summary->any.writes);
+    free(summary->any.regions);
+
+    free(summary->effects);
+    free(summary->roots);
+    free(summary->index);
+    free(summary->targets);
+    free(summary);
+}
+
+call_effect_t* ir_call_effect(call_summary_t* summary, ir_id_t call) {
+    if (call < 0 || call >= summary->target_size || summary->targets[call] < 0) {
+        return &summary->any;
+    }
+
+    return &summary->effects[summary->targets[call]];
+}
+
+/*
+ * Registers are shared by every activation, so a value can only be
+ * overwritten by a call that may run the region it was defined in.
+ */
+int ir_call_clobbers(ir_function_t* function, call_summary_t* summary, ir_id_t call, ir_id_t value) {
+    ir_block_t* owner = function->index->owners[value];
+    if (!owner || !owner->region || owner->region->id >= summary->index_size) return 1;
+
+    int r = summary->index[owner->region->id];
+    if (r < 0) return 1;
+
+    return ir_effect_has(ir_call_effect(summary, call)->regions, r);
+}
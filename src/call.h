@@ -0,0 +1,65 @@
+#ifndef CALL_H
+#define CALL_H
+
+#include "ir.h"
+
+#define INLINE_SIZE 48
+#define INLINE_BUDGET 4096
+#define INLINE_ROUNDS 4
+
+typedef struct call_info {
+    int* store_count;
+    ir_id_t* store;
+    signed char* ready;
+
+    // CALLs in the main program, the only way into a BLOCK body
+    ir_id_t* calls;
+    int call_count;
+    int call_capacity;
+} call_info_t;
+
+/*
+ * What running a BLOCK body may do, including every body it calls:
+ * the variables it reads and writes, whether it does I/O, and which
+ * bodies (by region index) may run and so overwrite their registers.
+ */
+typedef struct call_effect {
+    uint64_t* reads;
+    uint64_t* writes;
+    uint64_t* regions;
+    int io;
+} call_effect_t;
+
+typedef struct call_summary {
+    int region_count;
+    ir_block_t** roots;
+    int* index;
+    int index_size;
+
+    // Region index each CALL resolves to, -1 when unknown
+    int* targets;
+    int target_size;
+
+    int var_words;
+    int region_words;
+
+    call_effect_t* effects;
+    call_effect_t any;
+} call_summary_t;
+
+static inline int ir_effect_has(uint64_t* set, int bit) {
+    return (set[bit / 64] >> (bit % 64)) & 1;
+}
+
+call_info_t* ir_call_info(ir_function_t* function);
+void ir_call_info_free(call_info_t* info);
+ir_block_t* ir_call_target(ir_function_t* function, call_info_t* info, ir_id_t value);
+
+call_summary_t* ir_call_summary(ir_function_t* function);
+void ir_call_summary_free(call_summary_t* summary);
+call_effect_t* ir_call_effect(call_summary_t* summary, ir_id_t call);
+int ir_call_clobbers(ir_function_t* function, call_summary_t* summary, ir_id_t call, ir_id_t value);
+
+void ir_inline(ir_function_t* function);
+
+#endif
@@ -0,0 +1,603 @@
+#include "cfg.h"
+#include "opt.h"
+
+static void ir_cfg_table(ir_function_t* function) {
+    free(function->block_table);
+
+    function->block_table_size = function->next_block_id;
+    function->block_table = calloc(function->block_table_size + 1, sizeof(ir_block_t*));
+    if (!function->block_table) panic("Failed to allocate memory for block table");
+
+    for (int b = 0; b < function->block_count; b++) {
+        ir_block_t* block = function->blocks[b];
+        function->block_table[block->id] = block;
+    }
+}
+
+static void ir_cfg_edge(ir_block_t* from, ir_block_t* to) {
+    for (int i = 0; i < from->successor_count; i++) {
+        if (from->successors[i] == to->id) return;
+    }
+
+    if (from->successor_count >= from->successor_capacity) {
+        from->successor_capacity = from->successor_capacity ? from->successor_capacity * 2 : 2;
+        from->successors = arena_realloc(from->arena, from->successors, sizeof(ir_id_t) * from->successor_capacity);
+    }
+
+    if (to->predecessor_count >= to->predecessor_capacity) {
+        to->predecessor_capacity = to->predecessor_capacity ? to->predecessor_capacity * 2 : 2;
+        to->predecessors = arena_realloc(to->arena, to->predecessors, sizeof(ir_id_t) * to->predecessor_capacity);
+    }
+
+    from->successors[from->successor_count++] = to->id;
+    to->predecessors[to->predecessor_count++] = from->id;
+}
+
+static int ir_cfg_is_predecessor(ir_block_t* block, ir_block_t* predecessor) {
+    for (int i = 0; i < block->predecessor_count; i++) {
+        if (block->predecessors[i] == predecessor->id) return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Recompute successors and predecessors from block terminators. The IR
+ * builder records successors while it is still stitching blocks together,
+ * so they can contain stale edges, and it can leave unreachable jumps
+ * after a terminator along with PHI entries for blocks that never reach
+ * the merge. Both are dropped here.
+ */
+void ir_cfg_build(ir_function_t* function) {
+    ir_cfg_table(function);
+
+    for (int b = 0; b < function->block_count; b++) {
+        ir_block_t* block = function->blocks[b];
+        block->successor_count = 0;
+        block->predecessor_count = 0;
+
+        for (int i = 0; i < block->instruction_count; i++) {
+            ir_op_t op = block->instructions[i].op;
+            if (op != IR_BRANCH && op != IR_JUMP && op != IR_RETURN) continue;
+
+            for (int k = i + 1; k < block->instruction_count; k++) {
+                ir_index_remove(function, &block->instructions[k]);
+            }
+
+            block->instruction_count = i + 1;
+            break;
+        }
+    }
+
+    for (int b = 0; b < function->block_count; b++) {
+        ir_block_t* block = function->blocks[b];
+        ir_instruction_t* terminator = ir_terminator(block);
+        if (!terminator) continue;
+
+        if (terminator->op == IR_BRANCH) {
+            ir_cfg_edge(block, terminator->branch.truthy);
+            ir_cfg_edge(block, terminator->branch.falsey);
+        } else if (terminator->op == IR_JUMP) {
+            ir_cfg_edge(block, terminator->jump.block);
+        }
+    }
+
+    for (int b = 0; b < function->block_count; b++) {
+        ir_block_t* block = function->blocks[b];
+
+        for (int i = 0; i < block->instruction_count; i++) {
+            ir_instruction_t* phi = &block->instructions[i];
+            if (phi->op != IR_PHI) continue;
+
+            int count = 0;
+            for (int k = 0; k < phi->phi.phi_count; k++) {
+                ir_block_t* from = phi->phi.phi_blocks[k];
+                int keep = ir_cfg_is_predecessor(block, from);
+
+                for (int j = 0; j < count && keep; j++) {
+                    if (phi->phi.phi_blocks[j] == from) keep = 0;
+                }
+
+                if (!keep) {
+                    ir_index_unuse(function, phi->phi.phi_values[k], phi->result);
+                    continue;
+                }
+
+                phi->phi.phi_values[count] = phi->phi.phi_values[k];
+                phi->phi.phi_blocks[count] = from;
+                count++;
+            }
+
+            phi->phi.phi_count = count;
+        }
+    }
+}
+
+static void ir_cfg_visit(ir_function_t* function, ir_block_t* root, ir_block_t** stack, int* next, ir_block_t** post, int* post_count) {
+    int size = 0;
+    int first = *post_count;
+
+    root->order = -2;
+    root->region = root;
+    stack[size] = root;
+    next[size++] = root->successor_count;
+
+    while (size > 0) {
+        ir_block_t* top = stack[size - 1];
+
+        // Walk successors last to first so the first one comes first in reverse postorder
+        if (next[size - 1] > 0) {
+            ir_block_t* succ = ir_block_find(function, top->successors[--next[size - 1]]);
+            if (succ && succ->order == -1) {
+                succ->order = -2;
+                succ->region = root;
+                stack[size] = succ;
+                next[size++] = succ->successor_count;
+            }
+        } else {
+            post[(*post_count)++] = top;
+            size--;
+        }
+    }
+
+    for (int i = *post_count - 1; i >= first; i--) {
+        ir_block_t* block = post[i];
+        block->order = function->order_count;
+        function->order[function->order_count++] = block;
+    }
+}
+
+/*
+ * Linearize the blocks into reverse postorder, one region at a time: the
+ * program entry first, followed by the body of every BLOCK. Loop bodies
+ * directly follow their header. Unreachable blocks are placed last.
+ */
+void ir_cfg_order(ir_function_t* function) {
+    int count = function->block_count;
+
+    free(function->order);
+    function->order = malloc(sizeof(ir_block_t*) * (count + 1));
+    function->order_count = 0;
+
+    ir_block_t** stack = malloc(sizeof(ir_block_t*) * (count + 1));
+    ir_block_t** post = malloc(sizeof(ir_block_t*) * (count + 1));
+    int* next = malloc(sizeof(int) * (count + 1));
+    if (!function->order || !stack || !post || !next) panic("Failed to allocate memory for block order");
+
+    for (int b = 0; b < count; b++) {
+        function->blocks[b]->order = -1;
+        function->blocks[b]->region = NULL;
+    }
+
+    int post_count = 0;
+    ir_cfg_visit(function, function->block, stack, next, post, &post_count);
+
+    for (int b = 0; b < count; b++) {
+        ir_block_t* block = function->blocks[b];
+        for (int i = 0; i < block->instruction_count; i++) {
+            ir_instruction_t* instr = &block->instructions[i];
+            if (instr->op == IR_BLOCK && instr->block.function->order == -1) {
+                ir_cfg_visit(function, instr->block.function, stack, next, post, &post_count);
+            }
+        }
+    }
+
+    for (int b = 0; b < count; b++) {
+        ir_block_t* block = function->blocks[b];
+        if (block->order == -1) {
+            block->order = function->order_count;
+            function->order[function->order_count++] = block;
+        }
+    }
+
+    free(stack);
+    free(post);
+    free(next);
+}
+
+static ir_block_t* ir_cfg_intersect(ir_block_t* a, ir_block_t* b) {
+    while (a != b) {
+        while (a->order > b->order) a = a->idom;
+        while (b->order > a->order) b = b->idom;
+    }
+
+    return a;
+}
+
+/*
+ * Immediate dominators (Cooper, Harvey and Kennedy) over the order from
+ * ir_cfg_order. Region entries dominate themselves, unreachable blocks
+ * are left without a dominator.
+ */
+void ir_cfg_dominators(ir_function_t* function) {
+    for (int o = 0; o < function->order_count; o++) {
+        ir_block_t* block = function->order[o];
+        block->idom = block->region == block ? block : NULL;
+    }
+
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+
+        for (int o = 0; o < function->order_count; o++) {
+            ir_block_t* block = function->order[o];
+            if (!block->region || block->region == block) continue;
+
+            ir_block_t* idom = NULL;
+            for (int p = 0; p < block->predecessor_count; p++) {
+                ir_block_t* pred = ir_block_find(function, block->predecessors[p]);
+                if (!pred || !pred->idom) continue;
+
+                idom = idom ? ir_cfg_intersect(pred, idom) : pred;
+            }
+
+            if (idom != block->idom) {
+                block->idom = idom;
+                changed = 1;
+            }
+        }
+    }
+}
+
+int ir_dominates(ir_block_t* a, ir_block_t* b) {
+    while (b && b != a) {
+        if (b->idom == b) return 0;
+        b = b->idom;
+    }
+
+    return b == a;
+}
+
+/*
+ * Move the instructions from index at onwards into a new block. PHIs in
+ * the successors that named the old block now name the new one. The
+ * caller is responsible for terminating the old block.
+ */
+ir_block_t* ir_block_split(ir_function_t* function, ir_block_t* block, int at) {
+    ir_block_t* tail = ir_create_block(function);
+    int count = block->instruction_count - at;
+
+    if (count > tail->instruction_capacity) {
+        tail->instruction_capacity = count;
+        tail->instructions = arena_realloc(function->arena, tail->instructions, sizeof(ir_instruction_t) * count);
+    }
+
+    if (count > 0) {
+        memcpy(tail->instructions, block->instructions + at, sizeof(ir_instruction_t) * count);
+    }
+
+    tail->instruction_count = count;
+    block->instruction_count = at;
+    ir_index_block(function, tail);
+
+    ir_instruction_t* terminator = ir_terminator(tail);
+    if (terminator && terminator->op != IR_RETURN) {
+        ir_block_t* targets[2] = {
+            terminator->op == IR_BRANCH ? terminator->branch.truthy : terminator->jump.block,
+            terminator->op == IR_BRANCH ? terminator->branch.falsey : NULL
+        };
+
+        for (int t = 0; t < 2; t++) {
+            if (!targets[t] || (t == 1 && targets[1] == targets[0])) continue;
+
+            for (int i = 0; i < targets[t]->instruction_count; i++) {
+                ir_instruction_t* phi = &targets[t]->instructions[i];
+                if (phi->op != IR_PHI) continue;
+
+                for (int k = 0; k < phi->phi.phi_count; k++) {
+                    if (phi->phi.phi_blocks[k] == block) phi->phi.phi_blocks[k] = tail;
+                }
+            }
+        }
+    }
+
+    return tail;
+}
+
+static void ir_cfg_unlink(ir_block_t* from, ir_block_t* to) {
+    int count = 0;
+    for (int i = 0; i < from->successor_count; i++) {
+        if (from->successors[i] != to->id) from->successors[count++] = from->successors[i];
+    }
+    from->successor_count = count;
+
+    count = 0;
+    for (int i = 0; i < to->predecessor_count; i++) {
+        if (to->predecessors[i] != from->id) to->predecessors[count++] = to->predecessors[i];
+    }
+    to->predecessor_count = count;
+}
+
+static int ir_cfg_root(ir_function_t* function, ir_block_t* block) {
+    return block == function->block || block->region == block;
+}
+
+static int ir_cfg_has_phi(ir_block_t* block) {
+    return block->instruction_count > 0 && block->instructions[0].op == IR_PHI;
+}
+
+static void ir_cfg_phi_add(ir_function_t* function, ir_instruction_t* phi, ir_id_t value, ir_block_t* from) {
+    if (phi->phi.phi_count >= phi->phi.phi_capacity) {
+        int capacity = phi->phi.phi_capacity ? phi->phi.phi_capacity * 2 : 2;
+        ir_id_t* values = arena_alloc(function->arena, sizeof(ir_id_t) * capacity);
+        ir_block_t** blocks = arena_alloc(function->arena, sizeof(ir_block_t*) * capacity);
+
+        memcpy(values, phi->phi.phi_values, sizeof(ir_id_t) * phi->phi.phi_count);
+        memcpy(blocks, phi->phi.phi_blocks, sizeof(ir_block_t*) * phi->phi.phi_count);
+
+        phi->phi.phi_values = values;
+        phi->phi.phi_blocks = blocks;
+        phi->phi.phi_capacity = capacity;
+    }
+
+    phi->phi.phi_values[phi->phi.phi_count] = value;
+    phi->phi.phi_blocks[phi->phi.phi_count++] = from;
+    ir_index_use(function, value, phi->result);
+}
+
+/*
+ * Blocks that are not reachable from the program entry or any BLOCK
+ * body are removed, unless something reachable still reads their values.
+ */
+static int ir_cfg_sweep(ir_function_t* function) {
+    ir_index_t* index = function->index;
+    int count = 0;
+
+    for (int b = 0; b < function->block_count; b++) {
+        ir_block_t* block = function->blocks[b];
+        int keep = block->region != NULL;
+
+        for (int i = 0; i < block->instruction_count && !keep; i++) {
+            ir_id_t result = block->instructions[i].result;
+
+            for (int u = 0; u < ir_use_count(function, result); u++) {
+                ir_block_t* owner = index->owners[index->uses[result][u]];
+                if (owner && owner->region) keep = 1;
+            }
+        }
+
+        if (keep) {
+            function->blocks[count++] = block;
+            continue;
+        }
+
+        for (int i = 0; i < block->instruction_count; i++) {
+            ir_index_remove(function, &block->instructions[i]);
+        }
+
+        for (int s = 0; s < block->successor_count; s++) {
+            ir_block_t* succ = ir_block_find(function, block->successors[s]);
+            if (succ) ir_cfg_unlink(block, succ);
+        }
+
+        block->instruction_count = 0;
+    }
+
+    int removed = function->block_count - count;
+    function->block_count = count;
+
+    return removed;
+}
+
+/* Branches on a constant or to a single target become jumps */
+static int ir_cfg_fold_branch(ir_function_t* function, ir_block_t* block) {
+    ir_instruction_t* terminator = ir_terminator(block);
+    if (!terminator || terminator->op != IR_BRANCH) return 0;
+
+    ir_block_t* target = NULL;
+    ir_instruction_t* condition = ir_fetch(function, terminator->branch.condition);
+
+    if (terminator->branch.truthy == terminator->branch.falsey) {
+        target = terminator->branch.truthy;
+    } else if (condition && ir_is_constant(condition)) {
+        int truthy = v_coerce_to_boolean(condition->constant.value) >> 3;
+        target = truthy ? terminator->branch.truthy : terminator->branch.falsey;
+        ir_cfg_unlink(block, truthy ? terminator->branch.falsey : terminator->branch.truthy);
+    } else {
+        return 0;
+    }
+
+    ir_index_unuse(function, terminator->branch.condition, terminator->result);
+    terminator->op = IR_JUMP;
+    terminator->jump.block = target;
+
+    return 1;
+}
+
+/*
+ * Retarget edges into a block that only jumps elsewhere. PHIs in the
+ * final target get an entry for the new predecessor, which is not
+ * possible when it already reaches that target another way.
+ */
+static int ir_cfg_thread(ir_function_t* function, ir_block_t* block) {
+    ir_instruction_t* terminator = ir_terminator(block);
+    if (!terminator || terminator->op == IR_RETURN) return 0;
+
+    ir_block_t** slots[2] = {
+        terminator->op == IR_BRANCH ? &terminator->branch.truthy : &terminator->jump.block,
+        terminator->op == IR_BRANCH ? &terminator->branch.falsey : NULL
+    };
+
+    for (int s = 0; s < 2; s++) {
+        if (!slots[s]) continue;
+
+        ir_block_t* middle = *slots[s];
+        if (middle == block || middle->instruction_count != 1 || ir_cfg_root(function, middle)) continue;
+
+        ir_instruction_t* jump = &middle->instructions[0];
+        if (jump->op != IR_JUMP) continue;
+
+        ir_block_t* target = jump->jump.block;
+        if (target == middle) continue;
+
+        ir_block_t* other = slots[1 - s] ? *slots[1 - s] : NULL;
+        if (ir_cfg_has_phi(target) && (other == target || other == middle || ir_cfg_is_predecessor(target, block))) {
+            continue;
+        }
+
+        for (int i = 0; i < target->instruction_count && target->instructions[i].op == IR_PHI; i++) {
+            ir_instruction_t* phi = &target->instructions[i];
+
+            for (int k = 0; k < phi->phi.phi_count; k++) {
+                if (phi->phi.phi_blocks[k] == middle) {
+                    ir_cfg_phi_add(function, phi, phi->phi.phi_values[k], block);
+                    break;
+                }
+            }
+        }
+
+        *slots[s] = target;
+        if (other != middle) ir_cfg_unlink(block, middle);
+        ir_cfg_edge(block, target);
+
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Append a block's only successor to it when that successor has no
+ * other predecessors. Its PHIs have a single entry and fold away.
+ */
+static int ir_cfg_merge(ir_function_t* function, ir_block_t* block) {
+    ir_instruction_t* terminator = ir_terminator(block);
+    if (!terminator || terminator->op != IR_JUMP) return 0;
+
+    ir_block_t* next = terminator->jump.block;
+    if (next == block || next->predecessor_count != 1 || ir_cfg_root(function, next)) return 0;
+
+    int phis = 0;
+    for (; phis < next->instruction_count && next->instructions[phis].op == IR_PHI; phis++) {
+        ir_instruction_t* phi = &next->instructions[phis];
+        ir_id_t value = -1;
+
+        for (int k = 0; k < phi->phi.phi_count; k++) {
+            if (phi->phi.phi_blocks[k] == block) value = phi->phi.phi_values[k];
+        }
+
+        ir_index_remove(function, phi);
+        ir_replace_uses(function, phi->result, value);
+    }
+
+    int count = block->instruction_count - 1 + next->instruction_count - phis;
+    ir_instruction_t* instructions = arena_alloc(function->arena, sizeof(ir_instruction_t) * (count + 1));
+
+    ir_index_remove(function, terminator);
+    memcpy(instructions, block->instructions, sizeof(ir_instruction_t) * (block->instruction_count - 1));
+    memcpy(instructions + block->instruction_count - 1, next->instructions + phis, sizeof(ir_instruction_t) * (next->instruction_count - phis));
+
+    block->instructions = instructions;
+    block->instruction_count = count;
+    block->instruction_capacity = count + 1;
+    next->instruction_count = 0;
+    ir_index_block(function, block);
+
+    ir_cfg_unlink(block, next);
+    while (next->successor_count > 0) {
+        ir_block_t* succ = ir_block_find(function, next->successors[0]);
+        ir_cfg_unlink(next, succ);
+        ir_cfg_edge(block, succ);
+
+        for (int i = 0; i < succ->instruction_count && succ->instructions[i].op == IR_PHI; i++) {
+            ir_instruction_t* phi = &succ->instructions[i];
+
+            for (int k = 0; k < phi->phi.phi_count; k++) {
+                if (phi->phi.phi_blocks[k] == next) phi->phi.phi_blocks[k] = block;
+            }
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Clean up the block graph left by the builder and the inliner: fold
+ * trivial branches, thread jumps through empty blocks, merge straight
+ * chains and drop what is no longer reachable. Successors and
+ * predecessors are kept up to date throughout.
+ */
+void ir_cfg_simplify(ir_function_t* function) {
+    for (int round = 0; round < CFG_ROUNDS; round++) {
+        ir_cfg_build(function);
+        ir_cfg_order(function);
+
+        int changed = ir_cfg_sweep(function);
+
+        for (int b = 0; b < function->block_count; b++) {
+            ir_block_t* block = function->blocks[b];
+            if (!block->region) continue;
+
+            changed |= ir_cfg_fold_branch(function, block);
+            changed |= ir_cfg_thread(function, block);
+            while (ir_cfg_merge(function, block)) changed = 1;
+        }
+
+        if (!changed) break;
+    }
+
+    ir_cfg_build(function);
+}
+
+/* Insert a new instruction at index at, the caller indexes it once its fields are set */
+ir_instruction_t* ir_block_insert(ir_function_t* function, ir_block_t* block, int at, ir_op_t op) {
+    ir_instruction_t* instr = ir_emit(op, function, block);
+    ir_instruction_t copy = *instr;
+
+    memmove(&block->instructions[at + 1], &block->instructions[at], sizeof(ir_instruction_t) * (block->instruction_count - 1 - at));
+    block->instructions[at] = copy;
+    ir_index_block(function, block);
+
+    return &block->instructions[at];
+}
+
+/*
+ * Fill copy with instr, keeping the result it was emitted with. Values
+ * and blocks are renamed through values and clones, anything without an
+ * entry is kept. SAVE and RESTORE are left empty for ir_preserve.
+ */
+void ir_clone_instruction(
+    ir_function_t* function, ir_instruction_t* copy, ir_instruction_t* instr,
+    ir_id_t* values, ir_block_t** clones
+) {
+    ir_id_t result = copy->result;
+    *copy = *instr;
+    copy->result = result;
+
+    switch (instr->op) {
+        case IR_STORE:
+            copy->var.value = ir_clone_value(values, instr->var.value);
+            break;
+        case IR_BRANCH:
+            copy->branch.condition = ir_clone_value(values, instr->branch.condition);
+            copy->branch.truthy = ir_clone_block(clones, instr->branch.truthy);
+            copy->branch.falsey = ir_clone_block(clones, instr->branch.falsey);
+            break;
+        case IR_JUMP:
+            copy->jump.block = ir_clone_block(clones, instr->jump.block);
+            break;
+        case IR_PHI:
+            copy->phi.phi_values = arena_alloc(function->arena, sizeof(ir_id_t) * instr->phi.phi_capacity);
+            copy->phi.phi_blocks = arena_alloc(function->arena, sizeof(ir_block_t*) * instr->phi.phi_capacity);
+
+            for (int k = 0; k < instr->phi.phi_count; k++) {
+                copy->phi.phi_values[k] = ir_clone_value(values, instr->phi.phi_values[k]);
+                copy->phi.phi_blocks[k] = ir_clone_block(clones, instr->phi.phi_blocks[k]);
+            }
+            break;
+        case IR_SAVE:
+        case IR_RESTORE:
+            copy->generic.operands = NULL;
+            copy->generic.operand_count = 0;
+            break;
+        default:
+            if (ir_operand_count(instr) > 0) {
+                copy->generic.operands = arena_alloc(function->arena, sizeof(ir_id_t) * instr->generic.operand_count);
+
+                for (int k = 0; k < instr->generic.operand_count; k++) {
+                    copy->generic.operands[k] = ir_clone_value(values, instr->generic.operands[k]);
+                }
+            }
+            break;
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef CFG_H
+#define CFG_H
+
+#include "ir.h"
+
+static inline ir_block_t* ir_block_find(ir_function_t* function, ir_id_t id) {
+    if (id < 0 || id >= function->block_table_size) return NULL;
+    return function->block_table[id];
+}
+
+static inline ir_instruction_t* ir_terminator(ir_block_t* block) {
+    if (!block->instruction_count) return NULL;
+
+    ir_instruction_t* last = &block->instructions[block->instruction_count - 1];
+    if (last->op == IR_BRANCH || last->op == IR_JUMP || last->op == IR_RETURN) {
+        return last;
+    }
+
+    return NULL;
+}
+
+static inline ir_id_t ir_clone_value(ir_id_t* values, ir_id_t value) {
+    if (value >= 0 && values[value] != -1) return values[value];
+    return value;
+}
+
+static inline ir_block_t* ir_clone_block(ir_block_t** clones, ir_block_t* block) {
+    return clones[block->id] ? clones[block->id] : block;
+}
+
+#define CFG_ROUNDS 16
+
+void ir_cfg_build(ir_function_t* function);
+void ir_cfg_order(ir_function_t* function);
+void ir_cfg_dominators(ir_function_t* function);
+int ir_dominates(ir_block_t* a, ir_block_t* b);
+void ir_cfg_simplify(ir_function_t* function);
+ir_block_t* ir_block_split(ir_function_t* function, ir_block_t* block, int at);
+ir_instruction_t* ir_block_insert(ir_function_t* function, ir_block_t* block, int at, ir_op_t op);
+void ir_clone_instruction(
+    ir_function_t* function, ir_instruction_t* copy, ir_instruction_t* instr,
+    ir_id_t* values, ir_block_t** clones
+);
+
+#endif
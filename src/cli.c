@@ -4,6 +4,7 @@
 
 #include "cli.h"
 #include "debug.h"
+#include "pass.h"
 
 void cli_help() {
     printf("Usage: knight [options] <input_file>\n");
@@ -13,6 +14,15 @@ void cli_help() {
     printf("  -e, --execute        Execute a string of Knight code\n");
     printf("  -j, --jit-off        Disable JIT compilation\n");
     printf("  -d, --debug          View debug output for IR\n");
+    printf("  -m, --memo           Run in the VM, memoizing calls to pure blocks\n");
+    printf("  -p, --partial        Run the input-independent start of the program while compiling\n");
+    printf("  -t, --trace          Run in the VM, compiling the paths hot loops take instead of the whole program\n");
+    printf("  -s, --speculate      Let the JIT assume arithmetic is on numbers, falling back to the VM if not\n");
+    printf("  -O0, -O1, -O2, -O3   Optimization level, chosen from the program's size and loops by default\n");
+    printf("  --passes <list>      Run exactly these passes in order, [a,b] repeats a group until nothing changes\n");
+    printf("  --enable <list>      Run these passes regardless of level\n");
+    printf("  --disable <list>     Never run these passes\n");
+    printf("  --time-passes        Report the time and IR size of each pass\n");
 }
 
 cli_config_t cli_parse(int argc, char* argv[]) {
@@ -23,6 +33,7 @@ cli_config_t cli_parse(int argc, char* argv[]) {
 
     cli_config_t config = {0};
     config.flags = CONFIG_JIT | CONFIG_FILE;
+    config.level = PASS_AUTO;
 
     for (int i = 1; i < argc; i++) {
         if (!config.input) {
@@ -40,6 +51,31 @@ cli_config_t cli_parse(int argc, char* argv[]) {
                 }
             } else if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--debug") == 0) {
                 config.flags |= CONFIG_IR;
+            } else if (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--memo") == 0) {
+                // Memo tables are kept by the VM, compiled code calls bodies directly
+                config.flags |= CONFIG_MEMO;
+                config.flags &= ~CONFIG_JIT;
+            } else if (strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--partial") == 0) {
+                config.flags |= CONFIG_PARTIAL;
+            } else if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--trace") == 0) {
+                // Traces are compiled while the VM runs, instead of compiling the program up front
+                config.flags |= CONFIG_TRACE;
+                config.flags &= ~CONFIG_JIT;
+            } else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--speculate") == 0) {
+                config.flags |= CONFIG_SPECULATE;
+            } else if (strncmp(argv[i], "-O", 2) == 0 && argv[i][2] >= '0' && argv[i][2] <= '3' && !argv[i][3]) {
+                config.level = argv[i][2] - '0';
+            } else if (strcmp(argv[i], "--passes") == 0) {
+                if (i + 1 >= argc) panic("No pass list specified for --passes");
+                config.passes = argv[++i];
+            } else if (strcmp(argv[i], "--enable") == 0) {
+                if (i + 1 >= argc) panic("No pass list specified for --enable");
+                config.enable = argv[++i];
+            } else if (strcmp(argv[i], "--disable") == 0) {
+                if (i + 1 >= argc) panic("No pass list specified for --disable");
+                config.disable = argv[++i];
+            } else if (strcmp(argv[i], "--time-passes") == 0) {
+                config.flags |= CONFIG_TIME_PASSES;
             } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
                 cli_help();
                 exit(0);
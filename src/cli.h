@@ -6,12 +6,23 @@ typedef enum flags {
     CONFIG_JIT = 1 << 1,
     CONFIG_FILE = 1 << 2,
     CONFIG_IR = 1 << 3,
+    CONFIG_MEMO = 1 << 4,
+    CONFIG_PARTIAL = 1 << 5,
+    CONFIG_TIME_PASSES = 1 << 6,
+    CONFIG_SPECULATE = 1 << 7,
+    CONFIG_TRACE = 1 << 8,
 } flags_t;
 
 typedef struct cli_config {
     flags_t flags;
     char* input;
 
+    // Optimization level and pass lists, see opt_pipeline
+    int level;
+    char* passes;
+    char* enable;
+    char* disable;
+
     char** args;
     int argc;
 } cli_config_t;
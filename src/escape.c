@@ -0,0 +1,164 @@
+#include "escape.h"
+#include "cfg.h"
+#include "opt.h"
+
+/*
+ * A value escapes when anything but its one consumer can observe it. A
+ * result with a single use never reaches a variable, PHI or call except
+ * through that use, so the consumer is free to never build it.
+ */
+static ir_instruction_t* ir_sink_private(ir_function_t* function, ir_id_t value, ir_op_t op) {
+    ir_instruction_t* def = ir_fetch(function, value);
+    if (!def || def->op != op || ir_use_count(function, value) != 1) return NULL;
+
+    return def;
+}
+
+static int ir_sink_sequence(ir_function_t* function, ir_id_t value) {
+    ir_instruction_t* def = ir_fetch(function, value);
+    return def && (def->type == IR_TYPE_STRING || def->type == IR_TYPE_ARRAY);
+}
+
+static ir_type_t ir_sink_type(ir_function_t* function, ir_id_t value) {
+    ir_instruction_t* def = ir_fetch(function, value);
+    return def ? def->type : IR_TYPE_ANY;
+}
+
+static ir_id_t ir_sink_length(ir_function_t* function, ir_block_t* block, int at, ir_id_t value) {
+    ir_instruction_t* length = ir_block_insert(function, block, at, IR_LENGTH);
+    length->type = IR_TYPE_NUMBER;
+    length->generic.operand_count = 1;
+    length->generic.operands = arena_alloc(function->arena, sizeof(ir_id_t));
+    length->generic.operands[0] = value;
+    ir_index_add(function, block, length);
+
+    return length->result;
+}
+
+/* Turn instr into a binary number operation, it keeps its result */
+static void ir_sink_binary(ir_function_t* function, ir_block_t* block, ir_instruction_t* instr, ir_op_t op, ir_id_t l, ir_id_t r) {
+    for (int k = 0; k < ir_operand_count(instr); k++) {
+        ir_index_unuse(function, *ir_operand(instr, k), instr->result);
+    }
+
+    instr->op = op;
+    instr->type = IR_TYPE_NUMBER;
+    instr->generic.operand_count = 2;
+    instr->generic.operands = arena_alloc(function->arena, sizeof(ir_id_t) * 2);
+    instr->generic.operands[0] = l;
+    instr->generic.operands[1] = r;
+    ir_index_add(function, block, instr);
+}
+
+/*
+ * The length of a temporary follows from its operands: a BOX holds one
+ * item, a concatenation of two sequences of the same type is as long as
+ * both, a tail is one shorter and an in-bounds GET is its range.
+ */
+static int ir_sink_length_of(ir_function_t* function, ir_block_t* block, int i) {
+    ir_instruction_t* instr = &block->instructions[i];
+    ir_id_t result = instr->result;
+    ir_id_t value = instr->generic.operands[0];
+    ir_instruction_t* def;
+
+    if ((def = ir_sink_private(function, value, IR_BOX))) {
+        ir_to_const(function, instr, (v_t) (1 << 3) | TYPE_NUMBER);
+        instr->type = IR_TYPE_NUMBER;
+        return 1;
+    }
+
+    if ((def = ir_sink_private(function, value, IR_ADD)) && ir_sink_sequence(function, value)) {
+        ir_id_t l = def->generic.operands[0];
+        ir_id_t r = def->generic.operands[1];
+        if (ir_sink_type(function, l) != def->type || ir_sink_type(function, r) != def->type) return 0;
+
+        ir_id_t left = ir_sink_length(function, block, i, l);
+        ir_id_t right = ir_sink_length(function, block, i + 1, r);
+        ir_sink_binary(function, block, ir_fetch(function, result), IR_ADD, left, right);
+        return 1;
+    }
+
+    if ((def = ir_sink_private(function, value, IR_ULTIMATE)) && ir_sink_sequence(function, value)) {
+        ir_id_t whole = ir_sink_length(function, block, i, def->generic.operands[0]);
+
+        ir_instruction_t* one = ir_block_insert(function, block, i + 1, IR_CONST_NUMBER);
+        one->type = IR_TYPE_NUMBER;
+        one->constant.value = (v_t) (1 << 3) | TYPE_NUMBER;
+        ir_index_add(function, block, one);
+
+        ir_sink_binary(function, block, ir_fetch(function, result), IR_SUB, whole, one->result);
+        return 1;
+    }
+
+    if ((def = ir_sink_private(function, value, IR_GET)) && (def->flags & IR_FLAG_IN_BOUNDS)) {
+        ir_id_t range = def->generic.operands[2];
+        if (ir_sink_type(function, range) != IR_TYPE_NUMBER) return 0;
+
+        ir_replace_uses(function, result, range);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Collect the strings a private concatenation is built from, left to right */
+static int ir_sink_pieces(ir_function_t* function, ir_id_t value, ir_id_t* pieces, int count) {
+    ir_instruction_t* def = ir_sink_private(function, value, IR_ADD);
+
+    if (!def || def->type != IR_TYPE_STRING || count + 2 > SINK_PIECES) {
+        pieces[count++] = value;
+        return count;
+    }
+
+    count = ir_sink_pieces(function, def->generic.operands[0], pieces, count);
+    return ir_sink_pieces(function, def->generic.operands[1], pieces, count);
+}
+
+/*
+ * An OUTPUT of a concatenation writes the pieces one after the other
+ * instead, the VM coerces each of them to a string on its own. Only
+ * the VM understands OUTPUT with more than one operand.
+ */
+static int ir_sink_output(ir_function_t* function, ir_block_t* block, ir_instruction_t* instr) {
+    #ifndef JIT_OFF
+    if (function->config && (function->config->flags & CONFIG_JIT)) return 0;
+    #endif
+
+    ir_id_t pieces[SINK_PIECES];
+    int count = ir_sink_pieces(function, instr->generic.operands[0], pieces, 0);
+    if (count < 2) return 0;
+
+    ir_index_unuse(function, instr->generic.operands[0], instr->result);
+
+    instr->generic.operand_count = count;
+    instr->generic.operands = arena_alloc(function->arena, sizeof(ir_id_t) * count);
+    memcpy(instr->generic.operands, pieces, sizeof(ir_id_t) * count);
+    ir_index_add(function, block, instr);
+
+    return 1;
+}
+
+/*
+ * Sink temporary strings and lists into their only consumer. Returns
+ * whether anything changed, the temporaries are left for ir_drop.
+ */
+int ir_sink(ir_function_t* function) {
+    ir_types(function);
+
+    int changed = 0;
+    for (int b = 0; b < function->block_count; b++) {
+        ir_block_t* block = function->blocks[b];
+
+        for (int i = 0; i < block->instruction_count; i++) {
+            ir_instruction_t* instr = &block->instructions[i];
+
+            if (instr->op == IR_LENGTH) {
+                changed |= ir_sink_length_of(function, block, i);
+            } else if (instr->op == IR_OUTPUT) {
+                changed |= ir_sink_output(function, block, instr);
+            }
+        }
+    }
+
+    return changed;
+}
@@ -0,0 +1,11 @@
+#ifndef ESCAPE_H
+#define ESCAPE_H
+
+#include "ir.h"
+
+// Most pieces an OUTPUT of concatenated strings is split into
+#define SINK_PIECES 16
+
+int ir_sink(ir_function_t* function);
+
+#endif
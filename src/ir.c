@@ -47,6 +47,9 @@ const char* debug_ir_op_string(ir_op_t op) {
         case IR_LENGTH: return "LENGTH";
         case IR_GET: return "GET";
         case IR_SET: return "SET";
+        case IR_BUILD: return "BUILD";
+        case IR_APPEND: return "APPEND";
+        case IR_FINISH: return "FINISH";
         case IR_SAVE: return "SAVE";
         case IR_RESTORE: return "RESTORE";
         default: panic("Unknown IR operation");
@@ -131,9 +134,11 @@ ir_instruction_t* ir_emit(ir_op_t op, ir_function_t* function, ir_block_t* block
     }
 
     ir_instruction_t* instr = &block->instructions[block->instruction_count++];
+    memset(instr, 0, sizeof(ir_instruction_t));
     instr->op = op;
     instr->result = ir_next(function);
-    instr->type = IR_TYPE_NULL;
+    instr->type = IR_TYPE_ANY;
+    instr->position = 0;
 
     return instr;
 }
@@ -244,10 +249,21 @@ ir_block_t* ir_create_block(ir_function_t* function) {
 
     block->predecessors = arena_alloc(function->arena, sizeof(ir_id_t) * 2);
     block->predecessor_count = 0;
+    block->predecessor_capacity = 2;
     block->successors = arena_alloc(function->arena, sizeof(ir_id_t) * 3);
     block->successor_count = 0;
     block->successor_capacity = 3;
 
+    block->order = -1;
+    block->region = NULL;
+    block->idom = NULL;
+    block->from = 0;
+    block->to = 0;
+    block->live_in = NULL;
+    block->live_out = NULL;
+    block->memo = -1;
+    block->native = NULL;
+
     block->arena = function->arena;
     function->blocks[function->block_count++] = block;
     return block;
@@ -829,6 +845,19 @@ ir_function_t* ir_create(ast_node_t* tree, arena_t* arena, map_t* symbol_table,
     function->symbol_table = symbol_table;
     function->arena = arena;
     function->var_id = 0;
+    function->config = config;
+    function->index = NULL;
+
+    function->block_table = NULL;
+    function->block_table_size = 0;
+    function->order = NULL;
+    function->order_count = 0;
+    function->live_names = NULL;
+    function->live_ids = NULL;
+    function->live_count = 0;
+    function->live_words = 0;
+    function->memos = NULL;
+    function->memo_count = 0;
 
     ir_block_t* entry_block = ir_create_block(function);
     function->block = entry_block;
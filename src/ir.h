@@ -17,7 +17,8 @@ typedef enum ir_type {
     IR_TYPE_BOOLEAN,
     IR_TYPE_NULL,
     IR_TYPE_ARRAY,
-    IR_TYPE_BLOCK
+    IR_TYPE_BLOCK,
+    IR_TYPE_ANY
 } ir_type_t;
 
 typedef enum ir_op {
@@ -67,6 +68,11 @@ typedef enum ir_op {
     IR_GET,
     IR_SET,
 
+    // Loop-carried accumulators, see ir_builder
+    IR_BUILD,
+    IR_APPEND,
+    IR_FINISH,
+
     IR_PHI,
     IR_BLOCK,
 
@@ -74,10 +80,15 @@ typedef enum ir_op {
     IR_RESTORE,
 } ir_op_t;
 
+// GET/SET with a number index and range proven within the value's length
+#define IR_FLAG_IN_BOUNDS (1 << 0)
+
 typedef struct ir_instruction {
     ir_id_t result;
     ir_op_t op;
     ir_type_t type;
+    int position;
+    int flags;
 
     union {
         struct { // IR_*
@@ -132,6 +143,7 @@ typedef struct ir_block {
 
     ir_id_t* predecessors;
     int predecessor_count;
+    int predecessor_capacity;
 
     ir_id_t* successors;
     int successor_count;
@@ -139,9 +151,52 @@ typedef struct ir_block {
 
     ir_id_t follow_id;
 
+    // Linearized block order and liveness (see ir_cfg_order, ir_liveness)
+    int order;
+    ir_block_t* region;
+    ir_block_t* idom;
+    int from;
+    int to;
+    uint64_t* live_in;
+    uint64_t* live_out;
+
+    // Index into the function's memos when calls to this region are memoized, or -1
+    int memo;
+
+    // Where the compiled code for the block starts, see compile
+    void* native;
+
     arena_t* arena;
 } ir_block_t;
 
+/*
+ * A BLOCK body whose calls can be memoized, see ir_memo. Its result
+ * depends only on vars, of which the first write_count may be changed.
+ */
+typedef struct ir_memo {
+    ir_block_t* region;
+    ir_var_t* vars;
+    int var_count;
+    int write_count;
+} ir_memo_t;
+
+/*
+ * Def table (id -> instruction) and per-value use lists. Uses are
+ * recorded as the result id of the using instruction, so they stay
+ * valid when instruction arrays are compacted or reallocated; only
+ * the def table has to be refreshed (see ir_index_block).
+ */
+typedef struct ir_index {
+    ir_instruction_t** defs;
+    ir_block_t** owners;
+
+    ir_id_t** uses;
+    int* use_count;
+    int* use_capacity;
+
+    int size;
+} ir_index_t;
+
 typedef struct ir_function {
     ir_block_t** blocks;
     int block_count;
@@ -153,8 +208,25 @@ typedef struct ir_function {
     map_t* symbol_table;
     arena_t* arena;
     ir_var_t var_id;
+    cli_config_t* config;
 
     ir_block_t* block;
+    ir_index_t* index;
+
+    ir_block_t** block_table;
+    int block_table_size;
+
+    ir_block_t** order;
+    int order_count;
+
+    // Values live across blocks get a bit in live_in and live_out
+    int* live_names;
+    ir_id_t* live_ids;
+    int live_count;
+    int live_words;
+
+    ir_memo_t* memos;
+    int memo_count;
 } ir_function_t;
 
 typedef struct ir_worklist_item {
@@ -171,6 +243,8 @@ typedef struct ir_worklist {
 } ir_worklist_t;
 
 const char* debug_ir_op_string(ir_op_t op);
+ir_instruction_t* ir_emit(ir_op_t op, ir_function_t* function, ir_block_t* block);
+ir_block_t* ir_create_block(ir_function_t* function);
 ir_function_t* ir_create(ast_node_t* tree, arena_t* arena, map_t* symbol_table, cli_config_t* config);
 
 #endif
\ No newline at end of file
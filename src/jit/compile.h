@@ -4,63 +4,63 @@
 #include "ir.h"
 #include "opt.h"
 #include "jit/reg.h"
+#include "jit/value.h"
+#include "jit/heap.h"
 
 #include "dasm_proto.h"
 
 #if _WIN32
-    #include <Windows.h>
-    #define jalloc(size) VirtualAlloc(0, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE)
-    #define jprotect(ptr, size) {DWORD mprev; VirtualProtect(ptr, size, PAGE_EXECUTE_READWRITE, &mprev); }
     #define ARG_REG 1
     #define WIN_ABI
 #else
-    #include <sys/mman.h>
-    #if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
-        #define MAP_ANONYMOUS MAP_ANON
-    #endif
-    #define jalloc(size) mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
-    #define jprotect(ptr, size) mprotect(ptr, size, PROT_READ | PROT_WRITE | PROT_EXEC);
     #define ARG_REG 7
     #define POSIX_ABI
 #endif
 
+#define JIT_FALSE ((v_t) TYPE_BOOLEAN)
+#define JIT_TRUE ((v_t) (1 << 3) | TYPE_BOOLEAN)
+
+// Machine registers the arguments of a C call go in
+#ifdef WIN_ABI
+static const int jit_args[] = { 1, 2, 8, 9 };
+#define JIT_SHADOW 32
+#else
+static const int jit_args[] = { 7, 6, 2, 1 };
+#define JIT_SHADOW 0
+#endif
+
 static inline ir_instruction_t* jit_fetch(ir_function_t* ir, ir_id_t id) {
-    if (id < 0 || id >= ir->next_value_id) {
+    ir_instruction_t* instr = ir_fetch(ir, id);
+    if (!instr) {
         panic("Bad instruction fetch (fetch %d)", id);
     }
 
-    for (int b = 0; b < ir->block_count; b++) {
-        ir_block_t* block = ir->blocks[b];
-        for (int i = 0; i < block->instruction_count; i++) {
-            if (block->instructions[i].result == id) {
-                return &block->instructions[i];
-            }
-        }
-    }
-}
-
-static unsigned int pc(dasm_State** Dst, unsigned int cpc, unsigned int apc) {
-    if (apc <= cpc) {
-        apc *= 2;
-        dasm_growpc(Dst, apc);
-    }
-    
-    return cpc;
+    return instr;
 }
 
-static void* link(dasm_State** d) {
-    size_t size;
+// Encode the code into the code heap, size is set to the bytes it takes there
+static void* link(dasm_State** d, size_t* size) {
     void* ptr;
 
-    dasm_link(d, &size);
-    ptr = jalloc(size);
-    
+    dasm_link(d, size);
+    ptr = heap_alloc(*size);
+
+    heap_write(ptr, *size);
     dasm_encode(d, ptr);
-    jprotect(ptr, size);
+    heap_seal(ptr, *size);
 
     return ptr;
 }
 
 void* compile(ir_function_t* ir, reg_info_t reg_info);
 
+// Slow paths compiled code calls into, see x86_64.c
+v_t jit_not(v_t value);
+v_t jit_neg(v_t value);
+v_t jit_boolean(v_t value);
+v_t jit_random();
+void jit_quit(v_t value);
+void jit_output(v_t value);
+void jit_dump(v_t value);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,175 @@
+#ifndef JIT_OFF
+
+// MAP_ANONYMOUS is not part of strict C99
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "debug.h"
+#include "jit/heap.h"
+
+#if _WIN32
+    #include <Windows.h>
+#else
+    #include <sys/mman.h>
+    #include <unistd.h>
+    #if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+        #define MAP_ANONYMOUS MAP_ANON
+    #endif
+#endif
+
+// A free range of a segment, kept in address order so neighbours can be merged
+typedef struct heap_block {
+    char* ptr;
+    size_t size;
+    struct heap_block* next;
+} heap_block_t;
+
+static heap_block_t* heap_blocks = NULL;
+
+// What is left of the segment units are bumped out of
+static char* heap_top = NULL;
+static char* heap_limit = NULL;
+
+static size_t heap_page = 0;
+
+static size_t heap_round(size_t size, size_t to) {
+    return (size + to - 1) & ~(to - 1);
+}
+
+static size_t heap_page_size() {
+    if (!heap_page) {
+        #if _WIN32
+        SYSTEM_INFO system;
+        GetSystemInfo(&system);
+        heap_page = system.dwPageSize;
+        #else
+        heap_page = sysconf(_SC_PAGESIZE);
+        #endif
+    }
+
+    return heap_page;
+}
+
+// Segments start out executable, nothing is written to them before heap_write
+static char* heap_map(size_t size) {
+    #if _WIN32
+    char* ptr = VirtualAlloc(0, size, MEM_RESERVE | MEM_COMMIT, PAGE_EXECUTE_READ);
+    if (!ptr) panic("Failed to allocate memory for compiled code");
+    #else
+    char* ptr = mmap(0, size, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) panic("Failed to allocate memory for compiled code");
+    #endif
+
+    return ptr;
+}
+
+// Change the protection of every page ptr to ptr + size touches
+static void heap_protect(void* ptr, size_t size, int writable) {
+    size_t page = heap_page_size();
+    uintptr_t start = (uintptr_t) ptr & ~(page - 1);
+    size_t length = heap_round((uintptr_t) ptr + size, page) - start;
+
+    #if _WIN32
+    DWORD previous;
+    if (!VirtualProtect((void*) start, length, writable ? PAGE_READWRITE : PAGE_EXECUTE_READ, &previous)) {
+        panic("Failed to change protection of compiled code");
+    }
+    #else
+    if (mprotect((void*) start, length, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC)) {
+        panic("Failed to change protection of compiled code");
+    }
+    #endif
+}
+
+void* heap_alloc(size_t size) {
+    size = heap_round(size ? size : 1, HEAP_ALIGN);
+
+    // First fit among the ranges freed before
+    for (heap_block_t** link = &heap_blocks; *link; link = &(*link)->next) {
+        heap_block_t* block = *link;
+        if (block->size < size) continue;
+
+        char* ptr = block->ptr;
+        block->ptr += size;
+        block->size -= size;
+
+        if (!block->size) {
+            *link = block->next;
+            free(block);
+        }
+
+        return ptr;
+    }
+
+    if ((size_t) (heap_limit - heap_top) < size) {
+        size_t length = heap_round(size > HEAP_SEGMENT ? size : HEAP_SEGMENT, heap_page_size());
+        char* segment = heap_map(length);
+
+        // The rest of the old segment goes on the free list, first fit hands it out later
+        if (heap_top != heap_limit) heap_free(heap_top, heap_limit - heap_top);
+
+        heap_top = segment;
+        heap_limit = segment + length;
+    }
+
+    char* ptr = heap_top;
+    heap_top += size;
+
+    return ptr;
+}
+
+void heap_write(void* ptr, size_t size) {
+    heap_protect(ptr, size, 1);
+}
+
+void heap_seal(void* ptr, size_t size) {
+    heap_protect(ptr, size, 0);
+
+    #if defined(__GNUC__) || defined(__clang__)
+    __builtin___clear_cache((char*) ptr, (char*) ptr + size);
+    #endif
+}
+
+void heap_free(void* ptr, size_t size) {
+    char* start = ptr;
+    size = heap_round(size ? size : 1, HEAP_ALIGN);
+
+    heap_block_t* previous = NULL;
+    heap_block_t* next = heap_blocks;
+    while (next && next->ptr < start) {
+        previous = next;
+        next = next->next;
+    }
+
+    if (previous && previous->ptr + previous->size == start) {
+        previous->size += size;
+
+        if (next && previous->ptr + previous->size == next->ptr) {
+            previous->size += next->size;
+            previous->next = next->next;
+            free(next);
+        }
+
+        return;
+    }
+
+    if (next && start + size == next->ptr) {
+        next->ptr = start;
+        next->size += size;
+        return;
+    }
+
+    heap_block_t* block = malloc(sizeof(heap_block_t));
+    if (!block) panic("Failed to allocate memory for code heap");
+
+    block->ptr = start;
+    block->size = size;
+    block->next = next;
+
+    if (previous) previous->next = block;
+    else heap_blocks = block;
+}
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <stddef.h>
+
+// Size of the regions compiled code is carved out of, larger units get a region of their own
+#define HEAP_SEGMENT (1 << 20)
+// Units start on a cache line, so a hot entry does not share its first fetch with another unit
+#define HEAP_ALIGN 64
+
+/*
+ * Memory for compiled code. It is never writable and executable at the
+ * same time: heap_write makes a unit's pages writable, heap_seal makes
+ * them executable again once the code is in. Units freed are reused by
+ * later ones.
+ */
+void* heap_alloc(size_t size);
+void heap_write(void* ptr, size_t size);
+void heap_seal(void* ptr, size_t size);
+void heap_free(void* ptr, size_t size);
+
+#endif
@@ -1,61 +1,695 @@
+#include <limits.h>
+
 #include "opt.h"
 
 #include "jit/reg.h"
-#define REGISTERS (16 - 4)
 
-reg_info_t reg_allocate(ir_function_t* ir, opt_liveness_t* liveness) {
-    int alloc[REGISTERS];
-    for (int i = 0; i < REGISTERS; i++) {
-        alloc[i] = 0;
+/*
+ * Linear scan over the live intervals from ir_liveness, after Wimmer
+ * and Franz. Intervals are split where a register runs out instead of
+ * being spilled whole, and the pieces are tied back together by moves
+ * inside blocks (reg_info_t.moves) and on edges (see jit_edge).
+ */
+typedef struct reg_state {
+    ir_function_t* ir;
+    opt_liveness_t* liveness;
+    reg_info_t* info;
+    int capacity;
+
+    // Sorted positions each value is read at
+    int** uses;
+    int* use_count;
+
+    // Positions of the instructions reg_clobbers holds for
+    int* calls;
+    int call_count;
+
+    // A value to try to share a register with, or -1
+    ir_id_t* hints;
+
+    int* unhandled;
+    int unhandled_count;
+    int* active;
+    int active_count;
+    int* inactive;
+    int inactive_count;
+
+    // Per value its spill slot, and per slot where its value's interval ends
+    int* value_slot;
+    int* slot_end;
+} reg_state_t;
+
+static int reg_covers(reg_interval_t* interval, int position) {
+    for (int i = 0; i < interval->range_count; i++) {
+        if (interval->ranges[i].start > position) return 0;
+        if (interval->ranges[i].end > position) return 1;
+    }
+
+    return 0;
+}
+
+// First position both intervals cover, or INT_MAX
+static int reg_intersect(reg_interval_t* a, reg_interval_t* b) {
+    int i = 0;
+    int j = 0;
+
+    while (i < a->range_count && j < b->range_count) {
+        opt_range_t* x = &a->ranges[i];
+        opt_range_t* y = &b->ranges[j];
+
+        int start = x->start > y->start ? x->start : y->start;
+        if (start < x->end && start < y->end) return start;
+
+        if (x->end <= y->end) i++;
+        else j++;
+    }
+
+    return INT_MAX;
+}
+
+// Odd position to split at so that the first piece ends by limit
+static int reg_before(int limit) {
+    return limit & 1 ? limit : limit - 1;
+}
+
+static int reg_next_use(reg_state_t* state, reg_interval_t* interval, int from) {
+    int* uses = state->uses[interval->id];
+    int count = state->use_count[interval->id];
+
+    int low = 0;
+    int high = count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (uses[mid] < from) low = mid + 1;
+        else high = mid;
+    }
+
+    if (low < count && uses[low] < interval->end) return uses[low];
+    return INT_MAX;
+}
+
+/*
+ * First call the interval is live across, where it may not sit in a
+ * REG_VOLATILE register. A value read or defined by the call itself is
+ * not live across it.
+ */
+static int reg_crossing(reg_state_t* state, reg_interval_t* interval) {
+    opt_liveness_t* live = &state->liveness[interval->id];
+
+    int low = 0;
+    int high = state->call_count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (state->calls[mid] < interval->start) low = mid + 1;
+        else high = mid;
+    }
+
+    for (int c = low; c < state->call_count && state->calls[c] < interval->end; c++) {
+        int position = state->calls[c];
+        if (position != live->start && reg_covers(interval, position) && ir_covers(live, position + 1)) return position;
+    }
+
+    return INT_MAX;
+}
+
+static void reg_push(reg_state_t* state, int index) {
+    reg_interval_t* intervals = state->info->intervals;
+    int* heap = state->unhandled;
+    int i = state->unhandled_count++;
+
+    heap[i] = index;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (intervals[heap[parent]].start <= intervals[heap[i]].start) break;
+
+        int swap = heap[parent];
+        heap[parent] = heap[i];
+        heap[i] = swap;
+        i = parent;
+    }
+}
+
+static int reg_pop(reg_state_t* state) {
+    reg_interval_t* intervals = state->info->intervals;
+    int* heap = state->unhandled;
+    int top = heap[0];
+
+    heap[0] = heap[--state->unhandled_count];
+
+    int i = 0;
+    while (1) {
+        int least = i;
+        int left = 2 * i + 1;
+        int right = 2 * i + 2;
+
+        if (left < state->unhandled_count && intervals[heap[left]].start < intervals[heap[least]].start) least = left;
+        if (right < state->unhandled_count && intervals[heap[right]].start < intervals[heap[least]].start) least = right;
+        if (least == i) break;
+
+        int swap = heap[least];
+        heap[least] = heap[i];
+        heap[i] = swap;
+        i = least;
+    }
+
+    return top;
+}
+
+static int reg_create(reg_state_t* state, ir_id_t id) {
+    reg_info_t* info = state->info;
+
+    if (info->interval_count >= state->capacity) {
+        state->capacity *= 2;
+        info->intervals = realloc(info->intervals, sizeof(reg_interval_t) * state->capacity);
+        state->unhandled = realloc(state->unhandled, sizeof(int) * state->capacity);
+        state->active = realloc(state->active, sizeof(int) * state->capacity);
+        state->inactive = realloc(state->inactive, sizeof(int) * state->capacity);
+        if (!info->intervals || !state->unhandled || !state->active || !state->inactive) panic("Failed to allocate memory for live intervals");
+    }
+
+    reg_interval_t* interval = &info->intervals[info->interval_count];
+    interval->id = id;
+    interval->start = -1;
+    interval->end = -1;
+    interval->split = -1;
+    interval->ranges = NULL;
+    interval->range_count = 0;
+    interval->reg = -1;
+    interval->slot = -1;
+    interval->next = -1;
+
+    return info->interval_count++;
+}
+
+/*
+ * Split the interval at the odd position at, which has to fall after
+ * its start. The piece from at on is returned, or -1 if nothing of the
+ * interval is left there.
+ */
+static int reg_split(reg_state_t* state, int index, int at) {
+    reg_interval_t* interval = &state->info->intervals[index];
+
+    int r = 0;
+    while (r < interval->range_count && interval->ranges[r].end <= at) r++;
+    if (r == interval->range_count) return -1;
+
+    int child = reg_create(state, interval->id);
+    reg_interval_t* parent = &state->info->intervals[index];
+    reg_interval_t* piece = &state->info->intervals[child];
+
+    int count = parent->range_count - r;
+    piece->ranges = malloc(sizeof(opt_range_t) * count);
+    if (!piece->ranges) panic("Failed to allocate memory for live intervals");
+
+    memcpy(piece->ranges, parent->ranges + r, sizeof(opt_range_t) * count);
+    piece->range_count = count;
+
+    if (piece->ranges[0].start < at) {
+        piece->ranges[0].start = at;
+        parent->ranges[r].end = at;
+        parent->range_count = r + 1;
+    } else {
+        parent->range_count = r;
+    }
+
+    piece->start = piece->ranges[0].start;
+    piece->end = piece->ranges[count - 1].end;
+    piece->split = at;
+    piece->next = parent->next;
+
+    parent->end = parent->ranges[parent->range_count - 1].end;
+    parent->next = child;
+
+    return child;
+}
+
+static void reg_spill(reg_state_t* state, int index) {
+    reg_interval_t* interval = &state->info->intervals[index];
+    opt_liveness_t* live = &state->liveness[interval->id];
+    int* slot = &state->value_slot[interval->id];
+
+    if (*slot < 0) {
+        for (int s = 0; s < state->info->max_slot; s++) {
+            if (state->slot_end[s] <= live->start) {
+                *slot = s;
+                break;
+            }
+        }
+
+        if (*slot < 0) *slot = state->info->max_slot++;
+        state->slot_end[*slot] = live->end;
+    }
+
+    interval->reg = -1;
+    interval->slot = *slot;
+}
+
+/*
+ * Leave the piece from at on in memory up to its next use, the rest
+ * competes for a register again. Only pieces starting after after are
+ * queued, linear scan has moved past anything earlier.
+ */
+static void reg_evict(reg_state_t* state, int index, int at, int after) {
+    int child = reg_split(state, index, at);
+    if (child < 0) return;
+
+    int use = reg_next_use(state, &state->info->intervals[child], state->info->intervals[child].start);
+    int rest = -1;
+
+    if (use != INT_MAX && reg_before(use) > state->info->intervals[child].start && reg_before(use) > after) {
+        rest = reg_split(state, child, reg_before(use));
+    }
+
+    reg_spill(state, child);
+    if (rest >= 0) reg_push(state, rest);
+}
+
+static int reg_hint(reg_state_t* state, int index) {
+    reg_info_t* info = state->info;
+    reg_interval_t* interval = &info->intervals[index];
+
+    // Keep a split value where it was, so no move is needed
+    for (int i = info->first[interval->id]; i >= 0; i = info->intervals[i].next) {
+        if (info->intervals[i].next == index) return info->intervals[i].reg;
+    }
+
+    ir_id_t other = state->hints[interval->id];
+    if (other >= 0 && info->first[other] >= 0) return info->intervals[info->first[other]].reg;
+
+    return -1;
+}
+
+static int reg_try(reg_state_t* state, int index) {
+    reg_interval_t* intervals = state->info->intervals;
+    reg_interval_t* current = &intervals[index];
+
+    int free_until[REGISTERS];
+    for (int r = 0; r < REGISTERS; r++) {
+        free_until[r] = INT_MAX;
     }
 
-    regs_t* regs = malloc(sizeof(uint64_t) * ir->next_value_id);
+    for (int a = 0; a < state->active_count; a++) {
+        free_until[intervals[state->active[a]].reg] = 0;
+    }
+
+    for (int i = 0; i < state->inactive_count; i++) {
+        reg_interval_t* other = &intervals[state->inactive[i]];
+        int at = reg_intersect(other, current);
+        if (at < free_until[other->reg]) free_until[other->reg] = at;
+    }
+
+    int crossing = reg_crossing(state, current);
+    for (int r = 0; r < REGISTERS; r++) {
+        if ((REG_VOLATILE >> r) & 1 && crossing < free_until[r]) free_until[r] = crossing;
+    }
+
+    int hint = reg_hint(state, index);
+    int reg = 0;
+
+    if (hint >= 0 && free_until[hint] >= current->end) {
+        reg = hint;
+    } else {
+        for (int r = 1; r < REGISTERS; r++) {
+            if (free_until[r] > free_until[reg]) reg = r;
+        }
+    }
+
+    if (free_until[reg] >= current->end) {
+        current->reg = reg;
+        return 1;
+    }
+
+    int at = reg_before(free_until[reg]);
+    if (at <= current->start) return 0;
 
-    int stack_slot = 0;
-    for (int i = 0; i < ir->next_value_id; i++) {
-        regs[i].reg = -1;
-        regs[i].slot = -1;
+    int child = reg_split(state, index, at);
+    intervals = state->info->intervals;
+    intervals[index].reg = reg;
+    if (child >= 0) reg_push(state, child);
+
+    return 1;
+}
+
+/*
+ * No register is free for the whole of current. Take the one whose
+ * holders are next needed furthest away, or leave current in memory up
+ * to its own first use if that comes later still.
+ */
+static void reg_blocked(reg_state_t* state, int index) {
+    reg_interval_t* intervals = state->info->intervals;
+    reg_interval_t* current = &intervals[index];
+    int start = current->start;
+
+    int use_pos[REGISTERS];
+    int block_pos[REGISTERS];
+    for (int r = 0; r < REGISTERS; r++) {
+        use_pos[r] = INT_MAX;
+        block_pos[r] = INT_MAX;
+    }
+
+    for (int a = 0; a < state->active_count; a++) {
+        reg_interval_t* other = &intervals[state->active[a]];
+        int use = reg_next_use(state, other, start);
+        if (use < use_pos[other->reg]) use_pos[other->reg] = use;
+    }
+
+    for (int i = 0; i < state->inactive_count; i++) {
+        reg_interval_t* other = &intervals[state->inactive[i]];
+        if (reg_intersect(other, current) == INT_MAX) continue;
+
+        int use = reg_next_use(state, other, start);
+        if (use < use_pos[other->reg]) use_pos[other->reg] = use;
+    }
+
+    int crossing = reg_crossing(state, current);
+    for (int r = 0; r < REGISTERS; r++) {
+        if (!((REG_VOLATILE >> r) & 1) || crossing == INT_MAX) continue;
+
+        block_pos[r] = crossing;
+        if (crossing < use_pos[r]) use_pos[r] = crossing;
     }
 
-    for (int b = 0; b < ir->block_count; b++) {
-        ir_block_t* block = ir->blocks[b];
-        for (int i = block->instruction_count - 1; i >= 0; i--) {
+    int reg = 0;
+    for (int r = 1; r < REGISTERS; r++) {
+        if (use_pos[r] > use_pos[reg]) reg = r;
+    }
+
+    int first = reg_next_use(state, current, start);
+
+    if (use_pos[reg] <= first || reg_before(block_pos[reg]) <= start) {
+        int at = first == INT_MAX ? -1 : reg_before(first);
+        int rest = at > start ? reg_split(state, index, at) : -1;
+
+        reg_spill(state, index);
+        if (rest >= 0) reg_push(state, rest);
+        return;
+    }
+
+    current->reg = reg;
+    int at = reg_before(start);
+
+    for (int a = 0; a < state->active_count; a++) {
+        int other = state->active[a];
+        if (intervals[other].reg != reg) continue;
+
+        state->active[a--] = state->active[--state->active_count];
+        if (at <= intervals[other].start) {
+            reg_spill(state, other);
+        } else {
+            reg_evict(state, other, at, start);
+        }
+
+        intervals = state->info->intervals;
+    }
+
+    for (int i = 0; i < state->inactive_count; i++) {
+        int other = state->inactive[i];
+        if (intervals[other].reg != reg || reg_intersect(&intervals[other], &intervals[index]) == INT_MAX) continue;
+
+        state->inactive[i--] = state->inactive[--state->inactive_count];
+        if (at <= intervals[other].start) {
+            reg_spill(state, other);
+        } else {
+            reg_evict(state, other, at, start);
+        }
+
+        intervals = state->info->intervals;
+    }
+
+    if (block_pos[reg] < intervals[index].end) {
+        int child = reg_split(state, index, reg_before(block_pos[reg]));
+        if (child >= 0) reg_push(state, child);
+    }
+}
+
+static void reg_use(reg_state_t* state, int* capacity, ir_id_t value, int position) {
+    int count = state->use_count[value];
+
+    if (count >= capacity[value]) {
+        capacity[value] = capacity[value] ? capacity[value] * 2 : 2;
+        state->uses[value] = realloc(state->uses[value], sizeof(int) * capacity[value]);
+        if (!state->uses[value]) panic("Failed to allocate memory for use positions");
+    }
+
+    state->uses[value][state->use_count[value]++] = position;
+}
+
+static int reg_compare(const void* a, const void* b) {
+    return *(const int*) a - *(const int*) b;
+}
+
+static int reg_compare_moves(const void* a, const void* b) {
+    return ((const reg_move_t*) a)->position - ((const reg_move_t*) b)->position;
+}
+
+static int reg_allocatable(ir_instruction_t* instr) {
+    return instr && !ir_is_constant(instr) && instr->op != IR_BLOCK;
+}
+
+/* Use positions, hints and call positions, in one pass over the order */
+static void reg_prepare(reg_state_t* state) {
+    ir_function_t* ir = state->ir;
+    int n = ir->next_value_id;
+
+    int* capacity = calloc(n + 1, sizeof(int));
+    if (!capacity) panic("Failed to allocate memory for use positions");
+
+    for (int o = 0; o < ir->order_count; o++) {
+        ir_block_t* block = ir->order[o];
+
+        for (int i = 0; i < block->instruction_count; i++) {
             ir_instruction_t* instr = &block->instructions[i];
-            ir_id_t result = instr->result;
-            opt_liveness_t lifetime = liveness[result];
-            
-            if (lifetime.end == -1) continue;
-            if (instr->op == IR_BLOCK || instr->op == IR_CONST_NULL || instr->op == IR_CONST_BOOLEAN || instr->op == IR_CONST_NUMBER) continue;
-
-            // Free registers for values whose lifetime ends at this instruction
-            for (int p = 0; p < ir->next_value_id; p++) {
-                if (liveness[p].end == i) {
-                    int reg = regs[p].reg;
-                    if (reg != -1) {
-                        alloc[reg] = 0;
-                    }
+
+            if (reg_clobbers(instr)) state->calls[state->call_count++] = instr->position;
+
+            if (instr->op == IR_PHI) {
+                for (int k = 0; k < instr->phi.phi_count; k++) {
+                    ir_id_t value = instr->phi.phi_values[k];
+                    if (value < 0 || value >= n) continue;
+
+                    reg_use(state, capacity, value, instr->phi.phi_blocks[k]->to - 2);
+                    if (state->hints[instr->result] < 0 && reg_allocatable(ir_fetch(ir, value))) state->hints[instr->result] = value;
+                    if (state->hints[value] < 0) state->hints[value] = instr->result;
                 }
+                continue;
+            }
+
+            for (int k = 0; k < ir_operand_count(instr); k++) {
+                ir_id_t value = *ir_operand(instr, k);
+                if (value >= 0 && value < n) reg_use(state, capacity, value, instr->position);
             }
+        }
+    }
+
+    for (int v = 0; v < n; v++) {
+        if (state->use_count[v] > 1) qsort(state->uses[v], state->use_count[v], sizeof(int), reg_compare);
+    }
+
+    free(capacity);
+}
+
+/* Moves between split pieces, and the registers live across each instruction */
+static void reg_finish(reg_state_t* state) {
+    reg_info_t* info = state->info;
+    int n = state->ir->next_value_id;
+
+    info->moves = malloc(sizeof(reg_move_t) * (info->interval_count + 1));
+    info->across = calloc(info->positions / 2 + 1, sizeof(uint16_t));
+    if (!info->moves || !info->across) panic("Failed to allocate memory for register allocation");
+
+    for (int v = 0; v < n; v++) {
+        int first = info->first[v];
+        if (first < 0) continue;
+
+        opt_liveness_t* live = &state->liveness[v];
+        info->regs[v] = (regs_t) { info->intervals[first].reg, info->intervals[first].slot };
 
-            int reg = -1;
-            for (int r = 0; r < REGISTERS; r++) {
-                if (!alloc[r]) {
-                    reg = r;
-                    break;
+        for (int i = first; i >= 0; i = info->intervals[i].next) {
+            reg_interval_t* interval = &info->intervals[i];
+            int next = interval->next;
+
+            if (next >= 0) {
+                reg_interval_t* piece = &info->intervals[next];
+                regs_t from = { interval->reg, interval->slot };
+                regs_t to = { piece->reg, piece->slot };
+
+                if (!reg_same(from, to) && ir_covers(live, piece->split)) {
+                    info->moves[info->move_count++] = (reg_move_t) { piece->split, v, from, to };
                 }
             }
 
-            if (reg == -1) {
-                regs[result].slot = stack_slot++;
-            } else {
-                alloc[reg] = 1;
-                regs[result].reg = reg;
+            if (interval->reg < 0) continue;
+
+            for (int r = 0; r < interval->range_count; r++) {
+                opt_range_t* range = &interval->ranges[r];
+
+                for (int position = (range->start + 1) & ~1; position < range->end; position += 2) {
+                    if (position != live->start && ir_covers(live, position + 1)) info->across[position / 2] |= 1 << interval->reg;
+                }
             }
         }
     }
 
-    return (reg_info_t) {
-        .regs = regs,
-        .max_slot = stack_slot
-    };
-}
\ No newline at end of file
+    qsort(info->moves, info->move_count, sizeof(reg_move_t), reg_compare_moves);
+}
+
+#ifdef DEBUG
+/*
+ * No two pieces share a register, and no two values a slot, while both
+ * are live. Nothing live across a call is in a REG_VOLATILE register.
+ */
+static void reg_verify(reg_state_t* state) {
+    reg_info_t* info = state->info;
+
+    for (int a = 0; a < info->interval_count; a++) {
+        reg_interval_t* x = &info->intervals[a];
+        if (x->reg < 0 && x->slot < 0) panic("Interval of %d has no location", x->id);
+
+        if (x->reg >= 0 && (REG_VOLATILE >> x->reg) & 1 && reg_crossing(state, x) != INT_MAX) {
+            panic("Value %d is in register %d across the call at %d", x->id, x->reg, reg_crossing(state, x));
+        }
+
+        for (int b = a + 1; b < info->interval_count; b++) {
+            reg_interval_t* y = &info->intervals[b];
+            if (x->id == y->id) continue;
+
+            if (x->reg >= 0 && x->reg == y->reg && reg_intersect(x, y) != INT_MAX) {
+                panic("Values %d and %d share register %d at %d", x->id, y->id, x->reg, reg_intersect(x, y));
+            }
+
+            if (x->slot >= 0 && x->slot == y->slot && reg_intersect(x, y) != INT_MAX) {
+                panic("Values %d and %d share slot %d at %d", x->id, y->id, x->slot, reg_intersect(x, y));
+            }
+        }
+    }
+}
+#endif
+
+reg_info_t reg_allocate(ir_function_t* ir, opt_liveness_t* liveness) {
+    int n = ir->next_value_id;
+    reg_info_t info = { 0 };
+
+    reg_state_t state = { 0 };
+    state.ir = ir;
+    state.liveness = liveness;
+    state.info = &info;
+    state.capacity = 2 * n + 16;
+
+    info.regs = malloc(sizeof(regs_t) * (n + 1));
+    info.first = malloc(sizeof(int) * (n + 1));
+    info.intervals = malloc(sizeof(reg_interval_t) * state.capacity);
+
+    state.uses = calloc(n + 1, sizeof(int*));
+    state.use_count = calloc(n + 1, sizeof(int));
+    state.hints = malloc(sizeof(ir_id_t) * (n + 1));
+    state.value_slot = malloc(sizeof(int) * (n + 1));
+    state.slot_end = malloc(sizeof(int) * (n + 1));
+    state.unhandled = malloc(sizeof(int) * state.capacity);
+    state.active = malloc(sizeof(int) * state.capacity);
+    state.inactive = malloc(sizeof(int) * state.capacity);
+
+    int instructions = 0;
+    for (int o = 0; o < ir->order_count; o++) {
+        instructions += ir->order[o]->instruction_count;
+        if (ir->order[o]->to > info.positions) info.positions = ir->order[o]->to;
+    }
+
+    state.calls = malloc(sizeof(int) * (instructions + 1));
+
+    if (!info.regs || !info.first || !info.intervals || !state.uses || !state.use_count || !state.hints
+        || !state.value_slot || !state.slot_end || !state.unhandled || !state.active || !state.inactive || !state.calls) {
+        panic("Failed to allocate memory for register allocation");
+    }
+
+    for (int v = 0; v < n; v++) {
+        info.regs[v] = (regs_t) { -1, -1 };
+        info.first[v] = -1;
+        state.hints[v] = -1;
+        state.value_slot[v] = -1;
+    }
+
+    reg_prepare(&state);
+
+    // Constants and BLOCK values are loaded where they are used
+    for (int v = 0; v < n; v++) {
+        opt_liveness_t* live = &liveness[v];
+        if (!live->range_count || !state.use_count[v] || !reg_allocatable(ir_fetch(ir, v))) continue;
+
+        int index = reg_create(&state, v);
+        reg_interval_t* interval = &info.intervals[index];
+
+        interval->ranges = malloc(sizeof(opt_range_t) * live->range_count);
+        if (!interval->ranges) panic("Failed to allocate memory for live intervals");
+
+        memcpy(interval->ranges, live->ranges, sizeof(opt_range_t) * live->range_count);
+        interval->range_count = live->range_count;
+        interval->start = live->start;
+        interval->end = live->end;
+
+        info.first[v] = index;
+        reg_push(&state, index);
+    }
+
+    while (state.unhandled_count > 0) {
+        int index = reg_pop(&state);
+        reg_interval_t* intervals = info.intervals;
+        int position = intervals[index].start;
+
+        for (int a = 0; a < state.active_count; a++) {
+            reg_interval_t* other = &intervals[state.active[a]];
+            if (other->end <= position) {
+                state.active[a--] = state.active[--state.active_count];
+            } else if (!reg_covers(other, position)) {
+                state.inactive[state.inactive_count++] = state.active[a];
+                state.active[a--] = state.active[--state.active_count];
+            }
+        }
+
+        for (int i = 0; i < state.inactive_count; i++) {
+            reg_interval_t* other = &intervals[state.inactive[i]];
+            if (other->end <= position) {
+                state.inactive[i--] = state.inactive[--state.inactive_count];
+            } else if (reg_covers(other, position)) {
+                state.active[state.active_count++] = state.inactive[i];
+                state.inactive[i--] = state.inactive[--state.inactive_count];
+            }
+        }
+
+        if (!reg_try(&state, index)) reg_blocked(&state, index);
+        if (info.intervals[index].reg >= 0) state.active[state.active_count++] = index;
+    }
+
+    reg_finish(&state);
+
+    #ifdef DEBUG
+    reg_verify(&state);
+    #endif
+
+    for (int v = 0; v < n; v++) {
+        free(state.uses[v]);
+    }
+
+    free(state.uses);
+    free(state.use_count);
+    free(state.calls);
+    free(state.hints);
+    free(state.value_slot);
+    free(state.slot_end);
+    free(state.unhandled);
+    free(state.active);
+    free(state.inactive);
+
+    return info;
+}
+
+void reg_free(reg_info_t* info) {
+    for (int i = 0; i < info->interval_count; i++) {
+        free(info->intervals[i].ranges);
+    }
+
+    free(info->intervals);
+    free(info->regs);
+    free(info->first);
+    free(info->moves);
+    free(info->across);
+}
@@ -5,19 +5,113 @@
 #include "ir.h"
 #include "opt.h"
 
+// Registers handed out, see jit_reg for the machine registers they are
+#define REGISTERS (16 - 4)
+
+// Allocator registers a C call may overwrite (rax, rcx, rdx and r8 to r11)
+#define REG_VOLATILE 0x0F7
+
 /*
- * regs_t (high bits -> stack slot)(low bits -> register number)
+ * Location of a value: a register number, or else a stack slot, or
+ * neither for constants and values that are never used.
  */
 typedef struct regs {
     int reg;
     int slot;
 } regs_t;
 
+/*
+ * A piece of a value's live interval that stays in one location. When
+ * a value is split, its pieces are chained through next in position
+ * order and the move into a piece happens at split, the odd position
+ * before the instruction it precedes.
+ */
+typedef struct reg_interval {
+    ir_id_t id;
+    int start;
+    int end;
+    int split;
+
+    opt_range_t* ranges;
+    int range_count;
+
+    int reg;
+    int slot;
+    int next;
+} reg_interval_t;
+
+// A move between the pieces of a split value, done before the instruction at position + 1
+typedef struct reg_move {
+    int position;
+    ir_id_t id;
+    regs_t from;
+    regs_t to;
+} reg_move_t;
+
 typedef struct reg_info {
+    // Where each value is defined
     regs_t* regs;
     int max_slot;
+
+    reg_interval_t* intervals;
+    int interval_count;
+    int* first;
+
+    reg_move_t* moves;
+    int move_count;
+
+    // Per instruction (position / 2), the registers holding values live across it
+    uint16_t* across;
+    int positions;
 } reg_info_t;
 
+/*
+ * Instructions whose code always calls into C. Values live across one
+ * are kept out of REG_VOLATILE, so the call does not have to save them.
+ */
+static inline int reg_clobbers(ir_instruction_t* instr) {
+    switch (instr->op) {
+        case IR_DIV: case IR_MOD: case IR_POW:
+        case IR_ASCII: case IR_BOX: case IR_PRIME: case IR_ULTIMATE:
+        case IR_GET: case IR_SET:
+        case IR_BUILD: case IR_APPEND: case IR_FINISH:
+        case IR_PROMPT: case IR_RANDOM: case IR_OUTPUT: case IR_DUMP: case IR_QUIT:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Location of value id at position, the piece covering it
+static inline regs_t reg_at(reg_info_t* info, ir_id_t id, int position) {
+    int i = info->first[id];
+    if (i < 0) return (regs_t) { -1, -1 };
+
+    while (info->intervals[i].next >= 0 && info->intervals[info->intervals[i].next].start <= position) {
+        i = info->intervals[i].next;
+    }
+
+    return (regs_t) { info->intervals[i].reg, info->intervals[i].slot };
+}
+
+// Whether value id is live at position, in any of its pieces
+static inline int reg_live(reg_info_t* info, ir_id_t id, int position) {
+    for (int i = info->first[id]; i >= 0; i = info->intervals[i].next) {
+        reg_interval_t* interval = &info->intervals[i];
+
+        for (int r = 0; r < interval->range_count; r++) {
+            if (interval->ranges[r].start <= position && position < interval->ranges[r].end) return 1;
+        }
+    }
+
+    return 0;
+}
+
+static inline int reg_same(regs_t a, regs_t b) {
+    return a.reg == b.reg && a.slot == b.slot;
+}
+
 reg_info_t reg_allocate(ir_function_t* ir, opt_liveness_t* liveness);
+void reg_free(reg_info_t* info);
 
-#endif
\ No newline at end of file
+#endif
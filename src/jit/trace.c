@@ -0,0 +1,403 @@
+#if defined(JIT_ON) && defined(X64)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+
+#include "compile.h"
+#include "trace.h"
+
+#include "value.h"
+#include "vm.h"
+
+| .arch x64
+
+/*
+ * Traces work on the VM's own arrays, so a guard that fails only has to
+ * say where the VM picks up. rbx holds its values and r12 its variables.
+ */
+| .define values, rbx
+| .define vars, r12
+
+| .macro epilogue
+| add rsp, 8 + JIT_SHADOW
+| pop r12
+| pop rbx
+| ret
+| .endmacro
+
+static int trace_offset(ir_id_t id) {
+    return id * 8;
+}
+
+// Constants are not recorded, the VM skips over them
+static int trace_number(ir_function_t* function, char* numbers, ir_id_t id) {
+    return numbers[id] || jit_fetch(function, id)->op == IR_CONST_NUMBER;
+}
+
+/*
+ * Add an exit continuing at instruction index of block, returning the
+ * label trace_compile emits its stub at.
+ */
+static int trace_exit(trace_t* trace, ir_block_t* block, int index, ir_block_t* previous) {
+    trace_exit_t* out = &trace->exits[trace->exit_count];
+
+    out->trace = trace;
+    out->block = block;
+    out->previous = previous;
+    out->index = index;
+    out->hits = 0;
+    out->link = NULL;
+
+    return trace->exit_count++;
+}
+
+// Call fn with the first count operands of instr, storing the result unless store is 0
+static void trace_call(dasm_State** Dst, ir_instruction_t* instr, uint64_t fn, int count, int store) {
+    for (int k = 0; k < count; k++) {
+        int offset = trace_offset(instr->generic.operands[k]);
+        | mov Rq(jit_args[k]), [values + offset]
+    }
+
+    | mov64 rax, fn
+    | call rax
+
+    if (store) {
+        int offset = trace_offset(instr->result);
+        | mov [values + offset], rax
+    }
+}
+
+/*
+ * ADD, SUB, MUL, LT and GT inline when both operands were numbers while
+ * recording, with a guard on those not already known to be. Otherwise
+ * the trace calls fn like the VM would. numbers holds what is known to
+ * be a number so far, the result of a guarded ADD, SUB or MUL included.
+ */
+static void trace_arith(dasm_State** Dst, ir_function_t* function, trace_t* trace, trace_step_t* step, char* numbers, uint64_t fn) {
+    ir_instruction_t* instr = step->instruction;
+    ir_id_t left = instr->generic.operands[0];
+    ir_id_t right = instr->generic.operands[1];
+
+    int known_left = trace_number(function, numbers, left);
+    int known_right = trace_number(function, numbers, right);
+
+    if (step->types[0] != TYPE_NUMBER || step->types[1] != TYPE_NUMBER) {
+        trace_call(Dst, instr, fn, 2, 1);
+        return;
+    }
+
+    int guard = -1;
+    if (!known_left || !known_right) {
+        guard = trace_exit(trace, step->block, (int) (instr - step->block->instructions), NULL);
+    }
+
+    int offset = trace_offset(left);
+    | mov rax, [values + offset]
+    offset = trace_offset(right);
+    | mov rcx, [values + offset]
+
+    if (!known_left) {
+        | test rax, TYPE_MASK
+        | jnz =>guard
+    }
+
+    if (!known_right) {
+        | test rcx, TYPE_MASK
+        | jnz =>guard
+    }
+
+    switch (instr->op) {
+        case IR_ADD:
+            | add rax, rcx
+            break;
+        case IR_SUB:
+            | sub rax, rcx
+            break;
+        case IR_MUL:
+            | sar rcx, 3
+            | imul rax, rcx
+            break;
+        case IR_LT:
+            | cmp rax, rcx
+            | mov rax, JIT_FALSE
+            | mov rcx, JIT_TRUE
+            | cmovl rax, rcx
+            break;
+        case IR_GT:
+            | cmp rax, rcx
+            | mov rax, JIT_FALSE
+            | mov rcx, JIT_TRUE
+            | cmovg rax, rcx
+            break;
+        default:
+            panic("Bad arithmetic op %s", debug_ir_op_string(instr->op));
+    }
+
+    offset = trace_offset(instr->result);
+    | mov [values + offset], rax
+
+    if (instr->op != IR_LT && instr->op != IR_GT) numbers[instr->result] = 1;
+}
+
+// Leave the trace unless the condition goes the way it went while recording
+static void trace_branch(dasm_State** Dst, trace_t* trace, trace_step_t* step) {
+    ir_instruction_t* instr = step->instruction;
+    ir_block_t* other = step->taken ? instr->branch.falsey : instr->branch.truthy;
+
+    int guard = trace_exit(trace, other, 0, step->block);
+    int offset = trace_offset(instr->branch.condition);
+
+    | mov Rq(jit_args[0]), [values + offset]
+
+    if (step->taken) {
+        | cmp Rq(jit_args[0]), JIT_TRUE
+        | je >1
+        | cmp Rq(jit_args[0]), JIT_FALSE
+        | je =>guard
+        | mov64 rax, (uint64_t) jit_boolean
+        | call rax
+        | cmp rax, JIT_TRUE
+        | jne =>guard
+        | 1:
+    } else {
+        | cmp Rq(jit_args[0]), JIT_TRUE
+        | je =>guard
+        | cmp Rq(jit_args[0]), JIT_FALSE
+        | je >1
+        | mov64 rax, (uint64_t) jit_boolean
+        | call rax
+        | cmp rax, JIT_TRUE
+        | je =>guard
+        | 1:
+    }
+}
+
+/*
+ * Compile the path the VM recorded. A root trace loops back to its own
+ * top, a side trace, recorded from the exit from, is jumped to by that
+ * exit and ends by jumping to the top of its root trace.
+ */
+trace_t* trace_compile(ir_function_t* function, trace_step_t* steps, int count, trace_exit_t* from) {
+    dasm_State* d;
+
+    trace_t* trace = malloc(sizeof(trace_t));
+    if (!trace) panic("Failed to allocate memory for trace");
+
+    trace->root = from ? from->trace->root : trace;
+    trace->header = trace->root == trace ? steps[0].block : trace->root->header;
+    trace->exits = malloc(sizeof(trace_exit_t) * (count + 1));
+    trace->exit_count = 0;
+    trace->next = NULL;
+    trace->side_count = 0;
+    if (!trace->exits) panic("Failed to allocate memory for trace exits");
+
+    char* numbers = calloc(function->next_value_id, sizeof(char));
+    if (!numbers) panic("Failed to allocate memory for trace types");
+
+    | .section code
+    dasm_init(&d, DASM_MAXSECTION);
+
+    | .globals trace_
+    void* labels[trace__MAX];
+    dasm_setupglobal(&d, labels, trace__MAX);
+
+    | .actionlist trace_actions
+    dasm_setup(&d, trace_actions);
+
+    dasm_State** Dst = &d;
+    dasm_growpc(Dst, count + 1);
+
+    // Both are callee-saved, and with the return address they leave rsp aligned after the sub
+    | ->entry:
+    | push rbx
+    | push r12
+    | sub rsp, 8 + JIT_SHADOW
+    | mov values, Rq(jit_args[0])
+    | mov vars, Rq(jit_args[1])
+    | ->loop:
+
+    for (int s = 0; s < count; s++) {
+        trace_step_t* step = &steps[s];
+        ir_instruction_t* instr = step->instruction;
+        ir_id_t* operands = instr->generic.operands;
+        int result = trace_offset(instr->result);
+
+        switch (instr->op) {
+            case IR_CONST_NUMBER: case IR_CONST_STRING: case IR_CONST_BOOLEAN:
+            case IR_CONST_NULL: case IR_CONST_ARRAY: case IR_BLOCK:
+                // Filled in by vm_constants before anything runs
+                break;
+            case IR_PHI: {
+                int offset = trace_offset(step->phi);
+                | mov rax, [values + offset]
+                | mov [values + result], rax
+                break;
+            }
+            case IR_LOAD: {
+                int offset = instr->var.var_id * 8;
+                | mov rax, [vars + offset]
+                | mov [values + result], rax
+                break;
+            }
+            case IR_STORE: {
+                int offset = instr->var.var_id * 8;
+                int value = trace_offset(instr->var.value);
+                | mov rax, [values + value]
+                | mov [vars + offset], rax
+                break;
+            }
+            case IR_ADD:
+                trace_arith(Dst, function, trace, step, numbers, (uint64_t) vm_add);
+                break;
+            case IR_SUB:
+                trace_arith(Dst, function, trace, step, numbers, (uint64_t) vm_sub);
+                break;
+            case IR_MUL:
+                trace_arith(Dst, function, trace, step, numbers, (uint64_t) vm_mul);
+                break;
+            case IR_LT:
+                trace_arith(Dst, function, trace, step, numbers, (uint64_t) vm_lt);
+                break;
+            case IR_GT:
+                trace_arith(Dst, function, trace, step, numbers, (uint64_t) vm_gt);
+                break;
+            case IR_EQ:
+                if (trace_number(function, numbers, operands[0]) || trace_number(function, numbers, operands[1])) {
+                    int left = trace_offset(operands[0]);
+                    int right = trace_offset(operands[1]);
+                    | mov rax, [values + left]
+                    | cmp rax, [values + right]
+                    | mov rax, JIT_FALSE
+                    | mov rcx, JIT_TRUE
+                    | cmove rax, rcx
+                    | mov [values + result], rax
+                } else {
+                    trace_call(Dst, instr, (uint64_t) vm_eq, 2, 1);
+                }
+                break;
+            case IR_DIV:
+                trace_call(Dst, instr, (uint64_t) vm_div, 2, 1);
+                break;
+            case IR_MOD:
+                trace_call(Dst, instr, (uint64_t) vm_mod, 2, 1);
+                break;
+            case IR_POW:
+                trace_call(Dst, instr, (uint64_t) vm_pow, 2, 1);
+                break;
+            case IR_NOT:
+                trace_call(Dst, instr, (uint64_t) jit_not, 1, 1);
+                break;
+            case IR_NEG:
+                trace_call(Dst, instr, (uint64_t) jit_neg, 1, 1);
+                break;
+            case IR_LENGTH:
+                trace_call(Dst, instr, (uint64_t) vm_length, 1, 1);
+                break;
+            case IR_ASCII:
+                trace_call(Dst, instr, (uint64_t) vm_ascii, 1, 1);
+                break;
+            case IR_BOX:
+                trace_call(Dst, instr, (uint64_t) vm_box, 1, 1);
+                break;
+            case IR_PRIME:
+                trace_call(Dst, instr, (uint64_t) vm_prime, 1, 1);
+                break;
+            case IR_ULTIMATE:
+                trace_call(Dst, instr, (uint64_t) vm_ultimate, 1, 1);
+                break;
+            case IR_GET:
+                trace_call(Dst, instr, instr->flags & IR_FLAG_IN_BOUNDS ? (uint64_t) vm_get_unchecked : (uint64_t) vm_get, 3, 1);
+                break;
+            case IR_SET:
+                trace_call(Dst, instr, instr->flags & IR_FLAG_IN_BOUNDS ? (uint64_t) vm_set_unchecked : (uint64_t) vm_set, 4, 1);
+                break;
+            case IR_BUILD:
+                trace_call(Dst, instr, (uint64_t) vm_build, 1, 1);
+                break;
+            case IR_APPEND:
+                trace_call(Dst, instr, (uint64_t) vm_append, 2, 0);
+                break;
+            case IR_FINISH:
+                trace_call(Dst, instr, (uint64_t) vm_finish, 1, 1);
+                break;
+            case IR_PROMPT:
+                trace_call(Dst, instr, (uint64_t) vm_prompt, 0, 1);
+                break;
+            case IR_RANDOM:
+                trace_call(Dst, instr, (uint64_t) jit_random, 0, 1);
+                break;
+            case IR_OUTPUT:
+                trace_call(Dst, instr, (uint64_t) jit_output, 1, 0);
+                break;
+            case IR_DUMP:
+                trace_call(Dst, instr, (uint64_t) jit_dump, 1, 0);
+                break;
+            case IR_QUIT:
+                trace_call(Dst, instr, (uint64_t) jit_quit, 1, 0);
+                break;
+            case IR_JUMP:
+                // The path goes on with the block jumped to
+                break;
+            case IR_BRANCH:
+                trace_branch(Dst, trace, step);
+                break;
+            default:
+                panic("Cannot trace %s", debug_ir_op_string(instr->op));
+        }
+    }
+
+    if (trace->root == trace) {
+        | jmp ->loop
+    } else {
+        uint64_t loop = (uint64_t) trace->root->loop;
+        | mov64 rax, loop
+        | jmp rax
+    }
+
+    // Exits go to their side trace once it exists, and otherwise return to the VM
+    for (int e = 0; e < trace->exit_count; e++) {
+        trace_exit_t* out = &trace->exits[e];
+        uint64_t link = (uint64_t) &out->link;
+
+        | =>e:
+        | mov64 rax, link
+        | mov rax, [rax]
+        | test rax, rax
+        | jz >1
+        | jmp rax
+        | 1:
+        | mov64 rax, (uint64_t) out
+        | epilogue
+    }
+
+    free(numbers);
+    trace->base = link(&d, &trace->size);
+
+    if (trace->root != trace) {
+        trace->next = trace->root->next;
+        trace->root->next = trace;
+        trace->root->side_count++;
+    }
+
+    trace->code = trace->root == trace ? labels[trace_entry] : labels[trace_loop];
+    trace->loop = labels[trace_loop];
+
+    dasm_free(&d);
+
+    return trace;
+}
+
+void trace_free(trace_t* trace) {
+    while (trace) {
+        trace_t* next = trace->next;
+
+        heap_free(trace->base, trace->size);
+        free(trace->exits);
+        free(trace);
+
+        trace = next;
+    }
+}
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+
+#include "ir.h"
+#include "jit/value.h"
+
+// Times a loop header is reached along a back edge before the path through it is recorded
+#define TRACE_HOT 64
+// Times a side exit is taken before the path from it is recorded as a side trace
+#define TRACE_EXIT_HOT 32
+// Longest path recorded, longer ones are left to the VM
+#define TRACE_LIMIT 1024
+// Back edges ignored after a recording is given up on, before the loop is tried again
+#define TRACE_BACKOFF 4096
+// Side traces a root trace may have, past that the whole tree is thrown out and recorded again
+#define TRACE_SIDES 32
+// Bytes of code all traces may take together before every trace is thrown out
+#define TRACE_CACHE (8 << 20)
+
+/*
+ * One instruction the VM ran while recording, with the type tags its
+ * first two operands had. BRANCH also keeps the side it went to, PHI
+ * the value it took.
+ */
+typedef struct trace_step {
+    ir_block_t* block;
+    ir_instruction_t* instruction;
+
+    v_t types[2];
+    int taken;
+    ir_id_t phi;
+} trace_step_t;
+
+/*
+ * Where the VM continues when a guard of a trace fails. Once taken
+ * often enough, the path from it is recorded and link is set to the
+ * side trace, which the exit jumps to from then on.
+ */
+typedef struct trace_exit {
+    struct trace* trace;
+
+    ir_block_t* block;
+    ir_block_t* previous;
+    int index;
+
+    int hits;
+    void* link;
+} trace_exit_t;
+
+typedef struct trace {
+    // The root trace of the loop, this trace if it is one
+    struct trace* root;
+    ir_block_t* header;
+
+    // Entry from the VM, and the top of the loop past the entry code
+    void* code;
+    void* loop;
+
+    // Where the code is on the code heap
+    void* base;
+    size_t size;
+
+    trace_exit_t* exits;
+    int exit_count;
+
+    // The side traces of a root trace, chained through next
+    struct trace* next;
+    int side_count;
+} trace_t;
+
+/*
+ * What the VM keeps while running with traces. hits and traces are per
+ * block ID, steps is the path being recorded when header is set, and
+ * from is the exit it is recorded from for a side trace.
+ */
+typedef struct trace_recorder {
+    int* hits;
+    trace_t** traces;
+
+    trace_step_t* steps;
+    int count;
+
+    // Bytes of code the traces in traces take
+    size_t size;
+
+    ir_block_t* header;
+    trace_exit_t* from;
+} trace_recorder_t;
+
+// Runs the trace on the VM's values and variables, returning the exit it left through
+typedef trace_exit_t* (*trace_entry_t)(v_t* registers, v_t* variables);
+
+trace_t* trace_compile(ir_function_t* function, trace_step_t* steps, int count, trace_exit_t* from);
+// Free a root trace along with its side traces
+void trace_free(trace_t* trace);
+
+#endif
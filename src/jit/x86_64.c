@@ -4,6 +4,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include "reg.h"
 #include "compile.h"
@@ -15,95 +17,66 @@
 
 | .arch x64
 
-| .define arg, Rq(ARG_REG)
-| .define temp1, Rq(6)
-| .define temp2, Rq(7)
-
-| .macro prelude
-| push rbp
-| push arg
-| mov rbp, rsp
-| push rax
-| push rbx
-| push rcx
-| push r12
-| push r13
-| push r14
-| push r15
-| sub rsp, frame_shadow
-| .endmacro
+// Scratch registers, never handed out by the allocator
+#define TEMP1 6
+#define TEMP2 7
+
+| .define temp1, Rq(TEMP1)
+| .define temp2, Rq(TEMP2)
 
 | .macro epilogue
-| add rsp, frame_shadow
+| mov rsp, rbp
 | pop r15
 | pop r14
 | pop r13
 | pop r12
-| pop rcx
 | pop rbx
-| pop rax
-| pop arg
+| pop rdi
+| pop rsi
 | pop rbp
+| ret
 | .endmacro
 
-| .macro foreign, fn
-| mov rbp, rsp
-| mov64 rax, (uint64_t) fn
-| call rax
-| .endmacro
-
-| .macro ldr, r, v
-|| if (r.reg != -1) {
-    || if (r.reg > 3) {
-    | mov Rq(r.reg + 4), v
-    ||} else {
-    | mov Rq(r.reg), v
-    ||}
-||} else if (r.slot != -1) {
-| mov temp1, v
-| mov [rbp - (r.slot * 8)], temp1
-||}
-| .endmacro
-
-| .macro rdr, t, r
-||if (r.reg != -1) {
-|| if (r.reg > 3) {
-| mov t, Rq(r.reg + 4)
-||} else {
-| mov t, Rq(r.reg)
-||}
-||} else if (r.slot != -1) {
-| mov t, [rbp - (r.slot * 8)]
-||}
-| .endmacro
-
-| .macro type, t, r
-||if (r.reg != -1) {
-| rdr t, r
-| and t, 0b111
-||} else if (r.slot != -1) {
-| mov t, [rbp - (r.slot * 8)]
-| and t, 0b111
-||}
-| .endmacro
-
-| .macro coerce, d, t, r
-| type temp1, t
-| type temp2, r
-| cmp temp1, temp2
-| je >1
-| panic 0xff
-| 1:
-| mov d, temp2
-| .endmacro
+// Allocator registers 0-3 are rax to rbx, the rest skip rsp, rbp, rsi and rdi
+static inline int jit_reg(int reg) {
+    return reg > 3 ? reg + 4 : reg;
+}
 
-| .macro panic, code
-| sub rsp, 64
-| and rsp, -16
-| mov arg, code
-| foreign jit_panic
-| .endmacro
+static inline int jit_slot(int slot) {
+    return -8 - slot * 8;
+}
 
+// Bytes pushed since the last block boundary, where rsp is 16-byte aligned
+static int jit_depth;
+
+/*
+ * The value temp1 was last loaded into or stored from, which loading it
+ * again takes from temp1 instead, see jit_load. It is dropped wherever
+ * anything else writes temp1 and at every label, another path may get
+ * there with something else in it. Calls and edges drop it up front,
+ * since the slow paths and branches leading to them start at a label.
+ */
+static ir_id_t jit_held = -1;
+
+/*
+ * A guard that gives up on a speculation, continuing the main program
+ * in the VM from instruction index of block. Live values are stored
+ * into values first, indexed by their ID like the VM's registers.
+ */
+typedef struct jit_exit {
+    ir_function_t* function;
+    ir_block_t* block;
+    int index;
+    v_t* values;
+} jit_exit_t;
+
+// Guards of the block being compiled are only taken when this is set, see compile
+static int jit_speculate;
+
+static jit_exit_t* jit_exits;
+static int jit_exit_count;
+static int jit_exit_capacity;
+static v_t* jit_values;
 
 void jit_panic(int code) {
     switch (code) {
@@ -115,374 +88,1095 @@ void jit_panic(int code) {
 
 int jit_truthy(ir_instruction_t* instr) {
     switch (instr->op) {
-        case IR_CONST_STRING:
+        case IR_CONST_STRING: {
             v_string_t str = (v_string_t) (instr->constant.value & VALUE_MASK);
             return str->length > 0 ? 1 : 0;
+        }
         case IR_CONST_NUMBER:
             return (instr->constant.value >> 3) != 0 ? 1 : 0;
         case IR_CONST_BOOLEAN:
             return (instr->constant.value >> 3) != 0 ? 1 : 0;
         case IR_CONST_NULL:
             return 0;
-        case IR_CONST_ARRAY:
+        case IR_CONST_ARRAY: {
             v_list_t list = (v_list_t) (instr->constant.value & VALUE_MASK);
             return list->length > 0 ? 1 : 0;
+        }
         default:
             return -1;
     }
 }
 
-v_t jit_prompt() {
-    int capacity = 16;
-    int length = 0;
-    char* buffer = malloc(16);
-    if (!buffer) panic("Failed to allocate memory for prompt buffer");
+/* Slow paths the generated code calls when the inline one does not apply */
+
+v_t jit_not(v_t value) {
+    return v_coerce_to_boolean(value) ^ (1 << 3);
+}
+
+v_t jit_neg(v_t value) {
+    return ((v_number_t) v_coerce_to_number(value)) * -1;
+}
+
+v_t jit_boolean(v_t value) {
+    return v_coerce_to_boolean(value);
+}
+
+v_t jit_random() {
+    return ((v_number_t) (rand()) << 3) | TYPE_NUMBER;
+}
+
+void jit_quit(v_t value) {
+    exit(v_coerce_to_number(value) >> 3);
+}
 
-    char character;
-    while ((character = getchar()) != EOF && character != '\n') {
-        if (length + 1 >= capacity) {
-            capacity *= 2;
-            char* str = realloc(buffer, capacity);
-            if (!str) {
-                free(buffer);
-                panic("Failed to reallocate memory for prompt buffer");
+void jit_uncallable(v_t value) {
+    panic("Cannot call a %s", v_type(value));
+}
+
+void jit_deopt(jit_exit_t* side, v_t* variables) {
+    arena_t* arena = arena_create(512);
+    vm_resume(side->function, arena, side->block, side->index, side->values, variables);
+    arena_free(arena);
+}
+
+void jit_output(v_t value) {
+    v_t string = v_coerce_to_string(value);
+    v_string_t str = (v_string_t) (string & VALUE_MASK);
+    if (str->length > 0 && str->data[str->length - 1] == '\\') {
+        printf("%.*s", (int)(str->length - 1), str->data);
+        return;
+    }
+
+    puts(str->data);
+    return;
+}
+
+void jit_dump(v_t value) {
+    if (V_IS_LIST(value)) {
+        v_list_t list = (v_list_t)(value & VALUE_MASK);
+
+        printf("[");
+        for (size_t i = 0; i < list->length; ++i) {
+            if (i > 0) printf(",");
+            if (V_IS_STRING(list->items[i])) {
+                printf("'");
             }
 
-            buffer = str;
+            jit_dump(list->items[i]);
+
+            if (V_IS_STRING(list->items[i])) {
+                printf("'");
+            }
         }
-        buffer[length++] = character;
+        printf("]");
+    } else if (V_IS_NULL(value)) {
+        printf("null");
+    } else if (V_IS_BLOCK(value)) {
+        printf("BLOCK (0x%llx)", (unsigned long long)(value & VALUE_MASK));
+    } else {
+        v_t string = v_coerce_to_string(value);
+        v_string_t str = (v_string_t) (string & VALUE_MASK);
+
+        if (V_IS_NULL(value)) {
+            printf("null");
+        } else {
+            printf("%s", str->data);
+        }
+    }
+}
+
+static int jit_number(ir_function_t* ir, ir_id_t id) {
+    ir_instruction_t* instr = jit_fetch(ir, id);
+    return instr->op == IR_CONST_NUMBER || instr->type == IR_TYPE_NUMBER;
+}
+
+static void jit_read(dasm_State** Dst, regs_t r, int t) {
+    if (t == TEMP1) jit_held = -1;
+
+    if (r.reg != -1) {
+        | mov Rq(t), Rq(jit_reg(r.reg))
+    } else {
+        int offset = jit_slot(r.slot);
+        | mov Rq(t), [rbp + offset]
     }
+}
 
-    if (character == EOF && length == 0) {
-        free(buffer);
-        return (v_t)TYPE_NULL;
+static void jit_write(dasm_State** Dst, regs_t r, int t) {
+    if (r.reg != -1) {
+        | mov Rq(jit_reg(r.reg)), Rq(t)
+    } else if (r.slot != -1) {
+        int offset = jit_slot(r.slot);
+        | mov [rbp + offset], Rq(t)
     }
+}
 
-    if (length > 0 && buffer[length - 1] == '\r') {
-        length--;
+/*
+ * Read a value as it is at position into register t. Constants and
+ * BLOCK values are never given a location, they are loaded as
+ * immediates wherever they are used. A value temp1 was just stored
+ * from or loaded into is taken from temp1.
+ */
+static void jit_load(dasm_State** Dst, ir_function_t* ir, reg_info_t* info, ir_id_t id, int position, int t) {
+    ir_instruction_t* instr = jit_fetch(ir, id);
+
+    if (id == jit_held) {
+        if (t != TEMP1) {
+            | mov Rq(t), temp1
+        }
+        return;
     }
 
-    buffer[length] = '\0';
+    if (t == TEMP1) jit_held = -1;
 
-    v_t result = v_create_string(buffer, length);
-    free(buffer);
-    return result;
+    switch (instr->op) {
+        case IR_CONST_NUMBER: case IR_CONST_STRING: case IR_CONST_BOOLEAN:
+        case IR_CONST_NULL: case IR_CONST_ARRAY:
+            | mov64 Rq(t), (uint64_t) instr->constant.value
+            return;
+        case IR_BLOCK: {
+            uint64_t value = (uint64_t) instr->block.function | TYPE_BLOCK;
+            | mov64 Rq(t), value
+            return;
+        }
+        default:
+            break;
+    }
+
+    if (info->first[id] < 0) panic("Value %d is used but was not given a location", id);
+    jit_read(Dst, reg_at(info, id, position), t);
+
+    if (t == TEMP1) jit_held = id;
 }
 
-void jit_length(dasm_State** Dst, ir_function_t* ir, ir_id_t value, ir_id_t result, regs_t* regs) {
-    ir_instruction_t* p = jit_fetch(ir, value);
-    regs_t input = regs[value];
-    regs_t reg = regs[result];
+static void jit_store(dasm_State** Dst, reg_info_t* info, ir_instruction_t* instr, int t) {
+    jit_write(Dst, reg_at(info, instr->result, instr->position), t);
 
-    switch (p->op) {
-        default:
-            | type temp1, input // Gather type
-            | rdr temp2, input // Read value
-            | and temp2, -8 // Drop type bits
-
-            /* Handle string and list types */
-            | cmp temp1, TYPE_LIST
-            | je >1 // Jump if list
-            | cmp temp1, TYPE_STRING
-
-            /* Handle number, boolean, and null type */
-            | jne >2 // Jump if not a string
-            
-            /* String and list */
-            | 1:
-            | mov temp2, [temp2] // Dereference length
-            | shl temp2, 3 // Add bits 0b000 -> number
-            | ldr reg, temp2 // Load result into destination
-            | jmp >7 // Finish
+    if (t == TEMP1) jit_held = instr->result;
+}
 
-            /* Number, boolean, and null */
-            | 2:
-            | cmp temp1, TYPE_NULL
-            | je >3
+static void jit_move(dasm_State** Dst, regs_t from, regs_t to) {
+    if (from.reg != -1 && to.reg != -1) {
+        | mov Rq(jit_reg(to.reg)), Rq(jit_reg(from.reg))
+    } else if (from.reg != -1) {
+        jit_write(Dst, to, jit_reg(from.reg));
+    } else if (to.reg != -1) {
+        jit_read(Dst, from, jit_reg(to.reg));
+    } else {
+        jit_read(Dst, from, TEMP1);
+        jit_write(Dst, to, TEMP1);
+    }
+}
 
-            | cmp temp1, TYPE_BOOLEAN // Panic on booleans
-            | je >6
+/*
+ * Do a group of moves at once. Every source is read before anything is
+ * written, since a move may overwrite what another one reads: a move is
+ * done once no move left reads its target. When only cycles are left,
+ * one source is set aside in temp2, which frees the rest of its cycle.
+ */
+static void jit_parallel(dasm_State** Dst, regs_t* from, regs_t* to, int count) {
+    if (count == 0) return;
 
-            | cmp temp2, 0
-            | jl >4 // Panic if negative
+    char* done = calloc(count, sizeof(char));
+    if (!done) panic("Failed to allocate memory for parallel moves");
 
-            | shr temp2, 3 // Get raw number
-            | cmp temp2, 10
-            | jl >5 // Handle single digits
+    int aside = -1;
+    int left = count;
 
-            /* Multi-digit numbers */
+    while (left) {
+        int progress = 0;
 
-            // Preserve registers
-            | push rax
-            | push rdx
-            | push rcx
+        for (int m = 0; m < count; m++) {
+            if (done[m]) continue;
 
-            | mov temp1, temp2 // Input
-            | xor temp2, temp2 // Digits
+            int blocked = 0;
+            for (int k = 0; k < count && !blocked; k++) {
+                if (!done[k] && k != m && k != aside && reg_same(from[k], to[m])) blocked = 1;
+            }
+            if (blocked) continue;
 
-            | 1:
-            | inc temp2 // Increase count
-            | mov rax, temp1
-            | xor rdx, rdx
-            | mov rcx, 10 // Divisor
-
-            | div rcx // temp1 / 10
-            | mov temp1, rax // -> temp1
-            | cmp temp1, 0
-            | jne <1 // Finish if nothing left over
-
-            // Restore registers
-            | pop rcx
-            | pop rdx
-            | pop rax
+            if (m == aside) {
+                jit_write(Dst, to[m], TEMP2);
+            } else if (!reg_same(from[m], to[m])) {
+                jit_move(Dst, from[m], to[m]);
+            }
 
-            // Prepare value
-            | shl temp2, 3
-            | ldr reg, temp2
-            | jmp >7 // Finish
+            done[m] = 1;
+            left--;
+            progress = 1;
+        }
 
-            | 3:
-            | ldr reg, 0 // Return 0 for null
-            | jmp >7
+        if (!progress) {
+            for (aside = 0; done[aside]; aside++);
+            jit_read(Dst, from[aside], TEMP2);
+        }
+    }
 
-            | 4:
-            | panic 0x1
+    free(done);
+}
 
-            | 5:
-            | ldr reg, 1<<3
-            | jmp >7
+/*
+ * Move the operands into the argument registers. They are loaded
+ * directly unless an argument register holds an operand still to be
+ * read, then they go through the stack instead.
+ */
+static void jit_arguments(dasm_State** Dst, ir_function_t* ir, reg_info_t* info, ir_instruction_t* instr, ir_id_t* operands, int count) {
+    int direct = 1;
+    for (int k = 1; k < count && direct; k++) {
+        regs_t r = reg_at(info, operands[k], instr->position);
+        if (r.reg == -1 || info->first[operands[k]] < 0) continue;
+
+        for (int j = 0; j < k; j++) {
+            if (jit_reg(r.reg) == jit_args[j]) direct = 0;
+        }
+    }
 
-            | 6:
-            | panic, 0x2
+    if (direct) {
+        for (int k = 0; k < count; k++) {
+            jit_load(Dst, ir, info, operands[k], instr->position, jit_args[k]);
+        }
+        return;
+    }
 
-            | 7:
-            break;
+    for (int k = 0; k < count; k++) {
+        jit_load(Dst, ir, info, operands[k], instr->position, TEMP1);
+        | push temp1
+    }
+
+    for (int k = count - 1; k >= 0; k--) {
+        | pop Rq(jit_args[k])
     }
 }
 
-void jit_not(dasm_State** Dst, ir_function_t* ir, ir_id_t value, ir_id_t result, regs_t* regs) {
-    ir_instruction_t* p = jit_fetch(ir, value);
-    regs_t input = regs[value];
-    regs_t reg = regs[result];
+/*
+ * Call fn with the given operands of instr as arguments, storing what
+ * it returns into the result if store is set. The return value is also
+ * left in temp1. Only the REG_VOLATILE registers holding values live
+ * across instr are kept. The stack is aligned at every block boundary,
+ * so jit_depth tells whether a pad is needed to keep it aligned here.
+ */
+static void jit_call(dasm_State** Dst, ir_function_t* ir, reg_info_t* info, ir_instruction_t* instr, uint64_t fn, ir_id_t* operands, int count, int store) {
+    int saved = info->across[instr->position / 2] & REG_VOLATILE;
+    int pushed = 0;
+
+    jit_held = -1;
+
+    for (int r = 0; r < REGISTERS; r++) {
+        if ((saved >> r) & 1) {
+            | push Rq(jit_reg(r))
+            pushed += 8;
+        }
+    }
 
-    switch (p->op) {
-        default:
-            | type temp1, input // Gather type
-            | rdr temp2, input // Read value
-            | and temp2, -8 // Drop type bits
+    jit_arguments(Dst, ir, info, instr, operands, count);
 
-            /* Handle list and strings */
-            | cmp temp1, TYPE_LIST
-            | je >1
-            | cmp temp1, TYPE_STRING
-            | je >1
+    int pad = (jit_depth + pushed) % 16 + JIT_SHADOW;
+    if (pad) {
+        | sub rsp, pad
+    }
 
+    | mov64 rax, fn
+    | call rax
+    jit_held = -1;
 
-            /* Handle boolean, number, and null types */
-            | mov temp1, TYPE_BOOLEAN
-            | test temp2, temp2
-            | mov temp2, (1 << 3) | TYPE_BOOLEAN
-            | cmovz temp1, temp2
-            | ldr reg, temp1
-            | jmp >2
+    if (pad) {
+        | add rsp, pad
+    }
 
-            /* Dereference lengths */
-            | 1:
-            | mov temp2, [temp2] // Dereference length
-            | mov temp1, TYPE_BOOLEAN
-            | test temp2, temp2
-            | mov temp2, (1 << 3) | TYPE_BOOLEAN
-            | cmovz temp1, temp2
-            | ldr reg, temp1
+    | mov temp1, rax
 
-            | 2:
+    for (int r = REGISTERS - 1; r >= 0; r--) {
+        if ((saved >> r) & 1) {
+            | pop Rq(jit_reg(r))
+        }
+    }
+
+    if (store) jit_store(Dst, info, instr, TEMP1);
+}
+
+/*
+ * Whether to assume the operands of instr are numbers. Comparisons and
+ * SUB nearly always are once neither operand is known not to be, ADD
+ * and MUL also build strings and lists so one operand has to be proven.
+ */
+static int jit_speculates(ir_function_t* ir, ir_instruction_t* instr) {
+    if (!jit_speculate) return 0;
+
+    ir_type_t left = jit_fetch(ir, instr->generic.operands[0])->type;
+    ir_type_t right = jit_fetch(ir, instr->generic.operands[1])->type;
+
+    if (left != IR_TYPE_NUMBER && left != IR_TYPE_ANY) return 0;
+    if (right != IR_TYPE_NUMBER && right != IR_TYPE_ANY) return 0;
+
+    if (instr->op == IR_ADD || instr->op == IR_MUL) {
+        return jit_number(ir, instr->generic.operands[0]) || jit_number(ir, instr->generic.operands[1]);
     }
+
+    return 1;
 }
 
-void jit_add(dasm_State** Dst, ir_function_t* ir, ir_id_t left, ir_id_t right, ir_id_t result, regs_t* regs) {
-    ir_instruction_t* l = jit_fetch(ir, left);
-    ir_instruction_t* r = jit_fetch(ir, right);
+/*
+ * Record a guard before instr, returning the label of the side exit
+ * compile emits for it once every block is done.
+ */
+static int jit_guard(dasm_State** Dst, ir_function_t* ir, ir_block_t* block, ir_instruction_t* instr) {
+    if (jit_exit_count >= jit_exit_capacity) {
+        jit_exit_capacity = jit_exit_capacity ? jit_exit_capacity * 2 : 16;
+        jit_exits = realloc(jit_exits, sizeof(jit_exit_t) * jit_exit_capacity);
+        if (!jit_exits) panic("Failed to reallocate memory for side exits");
+    }
 
-    regs_t resr = regs[result];
-    regs_t lr = regs[left];
-    regs_t rr = regs[right];
+    jit_exit_t* side = &jit_exits[jit_exit_count];
+    side->function = ir;
+    side->block = block;
+    side->index = (int) (instr - block->instructions);
+    side->values = jit_values;
 
-    switch (l->op) {
-        case IR_CONST_NUMBER:
-            | rdr temp1, rr
-            | mov temp2, l->constant.value
-            | add temp1, temp2
-            | ldr resr, temp1
+    dasm_growpc(Dst, 2 * ir->order_count + jit_exit_count + 1);
+    return 2 * ir->order_count + jit_exit_count++;
+}
+
+/*
+ * Whether id is a constant that fits a sign-extended 32-bit immediate,
+ * setting imm to it. Strings and lists are pointers, they never do.
+ */
+static int jit_immediate(ir_function_t* ir, ir_id_t id, int32_t* imm) {
+    ir_instruction_t* instr = jit_fetch(ir, id);
+    if (instr->op != IR_CONST_NUMBER && instr->op != IR_CONST_BOOLEAN && instr->op != IR_CONST_NULL) return 0;
+
+    int64_t value = (int64_t) instr->constant.value;
+    if (value < INT32_MIN || value > INT32_MAX) return 0;
+
+    *imm = (int32_t) value;
+    return 1;
+}
+
+// The register id is in where instr is, loading it into temp1 if it is not in one
+static int jit_source(dasm_State** Dst, ir_function_t* ir, reg_info_t* info, ir_id_t id, int position) {
+    if (info->first[id] >= 0) {
+        regs_t r = reg_at(info, id, position);
+        if (r.reg != -1) return jit_reg(r.reg);
+    }
+
+    jit_load(Dst, ir, info, id, position, TEMP1);
+    return TEMP1;
+}
+
+// Leave through guard, or else for the slow path at local label 3, unless register t holds a number
+static void jit_check(dasm_State** Dst, ir_function_t* ir, ir_id_t id, int t, int guard) {
+    if (jit_number(ir, id)) return;
+
+    | test Rq(t), TYPE_MASK
+    if (guard != -1) {
+        | jnz =>guard
+    } else {
+        | jnz >3
+    }
+}
+
+/*
+ * Get the operands of a binary instr ready for the inline number code,
+ * see jit_check. A number constant that fits an immediate is not loaded,
+ * imm is set to it and the operand it is (0 or 1) returned, the other
+ * one is left in register source. The left operand is only taken when
+ * commutes is set. Otherwise they are loaded into temp1 and temp2 and
+ * -1 is returned.
+ */
+static int jit_operands(dasm_State** Dst, ir_function_t* ir, reg_info_t* info, ir_instruction_t* instr, int guard, int commutes, int32_t* imm, int* source) {
+    ir_id_t left = instr->generic.operands[0];
+    ir_id_t right = instr->generic.operands[1];
+
+    int constant = -1;
+    if (jit_number(ir, right) && jit_immediate(ir, right, imm)) constant = 1;
+    else if (commutes && jit_number(ir, left) && jit_immediate(ir, left, imm)) constant = 0;
+
+    if (constant == -1) {
+        jit_load(Dst, ir, info, left, instr->position, TEMP1);
+        jit_load(Dst, ir, info, right, instr->position, TEMP2);
+
+        jit_check(Dst, ir, left, TEMP1, guard);
+        jit_check(Dst, ir, right, TEMP2, guard);
+        return -1;
+    }
+
+    ir_id_t value = instr->generic.operands[1 - constant];
+    *source = jit_source(Dst, ir, info, value, instr->position);
+
+    jit_check(Dst, ir, value, *source, guard);
+    return constant;
+}
+
+// Multiply the number in register source by n into temp1, shifting for a power of two
+static void jit_scale(dasm_State** Dst, int source, int32_t n) {
+    if (n > 0 && (n & (n - 1)) == 0) {
+        if (source != TEMP1) {
+            | mov temp1, Rq(source)
+        }
+
+        int shift = __builtin_ctz(n);
+        if (shift) {
+            | shl temp1, shift
+        }
+    } else {
+        | imul temp1, Rq(source), n
+    }
+}
+
+/*
+ * ADD, SUB, MUL, LT and GT of two numbers inline, anything else goes
+ * through fn. Operands already known to be numbers skip the type check,
+ * and number constants are used as immediates. When speculating, any
+ * other operand leaves for the VM instead, so what ADD, SUB and MUL
+ * give is a number from then on.
+ */
+static void jit_arith(dasm_State** Dst, ir_function_t* ir, reg_info_t* info, ir_block_t* block, ir_instruction_t* instr, uint64_t fn) {
+    int checked = !jit_number(ir, instr->generic.operands[0]) || !jit_number(ir, instr->generic.operands[1]);
+
+    int guard = -1;
+    if (checked && jit_speculates(ir, instr)) guard = jit_guard(Dst, ir, block, instr);
+
+    int32_t imm = 0;
+    int source = TEMP1;
+    int constant = jit_operands(Dst, ir, info, instr, guard, instr->op != IR_SUB, &imm, &source);
+
+    // A constant left operand of a compare is compared the other way around
+    int less = (instr->op == IR_LT) != (constant == 0);
+
+    switch (instr->op) {
+        case IR_ADD:
+            if (constant == -1) {
+                | add temp1, temp2
+            } else {
+                | lea temp1, [Rq(source) + imm]
+            }
+            break;
+        case IR_SUB:
+            if (constant == -1) {
+                | sub temp1, temp2
+            } else {
+                if (source != TEMP1) {
+                    | mov temp1, Rq(source)
+                }
+                | sub temp1, imm
+            }
+            break;
+        case IR_MUL:
+            if (constant == -1) {
+                | sar temp2, 3
+                | imul temp1, temp2
+            } else {
+                jit_scale(Dst, source, imm >> 3);
+            }
+            break;
+        case IR_LT: case IR_GT:
+            if (constant == -1) {
+                | cmp temp1, temp2
+            } else {
+                | cmp Rq(source), imm
+            }
+
+            | mov temp1, JIT_FALSE
+            | mov temp2, JIT_TRUE
+            if (less) {
+                | cmovl temp1, temp2
+            } else {
+                | cmovg temp1, temp2
+            }
             break;
         default:
-            | coerce temp1, lr, rr // Coerced right in temp1
-            | type temp2, lr // Gather type
-            | cmp temp2, TYPE_NUMBER
-            | jne >1
-            /* Number addition */
-            | rdr temp2, lr
-            | rdr temp1, rr
-            | add temp2, temp1
-            | ldr resr, temp2
-            | jmp >2
+            panic("Bad arithmetic op %s", debug_ir_op_string(instr->op));
+    }
 
-            | 1:
-            | panic temp2 // Unimplemented
+    jit_store(Dst, info, instr, TEMP1);
 
-            | 2:
+    if (guard != -1) {
+        if (instr->op != IR_LT && instr->op != IR_GT) instr->type = IR_TYPE_NUMBER;
+    } else if (checked) {
+        | jmp >4
+        | 3:
+        jit_call(Dst, ir, info, instr, fn, instr->generic.operands, 2, 1);
+        | 4:
+        jit_held = -1;
+    }
+}
 
-            break;
+/*
+ * Multiplier and shift to divide by d with, from Hacker's Delight 10-1.
+ * d is at least 2 either way from zero.
+ */
+static void jit_magic(int64_t d, int64_t* multiplier, int* shift) {
+    const uint64_t two63 = 1ULL << 63;
+
+    uint64_t ad = d < 0 ? -(uint64_t) d : (uint64_t) d;
+    uint64_t t = two63 + ((uint64_t) d >> 63);
+    uint64_t anc = t - 1 - t % ad;
+
+    uint64_t q1 = two63 / anc, r1 = two63 - q1 * anc;
+    uint64_t q2 = two63 / ad, r2 = two63 - q2 * ad;
+    uint64_t delta;
+
+    int p = 63;
+    do {
+        p++;
+
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad) {
+            q2++;
+            r2 -= ad;
+        }
+
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+
+    *multiplier = (int64_t) (q2 + 1);
+    if (d < 0) *multiplier = -*multiplier;
+    *shift = p - 64;
+}
+
+/*
+ * DIV and MOD by a number constant without idiv. A power of two is
+ * shifted or masked, anything else is multiplied by its magic number,
+ * which needs rax and rdx for the high half of the product. Other
+ * divisors, and the negative operands MOD panics on, go to fn.
+ */
+static void jit_divide(dasm_State** Dst, ir_function_t* ir, reg_info_t* info, ir_instruction_t* instr, uint64_t fn) {
+    ir_id_t left = instr->generic.operands[0];
+    ir_id_t right = instr->generic.operands[1];
+
+    int32_t imm;
+    if (!jit_number(ir, right) || !jit_immediate(ir, right, &imm) || imm == 0 || (instr->op == IR_MOD && imm < 0)) {
+        jit_call(Dst, ir, info, instr, fn, instr->generic.operands, 2, 1);
+        return;
+    }
+
+    int64_t d = imm >> 3;
+    int64_t magnitude = d < 0 ? -d : d;
+    int power = (magnitude & (magnitude - 1)) == 0;
+    int checked = !jit_number(ir, left);
+
+    jit_load(Dst, ir, info, left, instr->position, TEMP1);
+    jit_check(Dst, ir, left, TEMP1, -1);
+
+    if (instr->op == IR_MOD) {
+        | test temp1, temp1
+        | js >3
+
+        if (power) {
+            int32_t mask = (int32_t) ((magnitude - 1) << 3);
+            | and temp1, mask
+        }
+    }
+
+    if (instr->op == IR_DIV && power) {
+        int shift = __builtin_ctzll(magnitude);
+
+        // Negative numbers are biased by the divisor less one to round towards zero
+        | sar temp1, 3
+        if (shift) {
+            | mov temp2, temp1
+            | sar temp2, 63
+            | shr temp2, 64 - shift
+            | add temp1, temp2
+            | sar temp1, shift
+        }
+        if (d < 0) {
+            | neg temp1
+        }
+        | shl temp1, 3
+    } else if (!power) {
+        int64_t multiplier;
+        int shift;
+        jit_magic(d, &multiplier, &shift);
+
+        int saved = info->across[instr->position / 2] & 0x5;
+
+        | sar temp1, 3
+        | mov temp2, temp1
+        if (saved & 0x1) {
+            | push rax
+        }
+        if (saved & 0x4) {
+            | push rdx
+        }
+
+        | mov64 rax, (uint64_t) multiplier
+        | imul temp1
+        if (d > 0 && multiplier < 0) {
+            | add rdx, temp2
+        } else if (d < 0 && multiplier > 0) {
+            | sub rdx, temp2
+        }
+        if (shift) {
+            | sar rdx, shift
+        }
+        | mov rax, rdx
+        | shr rax, 63
+        | add rdx, rax
+
+        if (instr->op == IR_MOD) {
+            int32_t divisor = (int32_t) d;
+            | imul rdx, rdx, divisor
+            | sub temp2, rdx
+            | mov temp1, temp2
+        } else {
+            | mov temp1, rdx
+        }
+
+        if (saved & 0x4) {
+            | pop rdx
+        }
+        if (saved & 0x1) {
+            | pop rax
+        }
+        | shl temp1, 3
+    }
+
+    jit_store(Dst, info, instr, TEMP1);
+
+    if (checked || instr->op == IR_MOD) {
+        | jmp >4
+        | 3:
+        jit_call(Dst, ir, info, instr, fn, instr->generic.operands, 2, 1);
+        | 4:
+        jit_held = -1;
     }
 }
 
-void jit_sub(dasm_State** Dst, ir_function_t* ir, ir_id_t left, ir_id_t right, ir_id_t result, regs_t* regs) {
-    ir_instruction_t* l = jit_fetch(ir, left);
-    ir_instruction_t* r = jit_fetch(ir, right);
+/*
+ * Values of the same type compare by their bits, except strings and
+ * lists which are compared by vm_eq. Values of different types differ
+ * in their tag bits, so they never compare equal either way.
+ */
+static void jit_eq(dasm_State** Dst, ir_function_t* ir, reg_info_t* info, ir_instruction_t* instr) {
+    ir_id_t left = instr->generic.operands[0];
+    ir_id_t right = instr->generic.operands[1];
+
+    // Nothing but itself equals a constant that fits an immediate
+    int32_t imm;
+    int constant = jit_immediate(ir, right, &imm) ? 1 : jit_immediate(ir, left, &imm) ? 0 : -1;
+    if (constant != -1) {
+        int source = jit_source(Dst, ir, info, instr->generic.operands[1 - constant], instr->position);
+
+        | cmp Rq(source), imm
+        | mov temp1, JIT_FALSE
+        | mov temp2, JIT_TRUE
+        | cmove temp1, temp2
+        jit_store(Dst, info, instr, TEMP1);
+        return;
+    }
 
-    
+    jit_load(Dst, ir, info, left, instr->position, TEMP1);
+    jit_load(Dst, ir, info, right, instr->position, TEMP2);
+
+    if (jit_number(ir, left) || jit_number(ir, right)) {
+        | cmp temp1, temp2
+        | mov temp1, JIT_FALSE
+        | mov temp2, JIT_TRUE
+        | cmove temp1, temp2
+        jit_store(Dst, info, instr, TEMP1);
+        return;
+    }
+
+    | cmp temp1, temp2
+    | je >1
+    | and temp1, 3 // Strings and lists both have 0b01 in the low bits
+    | cmp temp1, TYPE_STRING
+    | je >2
+    | mov temp1, JIT_FALSE
+    jit_store(Dst, info, instr, TEMP1);
+    | jmp >3
+    | 1:
+    | mov temp1, JIT_TRUE
+    jit_store(Dst, info, instr, TEMP1);
+    | jmp >3
+    | 2:
+    jit_call(Dst, ir, info, instr, (uint64_t) vm_eq, instr->generic.operands, 2, 1);
+    | 3:
+    jit_held = -1;
 }
 
-void jit_greater(dasm_State** Dst, ir_function_t* ir, ir_id_t left, ir_id_t right, ir_id_t result, regs_t* regs) {
-    ir_instruction_t* l = jit_fetch(ir, left);
-    ir_instruction_t* r = jit_fetch(ir, right);
+static void jit_unary(dasm_State** Dst, ir_function_t* ir, reg_info_t* info, ir_instruction_t* instr) {
+    ir_id_t value = instr->generic.operands[0];
+    ir_instruction_t* def = jit_fetch(ir, value);
 
-    regs_t resr = regs[result];
-    regs_t lr = regs[left];
-    regs_t rr = regs[right];
+    jit_load(Dst, ir, info, value, instr->position, TEMP1);
 
-    switch (l->op) {
-        case IR_CONST_NUMBER:
-            | rdr temp1, rr
-            | mov temp2, l->constant.value
-            | cmp temp2, temp1
-            | mov temp2, TYPE_BOOLEAN // False
-            | mov temp1, ((1 << 3) | TYPE_BOOLEAN) // True
-            | cmovg temp2, temp1
-            | ldr resr, temp2
+    switch (instr->op) {
+        case IR_NEG:
+            if (!jit_number(ir, value)) {
+                | test temp1, TYPE_MASK
+                | jnz >1
+            }
+
+            | neg temp1
+            jit_store(Dst, info, instr, TEMP1);
+
+            if (!jit_number(ir, value)) {
+                | jmp >2
+                | 1:
+                jit_call(Dst, ir, info, instr, (uint64_t) jit_neg, instr->generic.operands, 1, 1);
+                | 2:
+                jit_held = -1;
+            }
             break;
-        default:
-            | coerce temp1, lr, rr // Coerced right in temp1
-            | type temp2, lr // Gather type
-            | cmp temp2, TYPE_NUMBER
+        case IR_NOT:
+            if (def->type != IR_TYPE_BOOLEAN) {
+                | mov temp2, temp1
+                | and temp2, TYPE_MASK
+                | cmp temp2, TYPE_BOOLEAN
+                | jne >1
+            }
+
+            | xor temp1, (1 << 3)
+            jit_store(Dst, info, instr, TEMP1);
+
+            if (def->type != IR_TYPE_BOOLEAN) {
+                | jmp >2
+                | 1:
+                jit_call(Dst, ir, info, instr, (uint64_t) jit_not, instr->generic.operands, 1, 1);
+                | 2:
+                jit_held = -1;
+            }
+            break;
+        case IR_LENGTH:
+            // Strings and lists both start with their length
+            | mov temp2, temp1
+            | and temp2, 3
+            | cmp temp2, TYPE_STRING
             | jne >1
-            /* Number comparison */
-            | rdr temp2, lr
-            | rdr temp1, rr
-            | cmp temp2, temp1
-            | mov temp2, TYPE_BOOLEAN // False
-            | mov temp1, ((1 << 3) | TYPE_BOOLEAN) // True
-            | cmovg temp2, temp1
-            | ldr resr, temp2
+            | and temp1, -8
+            | mov temp1, [temp1]
+            | shl temp1, 3
+            jit_store(Dst, info, instr, TEMP1);
             | jmp >2
-
             | 1:
-            | panic temp2 // Unimplemented
-
+            jit_call(Dst, ir, info, instr, (uint64_t) vm_length, instr->generic.operands, 1, 1);
             | 2:
-
+            jit_held = -1;
             break;
+        default:
+            panic("Bad unary op %s", debug_ir_op_string(instr->op));
     }
 }
 
-void jit_branch(dasm_State** Dst, ir_function_t* ir, ir_instruction_t* instr, regs_t* regs) {
-    ir_block_t* truthy = instr->branch.truthy;
-    ir_block_t* falsey = instr->branch.falsey;
+/*
+ * Take the edge from from to to, then jump there unless it is the block
+ * placed next. Along the way PHIs get their value, and values live into
+ * to are moved to where to expects them if they were split in between.
+ */
+static void jit_edge(dasm_State** Dst, ir_function_t* ir, reg_info_t* info, ir_block_t* from, ir_block_t* to, int next) {
+    int end = from->to - 2;
+    jit_held = -1;
+
+    int capacity = ir->live_count + to->instruction_count + 1;
+    regs_t* sources = malloc(sizeof(regs_t) * capacity);
+    regs_t* targets = malloc(sizeof(regs_t) * capacity);
+    if (!sources || !targets) panic("Failed to allocate memory for edge moves");
+
+    int count = 0;
+    int constants = 0;
+
+    // Constant PHI inputs have no location to move from, they are stored last
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < to->instruction_count && to->instructions[i].op == IR_PHI; i++) {
+            ir_instruction_t* phi = &to->instructions[i];
+            if (info->first[phi->result] < 0) continue;
+
+            for (int k = 0; k < phi->phi.phi_count; k++) {
+                if (phi->phi.phi_blocks[k] != from) continue;
+
+                ir_id_t value = phi->phi.phi_values[k];
+                regs_t target = reg_at(info, phi->result, to->from);
+
+                if (info->first[value] >= 0 && pass == 0) {
+                    regs_t source = reg_at(info, value, end);
+                    if (!reg_same(source, target)) {
+                        sources[count] = source;
+                        targets[count++] = target;
+                    }
+                } else if (info->first[value] < 0 && pass == 1) {
+                    jit_load(Dst, ir, info, value, end, TEMP1);
+                    jit_write(Dst, target, TEMP1);
+                    constants++;
+                }
+                break;
+            }
+        }
+
+        if (pass == 0) {
+            for (int w = 0; w < ir->live_words; w++) {
+                uint64_t bits = to->live_in[w];
+                while (bits) {
+                    int bit = __builtin_ctzll(bits);
+                    bits &= bits - 1;
+
+                    ir_id_t value = ir->live_ids[w * 64 + bit];
+                    if (info->first[value] < 0) continue;
+
+                    regs_t source = reg_at(info, value, end);
+                    regs_t target = reg_at(info, value, to->from);
+                    if (!reg_same(source, target)) {
+                        sources[count] = source;
+                        targets[count++] = target;
+                    }
+                }
+            }
+
+            jit_parallel(Dst, sources, targets, count);
+        }
+    }
+
+    free(sources);
+    free(targets);
+
+    if (to->order != next) {
+        | jmp =>to->order
+    }
+}
+
+/*
+ * Jump to truthy or falsey on whether operand 0 of instr is truthy, as
+ * it is where instr is.
+ */
+static void jit_test(dasm_State** Dst, ir_function_t* ir, reg_info_t* info, ir_block_t* block, ir_instruction_t* instr, ir_block_t* truthy, ir_block_t* falsey, int next) {
+    ir_id_t* value = instr->op == IR_BRANCH ? &instr->branch.condition : instr->generic.operands;
+    ir_instruction_t* def = jit_fetch(ir, *value);
 
-    ir_id_t condition = instr->branch.condition;
-    ir_instruction_t* cond = jit_fetch(ir, condition);
-    
-    int constant = jit_truthy(cond);
+    int constant = jit_truthy(def);
     if (constant != -1) {
-        | jmp =>truthy->id
-    } else if (!constant) {
-        | jmp =>falsey->id
-    } else {
-        regs_t condition = regs[instr->branch.condition];
+        jit_edge(Dst, ir, info, block, constant ? truthy : falsey, next);
+        return;
+    }
 
-        | type temp1, condition // Gather type
-        | rdr temp2, condition // Read value
-        | and temp2, -8 // Drop type bits
+    jit_load(Dst, ir, info, *value, instr->position, TEMP1);
 
-        /* Handle list and strings */
-        | cmp temp1, TYPE_LIST
-        | je >1
-        | cmp temp1, TYPE_STRING
-        | je >1
+    | cmp temp1, JIT_TRUE
+    | je >1
 
-        /* Handle boolean, number, and null types */
-        | test temp2, temp2
-        | jne =>truthy->id
-        | jmp =>falsey->id
+    if (def->type != IR_TYPE_BOOLEAN) {
+        | cmp temp1, JIT_FALSE
+        | je >2
+        | cmp temp1, TYPE_NULL
+        | je >2
+        | test temp1, temp1 // Zero
+        | jz >2
+        | test temp1, TYPE_MASK // Any other number
+        | jz >1
 
-        /* Dereference lengths */
-        | 1:
-        | mov temp2, [temp2] // Dereference length
-        | test temp2, temp2
-        | jne =>truthy->id
-        | jmp =>falsey->id
+        jit_call(Dst, ir, info, instr, (uint64_t) jit_boolean, value, 1, 0);
+        | cmp temp1, JIT_TRUE
+        | je >1
     }
+
+    | 2:
+    jit_edge(Dst, ir, info, block, falsey, -1);
+    | 1:
+    jit_edge(Dst, ir, info, block, truthy, next);
 }
 
+/*
+ * Whether instruction i of block is a LT, GT, EQ or NOT that only the
+ * BRANCH right after it reads. The branch then jumps on the compare
+ * itself, see jit_fused, and the boolean is never made.
+ */
+static int jit_fuses(ir_function_t* ir, ir_block_t* block, int i) {
+    ir_instruction_t* instr = &block->instructions[i];
+    if (instr->op != IR_LT && instr->op != IR_GT && instr->op != IR_EQ && instr->op != IR_NOT) return 0;
+    if (i + 1 >= block->instruction_count) return 0;
 
+    ir_instruction_t* branch = &block->instructions[i + 1];
+    if (branch->op != IR_BRANCH || branch->branch.condition != instr->result) return 0;
 
-void jit_output(v_t value) {
-    v_t string = v_coerce_to_string(value);
-    v_string_t str = (v_string_t) (string & VALUE_MASK);
-    if (str->length > 0 && str->data[str->length - 1] == '\\') {
-        printf("%.*s", (int)(str->length - 1), str->data);
+    return ir_use_count(ir, instr->result) == 1;
+}
+
+/*
+ * BRANCH on cond, which jit_fuses let through. Numbers are compared
+ * and jumped on directly, only the slow path still gets a boolean back
+ * from C and tests that. Operands are read where cond is, nothing is
+ * moved in between.
+ */
+static void jit_fused(dasm_State** Dst, ir_function_t* ir, reg_info_t* info, ir_block_t* block, ir_instruction_t* cond, ir_instruction_t* instr, int next) {
+    ir_block_t* truthy = instr->branch.truthy;
+    ir_block_t* falsey = instr->branch.falsey;
+
+    // Branching on NOT x is branching on x the other way around
+    if (cond->op == IR_NOT) {
+        jit_test(Dst, ir, info, block, cond, falsey, truthy, next);
         return;
     }
 
-    puts(str->data);
-    return;
-}
+    ir_id_t left = cond->generic.operands[0];
+    ir_id_t right = cond->generic.operands[1];
 
-void jit_dump(v_t value) {
-    if (V_IS_LIST(value)) {
-        v_list_t list = (v_list_t)(value & VALUE_MASK);
+    int slow = 0;
+    uint64_t fn = (uint64_t) vm_eq;
 
-        printf("[");
-        for (size_t i = 0; i < list->length; ++i) {
-            if (i > 0) printf(",");
-            if (V_IS_STRING(list->items[i])) {
-                printf("'");
-            }
+    int32_t imm = 0;
+    int source = TEMP1;
 
-            jit_dump(list->items[i]);
+    if (cond->op == IR_EQ) {
+        int constant = jit_immediate(ir, right, &imm) ? 1 : jit_immediate(ir, left, &imm) ? 0 : -1;
 
-            if (V_IS_STRING(list->items[i])) {
-                printf("'");
+        if (constant != -1) {
+            source = jit_source(Dst, ir, info, cond->generic.operands[1 - constant], cond->position);
+            | cmp Rq(source), imm
+            | je >1
+        } else {
+            jit_load(Dst, ir, info, left, cond->position, TEMP1);
+            jit_load(Dst, ir, info, right, cond->position, TEMP2);
+
+            | cmp temp1, temp2
+            | je >1
+
+            // See jit_eq, only strings and lists with different bits can still be equal
+            if (!jit_number(ir, left) && !jit_number(ir, right)) {
+                | and temp1, 3
+                | cmp temp1, TYPE_STRING
+                | je >3
+                slow = 1;
             }
         }
-        printf("]");
-    } else if (V_IS_NULL(value)) {
-        printf("null");
-    } else if (V_IS_BLOCK(value)) {
-        printf("BLOCK (0x%llx)", (unsigned long long)(value & VALUE_MASK));
     } else {
-        v_t string = v_coerce_to_string(value);
-        v_string_t str = (v_string_t) (string & VALUE_MASK);
-        
-        if (V_IS_NULL(value)) {
-            printf("null");
+        int checked = !jit_number(ir, left) || !jit_number(ir, right);
+
+        int guard = -1;
+        if (checked && jit_speculates(ir, cond)) guard = jit_guard(Dst, ir, block, cond);
+
+        int constant = jit_operands(Dst, ir, info, cond, guard, 1, &imm, &source);
+        if (constant == -1) {
+            | cmp temp1, temp2
         } else {
-            printf("%s", str->data);
+            | cmp Rq(source), imm
         }
+
+        // See jit_arith
+        if ((cond->op == IR_LT) != (constant == 0)) {
+            | jl >1
+        } else {
+            | jg >1
+        }
+
+        slow = guard == -1 && checked;
+        fn = cond->op == IR_LT ? (uint64_t) vm_lt : (uint64_t) vm_gt;
+    }
+
+    | 2:
+    jit_edge(Dst, ir, info, block, falsey, -1);
+
+    if (slow) {
+        | 3:
+        jit_call(Dst, ir, info, cond, fn, cond->generic.operands, 2, 0);
+        | cmp temp1, JIT_TRUE
+        | jne <2
+    }
+
+    | 1:
+    jit_edge(Dst, ir, info, block, truthy, next);
+}
+
+static void jit_invoke(dasm_State** Dst, ir_function_t* ir, reg_info_t* info, ir_instruction_t* instr) {
+    ir_id_t callee = instr->generic.operands[0];
+    ir_instruction_t* def = jit_fetch(ir, callee);
+
+    // Bodies are entered through the stub before their first block, see compile
+    int pad = jit_depth % 16;
+    if (pad) {
+        | sub rsp, pad
+    }
+
+    if (def->op == IR_BLOCK) {
+        | call =>ir->order_count + def->block.function->order
+    } else {
+        jit_load(Dst, ir, info, callee, instr->position, TEMP1);
+        | call ->dispatch
+    }
+
+    if (pad) {
+        | add rsp, pad
     }
+    jit_held = -1;
+
+    // RETURN leaves the result in rax
+    jit_store(Dst, info, instr, 0);
 }
 
+static int jit_terminated(ir_block_t* block) {
+    if (block->instruction_count == 0) return 0;
+
+    ir_op_t op = block->instructions[block->instruction_count - 1].op;
+    return op == IR_JUMP || op == IR_BRANCH || op == IR_RETURN;
+}
+
+/*
+ * Compile every block in the order ir_liveness left them in, so the
+ * main program comes first and a block usually falls through into the
+ * next. Values live where reg_allocate put them at each position, with
+ * the moves between the pieces of split values done just before the
+ * instruction they precede. BLOCK bodies are native functions, their
+ * entry stub sets up a frame for their spills and RETURN leaves the
+ * result in rax. Registers are shared between all of them, so values
+ * live across a CALL are pushed by SAVE and popped by RESTORE.
+ */
 void* compile(ir_function_t* ir, reg_info_t reg_info) {
     dasm_State* d;
-    unsigned int apc = 8;
-    unsigned int cpc = 0;
+    reg_info_t* info = &reg_info;
+
+    // The inline paths rely on proven types, refresh them for the final IR
+    ir_types(ir);
+
+    // BLOCK bodies, which get their own frame, and the slots each region's values use
+    char* entry = calloc(ir->order_count, sizeof(char));
+    int* frames = calloc(ir->order_count, sizeof(int));
+    if (!entry || !frames) panic("Failed to allocate memory for entry blocks");
 
-    regs_t* regs = reg_info.regs;
+    jit_held = -1;
 
-    int slots = 8 * (reg_info.max_slot + 1);
-    int frame_size = ((slots + 9 * 8 + 15) & ~15);
-    int frame_shadow = frame_size - 9 * 8;
+    // Guards are only placed in the main program, where the VM can take over with an empty call stack
+    jit_exits = NULL;
+    jit_exit_count = 0;
+    jit_exit_capacity = 0;
+    jit_values = NULL;
 
-    | .section code, constants, variables
+    if (ir->config->flags & CONFIG_SPECULATE) {
+        jit_values = calloc(ir->next_value_id, sizeof(v_t));
+        if (!jit_values) panic("Failed to allocate memory for side exit values");
+    }
+
+    for (int o = 0; o < ir->order_count; o++) {
+        ir_block_t* block = ir->order[o];
+        for (int i = 0; i < block->instruction_count; i++) {
+            ir_instruction_t* instr = &block->instructions[i];
+            if (instr->op == IR_BLOCK) entry[instr->block.function->order] = 1;
+            if (!block->region || instr->result < 0 || instr->result >= ir->next_value_id) continue;
+
+            // Values never cross into another region, so slots are only ever used from one frame
+            for (int p = info->first[instr->result]; p >= 0; p = info->intervals[p].next) {
+                int slot = info->intervals[p].slot;
+                if (slot >= frames[block->region->order]) frames[block->region->order] = slot + 1;
+            }
+        }
+    }
+
+    // With the return address and the eight pushes of the prologue, rsp is 8 bytes off until this is taken
+    int frame = ((8 * frames[ir->block->order] + 15) & ~15) + 8;
+
+    regs_t* sources = malloc(sizeof(regs_t) * (info->move_count + 1));
+    regs_t* targets = malloc(sizeof(regs_t) * (info->move_count + 1));
+    if (!sources || !targets) panic("Failed to allocate memory for split moves");
+
+    // Kept off the code heap, which is never writable while the program runs
+    v_t* variables = calloc(ir->var_id + 1, sizeof(v_t));
+    if (!variables) panic("Failed to allocate memory for variables");
+
+    | .section code
     dasm_init(&d, DASM_MAXSECTION);
 
     | .globals label_
@@ -493,190 +1187,281 @@ void* compile(ir_function_t* ir, reg_info_t reg_info) {
     dasm_setup(&d, kn_actions);
 
     dasm_State** Dst = &d;
-    dasm_growpc(Dst, apc);
-
-    | .variables
-    | .align 8
-    | ->variables:
-    for (int i = 0; i <= ir->var_id; i++) {
-        | .qword 0
-    }
-
-    | .code
-    for (int b = 0; b < ir->block_count; b++) {
-        ir_block_t* block = ir->blocks[b];
-
-        block->id = cpc;
-        | =>pc(&d, cpc, apc):
-
-        if (cpc == 0) {
-            | lea rbp, [rsp - 8]
-            | sub rsp, (8 + ((reg_info.max_slot + 1) & 2) * 8)
+    dasm_growpc(Dst, 2 * ir->order_count);
+
+    | ->main:
+    | push rbp
+    | push rsi
+    | push rdi
+    | push rbx
+    | push r12
+    | push r13
+    | push r14
+    | push r15
+    | mov rbp, rsp
+    | sub rsp, frame
+
+    int move = 0;
+    for (int o = 0; o < ir->order_count; o++) {
+        ir_block_t* block = ir->order[o];
+
+        // A block is only fallen into when it has no stub in between
+        int next = o + 1 < ir->order_count && !entry[o + 1] ? o + 1 : -1;
+
+        // A body has its own frame for its spills, after the return address rbp realigns the stack
+        if (entry[o]) {
+            int size = (8 * frames[o] + 15) & ~15;
+
+            | =>ir->order_count + block->order:
+            | push rbp
+            | mov rbp, rsp
+            | sub rsp, size
         }
 
-        cpc++;
+        | =>block->order:
+        jit_held = -1;
+        jit_depth = 0;
+        ir_id_t fused = -1;
+        jit_speculate = (ir->config->flags & CONFIG_SPECULATE) && block->region == ir->block;
+
         for (int i = 0; i < block->instruction_count; i++) {
-            ir_instruction_t instr = block->instructions[i];
-
-            regs_t reg = regs[instr.result];
-
-            switch (instr.op) {
-                case IR_CONST_STRING:
-                    | .constants
-                    | .align 8
-                    v_string_t str = (v_string_t) (instr.constant.value & VALUE_MASK);
-
-                    | 2:
-                    | .qword str->length
-                    | .qword >1
-                    | 1:
-                    for (size_t i = 0; i < str->length; i++) {
-                        | .byte str->data[i]
-                    }
-                    | .byte 0
-
-                    | .code
-                    | lea temp1, [<2]
-                    | or temp1, TYPE_STRING
-                    | ldr reg, temp1
-                    break;
-                case IR_CONST_ARRAY:
-                    | .constants
-                    | .align 8
-                    v_list_t list = (v_list_t) (instr.constant.value & VALUE_MASK);
-
-                    | 2:
-                    | .qword list->length
-                    | .qword list->capacity
-                    | .qword >1
-                    | 1:
-                    for (size_t i = 0; i < list->capacity; i++) {
-                        | .qword list->items[i]
-                    }
+            ir_instruction_t* instr = &block->instructions[i];
+            ir_id_t* operands = instr->generic.operands;
+
+            // Moves at the block boundary are done on the edges instead
+            int count = 0;
+            while (move < info->move_count && info->moves[move].position < instr->position) {
+                if (i > 0 && info->moves[move].position == instr->position - 1) {
+                    sources[count] = info->moves[move].from;
+                    targets[count++] = info->moves[move].to;
+                }
+                move++;
+            }
 
-                    | .code
-                    | lea temp1, [<2]
-                    | or temp1, TYPE_LIST
-                    | ldr reg, temp1
-                    break;
-                case IR_PROMPT:
-                    | prelude
-                    | foreign jit_prompt
-                    | mov temp1, rax
-                    | epilogue
-                    | ldr reg, temp1
-                    break;
-                case IR_STORE:
-                    ir_instruction_t* value = jit_fetch(ir, instr.var.value);
-                    switch (value->op) {
-                        case IR_CONST_NUMBER: case IR_CONST_BOOLEAN: case IR_CONST_NULL:
-                            | mov64 temp2, value->constant.value
-                            break;
-                        default:
-                            | rdr temp2, regs[instr.var.value]
-                            break;
-                    }
+            jit_parallel(Dst, sources, targets, count);
 
-                    | lea temp1, [->variables]
-                    | add temp1, (instr.var.var_id * 8)
-                    | mov [temp1], temp2
+            // Left to the BRANCH after it, unless a split move has to be done in between
+            if (jit_fuses(ir, block, i) && !(move < info->move_count && info->moves[move].position == instr->position + 1)) {
+                fused = instr->result;
+                continue;
+            }
+
+            switch (instr->op) {
+                case IR_CONST_NUMBER: case IR_CONST_STRING: case IR_CONST_BOOLEAN:
+                case IR_CONST_NULL: case IR_CONST_ARRAY: case IR_BLOCK:
+                case IR_PHI:
+                    // Loaded where they are used, PHIs are filled in by jit_edge
                     break;
-                case IR_LOAD:
-                    | lea temp1, [->variables]
-                    | add temp1, (instr.var.var_id * 8)
+                case IR_LOAD: {
+                    uint64_t address = (uint64_t) &variables[instr->var.var_id];
+                    | mov64 temp1, address
                     | mov temp1, [temp1]
-                    | ldr reg, temp1
+                    jit_store(Dst, info, instr, TEMP1);
                     break;
-                case IR_LENGTH:
-                    jit_length(Dst, ir, instr.generic.operands[0], instr.result, regs);
-                    break;
-                case IR_NOT:
-                    jit_not(Dst, ir, instr.generic.operands[0], instr.result, regs);
+                }
+                case IR_STORE: {
+                    uint64_t address = (uint64_t) &variables[instr->var.var_id];
+                    jit_load(Dst, ir, info, instr->var.value, instr->position, TEMP2);
+                    | mov64 temp1, address
+                    | mov [temp1], temp2
+                    jit_held = -1;
                     break;
+                }
                 case IR_ADD:
-                    jit_add(Dst, ir, instr.generic.operands[0], instr.generic.operands[1], instr.result, regs);
+                    jit_arith(Dst, ir, info, block, instr, (uint64_t) vm_add);
                     break;
                 case IR_SUB:
-                    jit_sub(Dst, ir, instr.generic.operands[0], instr.generic.operands[1], instr.result, regs);
+                    jit_arith(Dst, ir, info, block, instr, (uint64_t) vm_sub);
+                    break;
+                case IR_MUL:
+                    jit_arith(Dst, ir, info, block, instr, (uint64_t) vm_mul);
+                    break;
+                case IR_LT:
+                    jit_arith(Dst, ir, info, block, instr, (uint64_t) vm_lt);
                     break;
                 case IR_GT:
-                    jit_greater(Dst, ir, instr.generic.operands[0], instr.generic.operands[1], instr.result, regs);
+                    jit_arith(Dst, ir, info, block, instr, (uint64_t) vm_gt);
+                    break;
+                case IR_EQ:
+                    jit_eq(Dst, ir, info, instr);
+                    break;
+                case IR_DIV:
+                    jit_divide(Dst, ir, info, instr, (uint64_t) vm_div);
+                    break;
+                case IR_MOD:
+                    jit_divide(Dst, ir, info, instr, (uint64_t) vm_mod);
+                    break;
+                case IR_POW:
+                    jit_call(Dst, ir, info, instr, (uint64_t) vm_pow, operands, 2, 1);
+                    break;
+                case IR_NEG: case IR_NOT: case IR_LENGTH:
+                    jit_unary(Dst, ir, info, instr);
+                    break;
+                case IR_ASCII:
+                    jit_call(Dst, ir, info, instr, (uint64_t) vm_ascii, operands, 1, 1);
+                    break;
+                case IR_BOX:
+                    jit_call(Dst, ir, info, instr, (uint64_t) vm_box, operands, 1, 1);
+                    break;
+                case IR_PRIME:
+                    jit_call(Dst, ir, info, instr, (uint64_t) vm_prime, operands, 1, 1);
+                    break;
+                case IR_ULTIMATE:
+                    jit_call(Dst, ir, info, instr, (uint64_t) vm_ultimate, operands, 1, 1);
+                    break;
+                case IR_GET:
+                    jit_call(Dst, ir, info, instr, instr->flags & IR_FLAG_IN_BOUNDS ? (uint64_t) vm_get_unchecked : (uint64_t) vm_get, operands, 3, 1);
+                    break;
+                case IR_SET:
+                    jit_call(Dst, ir, info, instr, instr->flags & IR_FLAG_IN_BOUNDS ? (uint64_t) vm_set_unchecked : (uint64_t) vm_set, operands, 4, 1);
+                    break;
+                case IR_BUILD:
+                    jit_call(Dst, ir, info, instr, (uint64_t) vm_build, operands, 1, 1);
+                    break;
+                case IR_APPEND:
+                    jit_call(Dst, ir, info, instr, (uint64_t) vm_append, operands, 2, 0);
+                    break;
+                case IR_FINISH:
+                    jit_call(Dst, ir, info, instr, (uint64_t) vm_finish, operands, 1, 1);
+                    break;
+                case IR_PROMPT:
+                    jit_call(Dst, ir, info, instr, (uint64_t) vm_prompt, NULL, 0, 1);
+                    break;
+                case IR_RANDOM:
+                    jit_call(Dst, ir, info, instr, (uint64_t) jit_random, NULL, 0, 1);
                     break;
                 case IR_OUTPUT:
-                    value = jit_fetch(ir, instr.generic.operands[0]);
-                    
-                    | prelude
-
-                    switch (value->op) {
-                        case IR_CONST_NUMBER: case IR_CONST_BOOLEAN: case IR_CONST_NULL:
-                            | mov64 arg, value->constant.value
-                            break;
-                        default:
-                            | rdr arg, regs[instr.generic.operands[0]]
-                            break;
-                    }
+                    if (instr->generic.operand_count != 1) panic("OUTPUT of several pieces is only run by the VM");
 
-                    
-                    | foreign jit_output
-                    | epilogue
-                    | ldr reg, TYPE_NULL
+                    jit_call(Dst, ir, info, instr, (uint64_t) jit_output, operands, 1, 0);
+                    | mov temp1, TYPE_NULL
+                    jit_store(Dst, info, instr, TEMP1);
                     break;
                 case IR_DUMP:
-                    value = jit_fetch(ir, instr.generic.operands[0]);
-                    
-                    | prelude
-
-                    switch (value->op) {
-                        case IR_CONST_NUMBER: case IR_CONST_BOOLEAN: case IR_CONST_NULL:
-                            | mov64 arg, value->constant.value
-                            break;
-                        default:
-                            | rdr arg, regs[instr.generic.operands[0]]
-                            break;
-                    }
-
-                    | foreign jit_dump
-                    | ldr reg, arg
-                    | epilogue
+                    jit_call(Dst, ir, info, instr, (uint64_t) jit_dump, operands, 1, 0);
+                    break;
+                case IR_QUIT:
+                    jit_call(Dst, ir, info, instr, (uint64_t) jit_quit, operands, 1, 0);
+                    break;
+                case IR_CALL:
+                    jit_invoke(Dst, ir, info, instr);
+                    break;
+                case IR_RETURN:
+                    jit_load(Dst, ir, info, operands[0], instr->position, 0);
+                    | mov rsp, rbp
+                    | pop rbp
+                    | ret
                     break;
                 case IR_JUMP:
-                    if (instr.jump.block->id != block->id) {
-                        | jmp =>instr.jump.block->id
-                    }
+                    jit_edge(Dst, ir, info, block, instr->jump.block, next);
                     break;
                 case IR_BRANCH:
-                    jit_branch(Dst, ir, &instr, regs);
+                    if (instr->branch.condition == fused) {
+                        jit_fused(Dst, ir, info, block, jit_fetch(ir, fused), instr, next);
+                    } else {
+                        jit_test(Dst, ir, info, block, instr, instr->branch.truthy, instr->branch.falsey, next);
+                    }
                     break;
                 case IR_SAVE:
-                    for (int i = 0; i < instr.generic.operand_count; i++) {
-                        ir_id_t operand = instr.generic.operands[i];
-                        ir_instruction_t* op = jit_fetch(ir, operand);
-                        int reg = regs[operand].reg;
+                    for (int k = 0; k < instr->generic.operand_count; k++) {
+                        if (info->first[operands[k]] < 0) continue;
 
-                        //| push Rq(reg)
+                        jit_load(Dst, ir, info, operands[k], instr->position, TEMP1);
+                        | push temp1
+                        jit_depth += 8;
                     }
                     break;
                 case IR_RESTORE:
-                    for (int i = instr.generic.operand_count - 1; i >= 0; i--) {
-                        ir_id_t operand = instr.generic.operands[i];
-                        ir_instruction_t* op = jit_fetch(ir, operand);
-                        int reg = regs[operand].reg;
+                    for (int k = instr->generic.operand_count - 1; k >= 0; k--) {
+                        if (info->first[operands[k]] < 0) continue;
 
-                        //| pop Rq(reg)
+                        | pop temp1
+                        jit_write(Dst, reg_at(info, operands[k], instr->position), TEMP1);
+                        jit_held = -1;
+                        jit_depth -= 8;
                     }
                     break;
                 default:
-                    continue;
+                    panic("The JIT cannot compile %s", debug_ir_op_string(instr->op));
             }
         }
-        | add rsp, (8 + ((reg_info.max_slot + 1) & 2) * 8)
-        | ret
+
+        // Only the end of the main program has nowhere to go
+        if (!jit_terminated(block)) {
+            | epilogue
+        }
+    }
+
+    | ->exit:
+    | epilogue
+
+    /*
+     * CALL of a value that is not known to be a BLOCK comes here with
+     * it in temp1, and goes on to the body from its native pointer.
+     */
+    int native = offsetof(ir_block_t, native);
+
+    | ->dispatch:
+    | mov temp2, temp1
+    | and temp2, TYPE_MASK
+    | cmp temp2, TYPE_BLOCK
+    | jne >1
+    | and temp1, -8
+    | mov temp1, [temp1 + native]
+    | jmp temp1
+    | 1:
+    | mov Rq(jit_args[0]), temp1
+    | sub rsp, 8 + JIT_SHADOW
+    | mov64 rax, (uint64_t) jit_uncallable
+    | call rax
+
+    // Side exits go after everything else, out of the way of the code that does not take them
+    for (int e = 0; e < jit_exit_count; e++) {
+        jit_exit_t* side = &jit_exits[e];
+        int position = side->block->instructions[side->index].position;
+
+        uint64_t values = (uint64_t) side->values;
+        uint64_t target = (uint64_t) side;
+
+        | =>2 * ir->order_count + e:
+        | mov64 temp2, values
+
+        for (ir_id_t id = 0; id < ir->next_value_id; id++) {
+            if (info->first[id] < 0 || !reg_live(info, id, position)) continue;
+
+            int offset = id * 8;
+            jit_read(Dst, reg_at(info, id, position), TEMP1);
+            | mov [temp2 + offset], temp1
+        }
+
+        // The VM runs the program to its end, so nothing here is returned to
+        | mov64 Rq(jit_args[0]), target
+        | mov64 Rq(jit_args[1]), (uint64_t) variables
+        | and rsp, -16
+        | sub rsp, JIT_SHADOW
+        | mov64 rax, (uint64_t) jit_deopt
+        | call rax
+        | jmp ->exit
+    }
+
+    free(sources);
+    free(targets);
+
+    size_t size;
+    void* base = link(&d, &size);
+
+    for (int o = 0; o < ir->order_count; o++) {
+        ir_block_t* block = ir->order[o];
+        block->native = (char*) base + dasm_getpclabel(&d, entry[o] ? ir->order_count + block->order : block->order);
     }
 
-    void* program = link(&d) + dasm_getpclabel(&d, 0);
+    free(entry);
+    free(frames);
+
+    void* program = labels[label_main];
     dasm_free(&d);
 
-    return (void*) program;
+    return program;
 }
 
 #endif
@@ -74,7 +74,16 @@ int main(int argc, char* argv[]) {
     info(config, "Created IR with %d blocks, total size of %zu bytes", ir->block_count, arena->size);
 
     opt_liveness_t* liveness = ir_optimize(ir);
-    reg_info_t reg_info = reg_allocate(ir, liveness);
+
+    // Registers are only needed to compile or to show them with -d
+    #ifdef JIT_OFF
+    int compiled = 0;
+    #else
+    int compiled = config.flags & CONFIG_JIT;
+    #endif
+
+    reg_info_t reg_info = { 0 };
+    if (compiled || (config.flags & CONFIG_IR)) reg_info = reg_allocate(ir, liveness);
 
     if (config.flags & CONFIG_IR) {
         ir_function_t* function = ir;
@@ -144,6 +153,10 @@ int main(int argc, char* argv[]) {
                     
                 }
 
+                if (instr->flags & IR_FLAG_IN_BOUNDS) {
+                    printf(" IN_BOUNDS");
+                }
+
                 printf(" REGISTER=%d STACK=%d", 
                        regs[instr->result].reg,
                        regs[instr->result].slot
@@ -168,6 +181,7 @@ int main(int argc, char* argv[]) {
     }
     #endif
 
+    ir_index_free(ir);
     arena_free(arena);
 
     return 0;
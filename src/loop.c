@@ -0,0 +1,885 @@
+#include "loop.h"
+#include "cfg.h"
+#include "opt.h"
+
+static ir_loop_t* ir_loop_at(ir_loops_t* loops, ir_function_t* function, ir_block_t* header) {
+    for (int l = 0; l < loops->count; l++) {
+        if (loops->loops[l].header == header) return &loops->loops[l];
+    }
+
+    ir_loop_t* loop = &loops->loops[loops->count++];
+    memset(loop, 0, sizeof(ir_loop_t));
+
+    loop->header = header;
+    loop->contains_size = function->next_block_id + 1;
+    loop->contains = calloc(loop->contains_size, 1);
+    loop->blocks = malloc(sizeof(ir_block_t*) * (function->block_count + 1));
+    loop->var = -1;
+    loop->update = -1;
+    loop->trip = -1;
+
+    if (!loop->contains || !loop->blocks) panic("Failed to allocate memory for loop analysis");
+
+    loop->contains[header->id] = 1;
+    loop->blocks[loop->block_count++] = header;
+
+    return loop;
+}
+
+/* Add the blocks that reach a back edge without passing the header */
+static void ir_loop_fill(ir_function_t* function, ir_loop_t* loop, ir_block_t* latch, ir_block_t** stack) {
+    int size = 0;
+    if (!loop->contains[latch->id]) {
+        loop->contains[latch->id] = 1;
+        loop->blocks[loop->block_count++] = latch;
+        stack[size++] = latch;
+    }
+
+    while (size > 0) {
+        ir_block_t* block = stack[--size];
+
+        for (int p = 0; p < block->predecessor_count; p++) {
+            ir_block_t* pred = ir_block_find(function, block->predecessors[p]);
+            if (!pred || !pred->region || loop->contains[pred->id]) continue;
+
+            loop->contains[pred->id] = 1;
+            loop->blocks[loop->block_count++] = pred;
+            stack[size++] = pred;
+        }
+    }
+}
+
+/* STOREs to var in the loop, or -1 when a call in it may write var */
+static int ir_loop_stores(ir_loop_t* loop, call_summary_t* summary, ir_var_t var) {
+    int stores = 0;
+
+    for (int b = 0; b < loop->block_count; b++) {
+        ir_block_t* block = loop->blocks[b];
+
+        for (int i = 0; i < block->instruction_count; i++) {
+            ir_instruction_t* instr = &block->instructions[i];
+
+            if (instr->op == IR_STORE && instr->var.var_id == var) {
+                stores++;
+            } else if (instr->op == IR_CALL && ir_effect_has(ir_call_effect(summary, instr->result)->writes, var)) {
+                return -1;
+            }
+        }
+    }
+
+    return stores;
+}
+
+static int ir_loop_constant(ir_function_t* function, ir_id_t value, v_number_t* number) {
+    ir_instruction_t* def = ir_fetch(function, value);
+    if (!def || def->op != IR_CONST_NUMBER) return 0;
+
+    *number = (v_number_t) def->constant.value >> 3;
+    return 1;
+}
+
+/* The variable a value was loaded from, if it is a number */
+static ir_var_t ir_loop_load(ir_function_t* function, ir_id_t value) {
+    ir_instruction_t* def = ir_fetch(function, value);
+    if (!def || def->op != IR_LOAD || def->type != IR_TYPE_NUMBER) return -1;
+
+    return def->var.var_id;
+}
+
+/* Whether a STORE to var, or a call that may write it, sits between two indices */
+static int ir_loop_clobbered(ir_block_t* block, int from, int to, ir_var_t var, call_summary_t* summary) {
+    for (int i = from + 1; i < to; i++) {
+        ir_instruction_t* instr = &block->instructions[i];
+
+        if (instr->op == IR_STORE && instr->var.var_id == var) return 1;
+        if (instr->op == IR_CALL && ir_effect_has(ir_call_effect(summary, instr->result)->writes, var)) return 1;
+    }
+
+    return 0;
+}
+
+static int ir_loop_index(ir_block_t* block, ir_instruction_t* instr) {
+    return (int) (instr - block->instructions);
+}
+
+/*
+ * Find the basic induction variable tested by the loop header: a number
+ * variable stored exactly once per iteration as its previous value plus
+ * a constant. The initial value and limit give the trip count when both
+ * are constants.
+ */
+static void ir_loop_induction_var(ir_function_t* function, ir_loops_t* loops, ir_loop_t* loop, call_summary_t* summary) {
+    ir_instruction_t* branch = ir_terminator(loop->header);
+    if (!branch || branch->op != IR_BRANCH || !loop->body || !loop->latch) return;
+
+    ir_instruction_t* condition = ir_fetch(function, branch->branch.condition);
+    if (!condition || (condition->op != IR_LT && condition->op != IR_GT)) return;
+    if (function->index->owners[condition->result] != loop->header) return;
+
+    // below is 1 when the loop continues while the variable is below the bound
+    ir_id_t load = condition->generic.operands[0];
+    ir_id_t bound = condition->generic.operands[1];
+    int below = condition->op == IR_LT;
+
+    if (ir_loop_load(function, load) < 0) {
+        load = condition->generic.operands[1];
+        bound = condition->generic.operands[0];
+        below = !below;
+    }
+
+    ir_var_t var = ir_loop_load(function, load);
+    if (var < 0 || function->index->owners[load] != loop->header) return;
+
+    ir_instruction_t* load_def = ir_fetch(function, load);
+    if (ir_loop_clobbered(loop->header, ir_loop_index(loop->header, load_def), loop->header->instruction_count, var, summary)) {
+        return;
+    }
+
+    if (ir_loop_stores(loop, summary, var) != 1) return;
+
+    ir_instruction_t* store = NULL;
+    ir_block_t* store_block = NULL;
+    for (int b = 0; b < loop->block_count && !store; b++) {
+        ir_block_t* block = loop->blocks[b];
+        for (int i = 0; i < block->instruction_count; i++) {
+            if (block->instructions[i].op == IR_STORE && block->instructions[i].var.var_id == var) {
+                store = &block->instructions[i];
+                store_block = block;
+                break;
+            }
+        }
+    }
+
+    if (loops->innermost[store_block->id] != loop || !ir_dominates(store_block, loop->latch)) return;
+
+    ir_instruction_t* add = ir_fetch(function, store->var.value);
+    if (!add || (add->op != IR_ADD && add->op != IR_SUB) || function->index->owners[add->result] != store_block) return;
+
+    v_number_t step;
+    ir_id_t previous = add->generic.operands[0];
+    if (ir_loop_constant(function, add->generic.operands[1], &step)) {
+        if (add->op == IR_SUB) step = -step;
+    } else if (add->op == IR_ADD && ir_loop_constant(function, add->generic.operands[0], &step)) {
+        previous = add->generic.operands[1];
+    } else {
+        return;
+    }
+
+    if (step == 0 || ir_loop_load(function, previous) != var || function->index->owners[previous] != store_block) return;
+
+    loop->var = var;
+    loop->update = store->result;
+    loop->step = step;
+
+    if (loop->preheader) {
+        ir_block_t* pre = loop->preheader;
+
+        for (int i = pre->instruction_count - 1; i >= 0; i--) {
+            ir_instruction_t* instr = &pre->instructions[i];
+
+            if (instr->op == IR_CALL && ir_effect_has(ir_call_effect(summary, instr->result)->writes, var)) break;
+            if (instr->op == IR_STORE && instr->var.var_id == var) {
+                loop->has_init = ir_loop_constant(function, instr->var.value, &loop->init);
+                break;
+            }
+        }
+    }
+
+    loop->has_limit = ir_loop_constant(function, bound, &loop->limit);
+
+    // The body must be the side where the comparison holds
+    if (branch->branch.truthy != loop->body || !loop->has_init || !loop->has_limit) return;
+
+    if (below && step > 0) {
+        loop->trip = loop->init < loop->limit ? (loop->limit - loop->init + step - 1) / step : 0;
+    } else if (!below && step < 0) {
+        loop->trip = loop->init > loop->limit ? (loop->init - loop->limit - step - 1) / -step : 0;
+    }
+}
+
+/*
+ * Natural loops from the back edges of the dominator tree. Each loop
+ * records its preheader and latch when they are unique, the body and
+ * exit targets of the header's branch, and its basic induction variable.
+ */
+ir_loops_t* ir_loops(ir_function_t* function, call_summary_t* summary) {
+    ir_cfg_build(function);
+    ir_cfg_order(function);
+    ir_cfg_dominators(function);
+
+    ir_loops_t* loops = calloc(1, sizeof(ir_loops_t));
+    if (!loops) panic("Failed to allocate memory for loop analysis");
+
+    loops->size = function->next_block_id + 1;
+    loops->loops = malloc(sizeof(ir_loop_t) * (function->block_count + 1));
+    loops->innermost = calloc(loops->size, sizeof(ir_loop_t*));
+    int* latches = calloc(function->block_count + 1, sizeof(int));
+    ir_block_t** stack = malloc(sizeof(ir_block_t*) * (function->block_count + 1));
+
+    if (!loops->loops || !loops->innermost || !latches || !stack) panic("Failed to allocate memory for loop analysis");
+
+    for (int o = 0; o < function->order_count; o++) {
+        ir_block_t* block = function->order[o];
+        if (!block->region) continue;
+
+        for (int s = 0; s < block->successor_count; s++) {
+            ir_block_t* header = ir_block_find(function, block->successors[s]);
+            if (!header || header->region != block->region || !ir_dominates(header, block)) continue;
+
+            ir_loop_t* loop = ir_loop_at(loops, function, header);
+            latches[loop - loops->loops]++;
+            loop->latch = block;
+            ir_loop_fill(function, loop, block, stack);
+        }
+    }
+
+    for (int l = 0; l < loops->count; l++) {
+        ir_loop_t* loop = &loops->loops[l];
+        ir_block_t* header = loop->header;
+
+        if (latches[l] != 1) loop->latch = NULL;
+
+        for (int p = 0; p < header->predecessor_count; p++) {
+            ir_block_t* pred = ir_block_find(function, header->predecessors[p]);
+            if (!pred || loop->contains[pred->id]) continue;
+
+            loop->preheader = loop->preheader ? NULL : pred;
+            if (!loop->preheader) break;
+        }
+
+        if (loop->preheader && loop->preheader->successor_count != 1) loop->preheader = NULL;
+
+        ir_instruction_t* branch = ir_terminator(header);
+        if (branch && branch->op == IR_BRANCH) {
+            int truthy = ir_loop_has(loop, branch->branch.truthy);
+            int falsey = ir_loop_has(loop, branch->branch.falsey);
+
+            if (truthy != falsey) {
+                loop->body = truthy ? branch->branch.truthy : branch->branch.falsey;
+                loop->exit = truthy ? branch->branch.falsey : branch->branch.truthy;
+            }
+        }
+    }
+
+    // Smaller loops are nested inside larger ones that contain their header
+    for (int l = 0; l < loops->count; l++) {
+        ir_loop_t* loop = &loops->loops[l];
+
+        for (int b = 0; b < loop->block_count; b++) {
+            ir_loop_t** inner = &loops->innermost[loop->blocks[b]->id];
+            if (!*inner || (*inner)->block_count > loop->block_count) *inner = loop;
+        }
+
+        for (int k = 0; k < loops->count; k++) {
+            ir_loop_t* outer = &loops->loops[k];
+            if (outer == loop || outer->block_count <= loop->block_count || !ir_loop_has(outer, loop->header)) continue;
+            if (!loop->parent || outer->block_count < loop->parent->block_count) loop->parent = outer;
+        }
+    }
+
+    for (int l = 0; l < loops->count; l++) {
+        ir_loop_t* loop = &loops->loops[l];
+        for (ir_loop_t* parent = loop->parent; parent; parent = parent->parent) loop->depth++;
+
+        ir_loop_induction_var(function, loops, loop, summary);
+    }
+
+    free(latches);
+    free(stack);
+
+    return loops;
+}
+
+void ir_loops_free(ir_loops_t* loops) {
+    if (!loops) return;
+
+    for (int l = 0; l < loops->count; l++) {
+        free(loops->loops[l].contains);
+        free(loops->loops[l].blocks);
+    }
+
+    free(loops->loops);
+    free(loops->innermost);
+    free(loops);
+}
+
+static ir_id_t ir_loop_emit_binary(ir_function_t* function, ir_block_t* block, int at, ir_op_t op, ir_id_t l, ir_id_t r) {
+    ir_instruction_t* instr = ir_block_insert(function, block, at, op);
+    instr->type = IR_TYPE_NUMBER;
+    instr->generic.operand_count = 2;
+    instr->generic.operands = arena_alloc(function->arena, sizeof(ir_id_t) * 2);
+    instr->generic.operands[0] = l;
+    instr->generic.operands[1] = r;
+    ir_index_add(function, block, instr);
+
+    return instr->result;
+}
+
+static ir_id_t ir_loop_emit_var(ir_function_t* function, ir_block_t* block, int at, ir_op_t op, ir_var_t var, ir_id_t value) {
+    ir_instruction_t* instr = ir_block_insert(function, block, at, op);
+    instr->type = IR_TYPE_NUMBER;
+    instr->var.var_id = var;
+    instr->var.value = value;
+    ir_index_add(function, block, instr);
+
+    return instr->result;
+}
+
+static ir_id_t ir_loop_emit_number(ir_function_t* function, ir_block_t* block, int at, v_number_t number) {
+    ir_instruction_t* instr = ir_block_insert(function, block, at, IR_CONST_NUMBER);
+    instr->type = IR_TYPE_NUMBER;
+    instr->constant.value = (v_t) (number << 3) | TYPE_NUMBER;
+    ir_index_add(function, block, instr);
+
+    return instr->result;
+}
+
+/*
+ * Give a derived induction variable * i k its own variable, set to i * k
+ * in the preheader and stepped by k times the step of i right after i
+ * is updated, so the multiplication becomes a LOAD.
+ */
+static void ir_loop_reduce(ir_function_t* function, ir_loop_t* loop, call_summary_t* summary, ir_instruction_t* mul, ir_block_t* block) {
+    v_number_t factor;
+    ir_id_t induction = mul->generic.operands[0];
+    if (!ir_loop_constant(function, mul->generic.operands[1], &factor)) {
+        if (!ir_loop_constant(function, mul->generic.operands[0], &factor)) return;
+        induction = mul->generic.operands[1];
+    }
+
+    ir_instruction_t* load = ir_fetch(function, induction);
+    if (ir_loop_load(function, induction) != loop->var || function->index->owners[induction] != block) return;
+    if (ir_loop_clobbered(block, ir_loop_index(block, load), ir_loop_index(block, mul), loop->var, summary)) return;
+
+    ir_var_t var = ++function->var_id;
+    ir_id_t mul_id = mul->result;
+
+    ir_block_t* pre = loop->preheader;
+    int at = pre->instruction_count - 1;
+    ir_id_t initial = ir_loop_emit_var(function, pre, at, IR_LOAD, loop->var, -1);
+    ir_id_t scale = ir_loop_emit_number(function, pre, at + 1, factor);
+    ir_id_t product = ir_loop_emit_binary(function, pre, at + 2, IR_MUL, initial, scale);
+    ir_loop_emit_var(function, pre, at + 3, IR_STORE, var, product);
+
+    ir_block_t* update_block = function->index->owners[loop->update];
+    at = ir_loop_index(update_block, ir_fetch(function, loop->update)) + 1;
+    ir_id_t current = ir_loop_emit_var(function, update_block, at, IR_LOAD, var, -1);
+    ir_id_t stride = ir_loop_emit_number(function, update_block, at + 1, factor * loop->step);
+    ir_id_t next = ir_loop_emit_binary(function, update_block, at + 2, IR_ADD, current, stride);
+    ir_loop_emit_var(function, update_block, at + 3, IR_STORE, var, next);
+
+    // The multiplication may have moved while inserting
+    mul = ir_fetch(function, mul_id);
+    for (int k = 0; k < ir_operand_count(mul); k++) {
+        ir_index_unuse(function, *ir_operand(mul, k), mul->result);
+    }
+
+    mul->op = IR_LOAD;
+    mul->var.var_id = var;
+    mul->var.value = -1;
+}
+
+/*
+ * Strength-reduce derived induction variables. Each one adds a LOAD, ADD
+ * and STORE per iteration in exchange for a MUL, which only pays off
+ * when compiling, so the VM keeps the multiplication.
+ */
+void ir_induction(ir_function_t* function, ir_loops_t* loops, call_summary_t* summary) {
+    #ifdef JIT_OFF
+    return;
+    #endif
+
+    if (!function->config || !(function->config->flags & CONFIG_JIT)) return;
+
+    for (int l = 0; l < loops->count; l++) {
+        ir_loop_t* loop = &loops->loops[l];
+        if (loop->var < 0 || !loop->preheader) continue;
+
+        for (int b = 0; b < loop->block_count; b++) {
+            ir_block_t* block = loop->blocks[b];
+            if (loops->innermost[block->id] != loop) continue;
+
+            for (int i = 0; i < block->instruction_count; i++) {
+                ir_instruction_t* instr = &block->instructions[i];
+                if (instr->op != IR_MUL || instr->type != IR_TYPE_NUMBER) continue;
+
+                ir_loop_reduce(function, loop, summary, instr, block);
+            }
+        }
+    }
+}
+
+static int ir_loop_size(ir_loop_t* loop) {
+    int size = 0;
+    for (int b = 0; b < loop->block_count; b++) {
+        size += loop->blocks[b]->instruction_count;
+    }
+
+    return size;
+}
+
+/*
+ * A loop can be copied when it is innermost, entered only from its
+ * preheader, closed by a single latch, leaves only through the header
+ * and has no PHIs in the header.
+ */
+static int ir_unroll_shape(ir_loops_t* loops, ir_loop_t* loop) {
+    if (!loop->preheader || !loop->latch || !loop->body || !loop->exit) return 0;
+    if (loop->header->predecessor_count != 2) return 0;
+
+    for (int l = 0; l < loops->count; l++) {
+        if (loops->loops[l].parent == loop) return 0;
+    }
+
+    ir_instruction_t* entry = ir_terminator(loop->preheader);
+    ir_instruction_t* back = ir_terminator(loop->latch);
+    if (!entry || entry->op != IR_JUMP || !back || back->op != IR_JUMP) return 0;
+
+    for (int i = 0; i < loop->header->instruction_count; i++) {
+        if (loop->header->instructions[i].op == IR_PHI) return 0;
+    }
+
+    for (int b = 0; b < loop->block_count; b++) {
+        ir_block_t* block = loop->blocks[b];
+        if (block == loop->header) continue;
+
+        ir_instruction_t* terminator = ir_terminator(block);
+        if (!terminator || terminator->op == IR_RETURN) return 0;
+
+        for (int s = 0; s < block->successor_count; s++) {
+            ir_id_t id = block->successors[s];
+            if (id >= loop->contains_size || !loop->contains[id]) return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Copy every block of the loop as one iteration: the header copy jumps
+ * straight into the body copy and the back edge goes to next. Returns
+ * the header copy.
+ */
+static ir_block_t* ir_unroll_copy(ir_function_t* function, ir_loop_t* loop, ir_id_t* values, ir_block_t** clones, ir_block_t* next) {
+    for (int b = 0; b < loop->block_count; b++) {
+        ir_block_t* block = loop->blocks[b];
+        ir_block_t* clone = ir_create_block(function);
+        clones[block->id] = clone;
+
+        for (int i = 0; i < block->instruction_count; i++) {
+            ir_instruction_t* instr = &block->instructions[i];
+            ir_instruction_t* copy = ir_emit(instr->op, function, clone);
+            values[instr->result] = copy->result;
+        }
+    }
+
+    for (int b = 0; b < loop->block_count; b++) {
+        ir_block_t* block = loop->blocks[b];
+        ir_block_t* clone = clones[block->id];
+
+        for (int i = 0; i < block->instruction_count; i++) {
+            ir_clone_instruction(function, &clone->instructions[i], &block->instructions[i], values, clones);
+        }
+    }
+
+    ir_instruction_t* branch = ir_terminator(clones[loop->header->id]);
+    branch->op = IR_JUMP;
+    branch->jump.block = clones[loop->body->id];
+
+    ir_terminator(clones[loop->latch->id])->jump.block = next;
+
+    for (int b = 0; b < loop->block_count; b++) {
+        ir_block_t* clone = clones[loop->blocks[b]->id];
+
+        for (int i = 0; i < clone->instruction_count; i++) {
+            ir_index_add(function, clone, &clone->instructions[i]);
+        }
+    }
+
+    return clones[loop->header->id];
+}
+
+/* Retarget the preheader to the first copy, copies are built last to first */
+static void ir_unroll_enter(ir_loop_t* loop, ir_block_t* first) {
+    ir_terminator(loop->preheader)->jump.block = first;
+}
+
+/*
+ * Run the loop trip times as straight-line copies. The original header
+ * still evaluates the final test, which is known to fail, so it jumps
+ * to the exit and the rest of the loop is swept.
+ */
+static void ir_unroll_full(ir_function_t* function, ir_loop_t* loop, ir_id_t* values, ir_block_t** clones) {
+    ir_block_t* next = loop->header;
+    for (long k = 0; k < loop->trip; k++) {
+        next = ir_unroll_copy(function, loop, values, clones, next);
+    }
+
+    ir_unroll_enter(loop, next);
+
+    ir_instruction_t* branch = ir_terminator(loop->header);
+    ir_index_unuse(function, branch->branch.condition, branch->result);
+    branch->op = IR_JUMP;
+    branch->jump.block = loop->exit;
+}
+
+/*
+ * Whether the header only loads and compares, and the bound it tests
+ * cannot change inside the loop. Sets at to the comparison operand
+ * holding the induction variable.
+ */
+static int ir_unroll_counted(ir_function_t* function, ir_loop_t* loop, call_summary_t* summary, int* at) {
+    ir_block_t* header = loop->header;
+    if (ir_terminator(header)->branch.truthy != loop->body) return 0;
+
+    for (int i = 0; i < header->instruction_count; i++) {
+        switch (header->instructions[i].op) {
+            case IR_LOAD: case IR_CONST_NUMBER:
+            case IR_LT: case IR_GT: case IR_BRANCH:
+                break;
+            default:
+                return 0;
+        }
+    }
+
+    ir_instruction_t* condition = ir_fetch(function, ir_terminator(header)->branch.condition);
+    *at = ir_loop_load(function, condition->generic.operands[0]) == loop->var ? 0 : 1;
+
+    int below = (condition->op == IR_LT) == (*at == 0);
+    if (below != (loop->step > 0)) return 0;
+
+    ir_instruction_t* bound = ir_fetch(function, condition->generic.operands[!*at]);
+    if (!bound) return 0;
+
+    if (bound->op == IR_CONST_NUMBER) return 1;
+    if (bound->type != IR_TYPE_NUMBER) return 0;
+    if (bound->op == IR_LOAD && function->index->owners[bound->result] == header) {
+        return ir_loop_stores(loop, summary, bound->var.var_id) == 0;
+    }
+
+    return function->index->owners[bound->result] != header;
+}
+
+/*
+ * Run UNROLL_FACTOR iterations per test. A guard copied from the header
+ * checks that the induction variable still passes the test after the
+ * last of them, the original loop runs whatever remains.
+ */
+static void ir_unroll_partial(ir_function_t* function, ir_loop_t* loop, ir_id_t* values, ir_block_t** clones, int at) {
+    ir_block_t* header = loop->header;
+    ir_block_t* guard = ir_create_block(function);
+    ir_id_t condition = ir_terminator(header)->branch.condition;
+
+    for (int i = 0; i < header->instruction_count; i++) {
+        ir_instruction_t* instr = &header->instructions[i];
+        ir_id_t ahead = -1;
+
+        if (instr->result == condition) {
+            ir_id_t induction = ir_clone_value(values, instr->generic.operands[at]);
+
+            ir_instruction_t* stride = ir_emit(IR_CONST_NUMBER, function, guard);
+            stride->type = IR_TYPE_NUMBER;
+            stride->constant.value = (v_t) ((loop->step * (UNROLL_FACTOR - 1)) << 3) | TYPE_NUMBER;
+            ir_index_add(function, guard, stride);
+
+            ir_instruction_t* add = ir_emit(IR_ADD, function, guard);
+            add->type = IR_TYPE_NUMBER;
+            add->generic.operand_count = 2;
+            add->generic.operands = arena_alloc(function->arena, sizeof(ir_id_t) * 2);
+            add->generic.operands[0] = induction;
+            add->generic.operands[1] = stride->result;
+            ir_index_add(function, guard, add);
+
+            ahead = add->result;
+        }
+
+        ir_instruction_t* copy = ir_emit(instr->op, function, guard);
+        ir_clone_instruction(function, copy, instr, values, clones);
+        if (ahead != -1) copy->generic.operands[at] = ahead;
+
+        values[instr->result] = copy->result;
+        ir_index_add(function, guard, copy);
+    }
+
+    ir_block_t* next = guard;
+    for (int k = 0; k < UNROLL_FACTOR; k++) {
+        next = ir_unroll_copy(function, loop, values, clones, next);
+    }
+
+    ir_instruction_t* branch = ir_terminator(guard);
+    branch->branch.truthy = next;
+    branch->branch.falsey = header;
+
+    ir_unroll_enter(loop, guard);
+}
+
+/*
+ * Unroll innermost loops with a known induction variable. Returns
+ * whether anything changed, the CFG needs rebuilding when it did.
+ */
+int ir_unroll(ir_function_t* function, ir_loops_t* loops, call_summary_t* summary) {
+    int budget = UNROLL_BUDGET;
+    int unrolled = 0;
+
+    int n = function->next_value_id;
+    ir_id_t* values = malloc(sizeof(ir_id_t) * (n + 1));
+    ir_block_t** clones = calloc(function->next_block_id + 1, sizeof(ir_block_t*));
+    if (!values || !clones) panic("Failed to allocate memory for unrolling");
+
+    for (int i = 0; i < n; i++) {
+        values[i] = -1;
+    }
+
+    for (int l = 0; l < loops->count; l++) {
+        ir_loop_t* loop = &loops->loops[l];
+        if (loop->var < 0 || !ir_unroll_shape(loops, loop)) continue;
+
+        int size = ir_loop_size(loop);
+        int at;
+
+        if (loop->trip >= 0 && loop->trip <= UNROLL_TRIP && size * loop->trip <= UNROLL_FULL_SIZE && size * loop->trip <= budget) {
+            ir_unroll_full(function, loop, values, clones);
+            budget -= size * loop->trip;
+        } else if (size <= UNROLL_SIZE && size * UNROLL_FACTOR <= budget && ir_unroll_counted(function, loop, summary, &at)) {
+            ir_unroll_partial(function, loop, values, clones, at);
+            budget -= size * UNROLL_FACTOR;
+        } else {
+            continue;
+        }
+
+        unrolled++;
+
+        for (int b = 0; b < loop->block_count; b++) {
+            ir_block_t* block = loop->blocks[b];
+            clones[block->id] = NULL;
+
+            for (int i = 0; i < block->instruction_count; i++) {
+                values[block->instructions[i].result] = -1;
+            }
+        }
+    }
+
+    free(values);
+    free(clones);
+
+    return unrolled;
+}
+
+/*
+ * A loop with a single way in through its preheader and a single way
+ * out from the header to an exit that nothing else reaches.
+ */
+static int ir_builder_shape(ir_loop_t* loop) {
+    if (!loop->preheader || !loop->exit || loop->exit->predecessor_count != 1) return 0;
+
+    ir_instruction_t* entry = ir_terminator(loop->preheader);
+    if (!entry || entry->op != IR_JUMP) return 0;
+
+    for (int b = 0; b < loop->block_count; b++) {
+        ir_block_t* block = loop->blocks[b];
+
+        ir_instruction_t* terminator = ir_terminator(block);
+        if (!terminator || terminator->op == IR_RETURN) return 0;
+
+        for (int s = 0; s < block->successor_count; s++) {
+            ir_id_t id = block->successors[s];
+            if (id < loop->contains_size && loop->contains[id]) continue;
+            if (block != loop->header || id != loop->exit->id) return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* The ADD of STORE var (ADD (LOAD var) piece), when nothing else sees the old value */
+static ir_instruction_t* ir_builder_append(ir_function_t* function, ir_block_t* block, ir_instruction_t* store, call_summary_t* summary) {
+    ir_var_t var = store->var.var_id;
+
+    ir_instruction_t* add = ir_fetch(function, store->var.value);
+    if (!add || add->op != IR_ADD || ir_use_count(function, add->result) != 1) return NULL;
+    if (add->type != IR_TYPE_STRING && add->type != IR_TYPE_ARRAY) return NULL;
+
+    ir_instruction_t* load = ir_fetch(function, add->generic.operands[0]);
+    if (!load || load->op != IR_LOAD || load->var.var_id != var || ir_use_count(function, load->result) != 1) return NULL;
+    if (function->index->owners[load->result] != block) return NULL;
+
+    if (ir_loop_clobbered(block, ir_loop_index(block, load), ir_loop_index(block, store), var, summary)) return NULL;
+
+    return add;
+}
+
+/* Whether a LOAD only feeds an append to the variable it reads */
+static int ir_builder_owned(ir_function_t* function, ir_instruction_t* load, call_summary_t* summary) {
+    ir_instruction_t* add = ir_first_use(function, load->result);
+    if (ir_use_count(function, load->result) != 1 || add->op != IR_ADD || add->generic.operands[0] != load->result) return 0;
+
+    ir_instruction_t* store = ir_first_use(function, add->result);
+    if (!store || store->op != IR_STORE || store->var.var_id != load->var.var_id) return 0;
+
+    return ir_builder_append(function, function->index->owners[store->result], store, summary) == add;
+}
+
+static ir_id_t ir_builder_emit(ir_function_t* function, ir_block_t* block, int at, ir_op_t op, ir_type_t type, ir_id_t operand) {
+    ir_instruction_t* instr = ir_block_insert(function, block, at, op);
+    instr->type = type;
+    instr->generic.operand_count = 1;
+    instr->generic.operands = arena_alloc(function->arena, sizeof(ir_id_t));
+    instr->generic.operands[0] = operand;
+    ir_index_add(function, block, instr);
+
+    return instr->result;
+}
+
+/* Write the builder's contents back to the variable before index at */
+static void ir_builder_flush(ir_function_t* function, ir_block_t* block, int at, ir_var_t var, ir_id_t builder, ir_type_t type) {
+    ir_id_t value = ir_builder_emit(function, block, at, IR_FINISH, type, builder);
+    ir_id_t store = ir_loop_emit_var(function, block, at + 1, IR_STORE, var, value);
+    ir_fetch(function, store)->type = type;
+}
+
+/*
+ * Whether var is only appended to inside the loop. Every other read,
+ * directly or by a call, is collected in reads and sees a flushed copy.
+ * A read that runs on every iteration would flush as often as the ADD
+ * copied before, so the variable is left alone.
+ */
+static int ir_builder_candidate(ir_function_t* function, ir_loop_t* loop, call_summary_t* summary, ir_var_t var, ir_id_t* reads, int* read_count) {
+    int appends = 0;
+    int stores = ir_loop_stores(loop, summary, var);
+    *read_count = 0;
+
+    for (int b = 0; b < loop->block_count; b++) {
+        ir_block_t* block = loop->blocks[b];
+
+        for (int i = 0; i < block->instruction_count; i++) {
+            ir_instruction_t* instr = &block->instructions[i];
+            int read = 0;
+
+            if (instr->op == IR_STORE && instr->var.var_id == var) {
+                if (!ir_builder_append(function, block, instr, summary)) return 0;
+                appends++;
+            } else if (instr->op == IR_LOAD && instr->var.var_id == var) {
+                read = !ir_builder_owned(function, instr, summary);
+            } else if (instr->op == IR_CALL) {
+                read = ir_effect_has(ir_call_effect(summary, instr->result)->reads, var);
+            }
+
+            if (read) {
+                if (ir_dominates(block, loop->latch)) return 0;
+                reads[(*read_count)++] = instr->result;
+            }
+        }
+    }
+
+    return appends > 0 && appends == stores;
+}
+
+/*
+ * Replace a variable that a loop only appends to with a builder made
+ * from its value in the preheader. Appends grow the builder in place
+ * and the variable gets its contents back on the way out, so building
+ * a string of n pieces no longer copies it n times.
+ */
+static void ir_builder_lower(ir_function_t* function, ir_loop_t* loop, ir_var_t var, ir_type_t type, ir_id_t* reads, int read_count) {
+    ir_block_t* pre = loop->preheader;
+    int at = pre->instruction_count - 1;
+
+    ir_id_t initial = ir_loop_emit_var(function, pre, at, IR_LOAD, var, -1);
+    ir_fetch(function, initial)->type = type;
+    ir_id_t builder = ir_builder_emit(function, pre, at + 1, IR_BUILD, type, initial);
+
+    for (int b = 0; b < loop->block_count; b++) {
+        ir_block_t* block = loop->blocks[b];
+
+        for (int i = 0; i < block->instruction_count; i++) {
+            ir_instruction_t* store = &block->instructions[i];
+            if (store->op != IR_STORE || store->var.var_id != var) continue;
+
+            ir_instruction_t* add = ir_fetch(function, store->var.value);
+            ir_index_unuse(function, add->result, store->result);
+
+            store->op = IR_APPEND;
+            store->generic.operand_count = 2;
+            store->generic.operands = arena_alloc(function->arena, sizeof(ir_id_t) * 2);
+            store->generic.operands[0] = builder;
+            store->generic.operands[1] = add->generic.operands[1];
+            ir_index_add(function, block, store);
+        }
+    }
+
+    for (int r = 0; r < read_count; r++) {
+        ir_instruction_t* read = ir_fetch(function, reads[r]);
+        ir_block_t* block = function->index->owners[reads[r]];
+
+        // A call keeps its SAVE right in front of it
+        int at = ir_loop_index(block, read);
+        if (at > 0 && block->instructions[at - 1].op == IR_SAVE) at--;
+
+        ir_builder_flush(function, block, at, var, builder, type);
+    }
+
+    ir_block_t* exit = loop->exit;
+    int first = 0;
+    while (first < exit->instruction_count && exit->instructions[first].op == IR_PHI) first++;
+
+    ir_builder_flush(function, exit, first, var, builder, type);
+}
+
+/*
+ * Turn loop-carried string and list accumulators into builders. Outer
+ * loops go first, an inner loop then sees the appends already lowered.
+ * Runs before ir_unroll, which copies the appends like anything else.
+ */
+int ir_builder(ir_function_t* function, ir_loops_t* loops, call_summary_t* summary) {
+    ir_types(function);
+
+    int vars = function->var_id + 1;
+    char* seen = malloc(vars);
+    ir_id_t* reads = malloc(sizeof(ir_id_t) * (function->next_value_id + 1));
+    if (!seen || !reads) panic("Failed to allocate memory for builder lowering");
+
+    int lowered = 0;
+    int deepest = 0;
+    for (int l = 0; l < loops->count; l++) {
+        if (loops->loops[l].depth > deepest) deepest = loops->loops[l].depth;
+    }
+
+    for (int depth = 0; depth <= deepest; depth++) {
+        for (int l = 0; l < loops->count; l++) {
+            ir_loop_t* loop = &loops->loops[l];
+            if (loop->depth != depth || !loop->latch || !ir_builder_shape(loop)) continue;
+
+            // Short loops are unrolled, their concatenations fold instead
+            if (loop->trip >= 0 && loop->trip <= UNROLL_TRIP) continue;
+
+            memset(seen, 0, vars);
+
+            for (int b = 0; b < loop->block_count; b++) {
+                ir_block_t* block = loop->blocks[b];
+
+                for (int i = 0; i < block->instruction_count; i++) {
+                    ir_instruction_t* instr = &block->instructions[i];
+                    if (instr->op != IR_STORE || seen[instr->var.var_id]) continue;
+
+                    ir_var_t var = instr->var.var_id;
+                    seen[var] = 1;
+
+                    ir_instruction_t* add = ir_builder_append(function, block, instr, summary);
+                    int read_count;
+                    if (!add || !ir_builder_candidate(function, loop, summary, var, reads, &read_count)) continue;
+
+                    ir_builder_lower(function, loop, var, add->type, reads, read_count);
+                    lowered++;
+
+                    // Lowering inserted instructions, start the block over
+                    i = -1;
+                }
+            }
+        }
+    }
+
+    free(seen);
+    free(reads);
+
+    return lowered;
+}
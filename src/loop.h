@@ -0,0 +1,64 @@
+#ifndef LOOP_H
+#define LOOP_H
+
+#include "ir.h"
+#include "call.h"
+
+// Loops of at most UNROLL_TRIP iterations and UNROLL_FULL_SIZE copied instructions are unrolled fully
+#define UNROLL_TRIP 16
+#define UNROLL_FULL_SIZE 192
+
+// Other counted loops of at most UNROLL_SIZE instructions run UNROLL_FACTOR iterations per check
+#define UNROLL_SIZE 32
+#define UNROLL_FACTOR 4
+#define UNROLL_BUDGET 2048
+
+typedef struct ir_loop {
+    ir_block_t* header;
+    ir_block_t* preheader;
+    ir_block_t* latch;
+    ir_block_t* body;
+    ir_block_t* exit;
+
+    // Member blocks, and membership by block id
+    ir_block_t** blocks;
+    int block_count;
+    char* contains;
+    int contains_size;
+
+    struct ir_loop* parent;
+    int depth;
+
+    // Basic induction variable tested by the header, or -1
+    ir_var_t var;
+    ir_id_t update;
+    v_number_t step;
+    v_number_t init;
+    v_number_t limit;
+    int has_init;
+    int has_limit;
+
+    // Iterations when init and limit are constants, -1 otherwise
+    long trip;
+} ir_loop_t;
+
+typedef struct ir_loops {
+    ir_loop_t* loops;
+    int count;
+    int size;
+
+    // Innermost loop of every block by id, or NULL
+    ir_loop_t** innermost;
+} ir_loops_t;
+
+static inline int ir_loop_has(ir_loop_t* loop, ir_block_t* block) {
+    return block->id < loop->contains_size && loop->contains[block->id];
+}
+
+ir_loops_t* ir_loops(ir_function_t* function, call_summary_t* summary);
+void ir_loops_free(ir_loops_t* loops);
+void ir_induction(ir_function_t* function, ir_loops_t* loops, call_summary_t* summary);
+int ir_unroll(ir_function_t* function, ir_loops_t* loops, call_summary_t* summary);
+int ir_builder(ir_function_t* function, ir_loops_t* loops, call_summary_t* summary);
+
+#endif
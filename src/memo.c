@@ -0,0 +1,76 @@
+#include "memo.h"
+#include "cfg.h"
+#include "opt.h"
+
+static int ir_memo_calls(ir_function_t* function, ir_block_t* root) {
+    for (int b = 0; b < function->block_count; b++) {
+        ir_block_t* block = function->blocks[b];
+        if (block->region != root) continue;
+
+        for (int i = 0; i < block->instruction_count; i++) {
+            if (block->instructions[i].op == IR_CALL) return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * A BLOCK body is pure when neither it nor anything it calls does I/O,
+ * so running it again with the same variables gives the same result
+ * and the same writes. Only bodies that call something are memoized,
+ * anything smaller costs more to hash than to run. Returns the number
+ * of memoized bodies, the VM keeps their tables.
+ */
+int ir_memo(ir_function_t* function, call_summary_t* summary) {
+    #ifndef JIT_OFF
+    if (function->config->flags & CONFIG_JIT) {
+        info((*function->config), "Memoization skipped, only the VM keeps memo tables");
+        return 0;
+    }
+    #endif
+
+    function->memos = arena_alloc(function->arena, sizeof(ir_memo_t) * (summary->region_count + 1));
+    function->memo_count = 0;
+
+    // Region 0 is the main program
+    for (int r = 1; r < summary->region_count; r++) {
+        call_effect_t* effect = &summary->effects[r];
+        ir_block_t* root = summary->roots[r];
+        if (effect->io || !ir_memo_calls(function, root)) continue;
+
+        ir_var_t vars[MEMO_VARS];
+        int count = 0;
+        int writes = 0;
+
+        // Written variables first, their values after the call are stored too
+        for (int pass = 0; pass < 2 && count <= MEMO_VARS; pass++) {
+            for (ir_var_t var = 0; var <= function->var_id; var++) {
+                int written = ir_effect_has(effect->writes, var);
+                if (pass == 0 ? !written : written || !ir_effect_has(effect->reads, var)) continue;
+
+                if (count == MEMO_VARS) {
+                    count++;
+                    break;
+                }
+
+                vars[count++] = var;
+            }
+
+            if (pass == 0) writes = count;
+        }
+
+        if (count > MEMO_VARS) continue;
+
+        ir_memo_t* memo = &function->memos[function->memo_count];
+        memo->region = root;
+        memo->var_count = count;
+        memo->write_count = writes;
+        memo->vars = arena_alloc(function->arena, sizeof(ir_var_t) * (count + 1));
+        memcpy(memo->vars, vars, sizeof(ir_var_t) * count);
+
+        root->memo = function->memo_count++;
+    }
+
+    return function->memo_count;
+}
@@ -0,0 +1,12 @@
+#ifndef MEMO_H
+#define MEMO_H
+
+#include "ir.h"
+#include "call.h"
+
+// Bodies depending on more variables than this are not worth hashing
+#define MEMO_VARS 16
+
+int ir_memo(ir_function_t* function, call_summary_t* summary);
+
+#endif
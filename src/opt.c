@@ -1,6 +1,159 @@
 #include "opt.h"
+#include "call.h"
+#include "pass.h"
 #include "jit/reg.h"
 
+static void ir_index_grow(ir_index_t* index, int size) {
+    if (size <= index->size) return;
+
+    int capacity = index->size ? index->size : 64;
+    while (capacity < size) capacity *= 2;
+
+    index->defs = realloc(index->defs, sizeof(ir_instruction_t*) * capacity);
+    index->owners = realloc(index->owners, sizeof(ir_block_t*) * capacity);
+    index->uses = realloc(index->uses, sizeof(ir_id_t*) * capacity);
+    index->use_count = realloc(index->use_count, sizeof(int) * capacity);
+    index->use_capacity = realloc(index->use_capacity, sizeof(int) * capacity);
+
+    if (!index->defs || !index->owners || !index->uses || !index->use_count || !index->use_capacity) {
+        panic("Failed to allocate memory for IR index");
+    }
+
+    for (int i = index->size; i < capacity; i++) {
+        index->defs[i] = NULL;
+        index->owners[i] = NULL;
+        index->uses[i] = NULL;
+        index->use_count[i] = 0;
+        index->use_capacity[i] = 0;
+    }
+
+    index->size = capacity;
+}
+
+void ir_index_use(ir_function_t* function, ir_id_t value, ir_id_t user) {
+    ir_index_t* index = function->index;
+    if (value < 0) return;
+    ir_index_grow(index, value + 1);
+
+    if (index->use_count[value] >= index->use_capacity[value]) {
+        index->use_capacity[value] = index->use_capacity[value] ? index->use_capacity[value] * 2 : 4;
+        index->uses[value] = realloc(index->uses[value], sizeof(ir_id_t) * index->use_capacity[value]);
+        if (!index->uses[value]) panic("Failed to allocate memory for use list of %d", value);
+    }
+
+    index->uses[value][index->use_count[value]++] = user;
+}
+
+void ir_index_unuse(ir_function_t* function, ir_id_t value, ir_id_t user) {
+    ir_index_t* index = function->index;
+    if (value < 0 || value >= index->size) return;
+
+    for (int i = 0; i < index->use_count[value]; i++) {
+        if (index->uses[value][i] == user) {
+            index->uses[value][i] = index->uses[value][--index->use_count[value]];
+            return;
+        }
+    }
+}
+
+void ir_index_add(ir_function_t* function, ir_block_t* block, ir_instruction_t* instr) {
+    ir_index_t* index = function->index;
+    ir_index_grow(index, instr->result + 1);
+
+    index->defs[instr->result] = instr;
+    index->owners[instr->result] = block;
+
+    for (int k = 0; k < ir_operand_count(instr); k++) {
+        ir_index_use(function, *ir_operand(instr, k), instr->result);
+    }
+}
+
+void ir_index_remove(ir_function_t* function, ir_instruction_t* instr) {
+    ir_index_t* index = function->index;
+
+    for (int k = 0; k < ir_operand_count(instr); k++) {
+        ir_index_unuse(function, *ir_operand(instr, k), instr->result);
+    }
+
+    if (instr->result >= 0 && instr->result < index->size) {
+        index->defs[instr->result] = NULL;
+        index->owners[instr->result] = NULL;
+    }
+}
+
+/* Re-point the def table after a block's instruction array moved or was compacted */
+void ir_index_block(ir_function_t* function, ir_block_t* block) {
+    ir_index_t* index = function->index;
+
+    for (int i = 0; i < block->instruction_count; i++) {
+        ir_instruction_t* instr = &block->instructions[i];
+        ir_index_grow(index, instr->result + 1);
+
+        index->defs[instr->result] = instr;
+        index->owners[instr->result] = block;
+    }
+}
+
+void ir_index_replace(ir_function_t* function, ir_instruction_t* instr, int k, ir_id_t value) {
+    ir_id_t* operand = ir_operand(instr, k);
+    if (*operand == value) return;
+
+    ir_index_unuse(function, *operand, instr->result);
+    *operand = value;
+    ir_index_use(function, value, instr->result);
+}
+
+void ir_replace_uses(ir_function_t* function, ir_id_t from, ir_id_t to) {
+    ir_index_t* index = function->index;
+    if (from == to || from < 0 || from >= index->size) return;
+
+    while (index->use_count[from] > 0) {
+        ir_instruction_t* user = index->defs[index->uses[from][0]];
+
+        for (int k = 0; k < ir_operand_count(user); k++) {
+            if (*ir_operand(user, k) == from) {
+                ir_index_replace(function, user, k, to);
+                break;
+            }
+        }
+    }
+}
+
+void ir_index_build(ir_function_t* function) {
+    ir_index_free(function);
+
+    ir_index_t* index = calloc(1, sizeof(ir_index_t));
+    if (!index) panic("Failed to allocate memory for IR index");
+
+    function->index = index;
+    ir_index_grow(index, function->next_value_id);
+
+    for (int b = 0; b < function->block_count; b++) {
+        ir_block_t* block = function->blocks[b];
+        for (int i = 0; i < block->instruction_count; i++) {
+            ir_index_add(function, block, &block->instructions[i]);
+        }
+    }
+}
+
+void ir_index_free(ir_function_t* function) {
+    ir_index_t* index = function->index;
+    if (!index) return;
+
+    for (int i = 0; i < index->size; i++) {
+        free(index->uses[i]);
+    }
+
+    free(index->defs);
+    free(index->owners);
+    free(index->uses);
+    free(index->use_count);
+    free(index->use_capacity);
+    free(index);
+
+    function->index = NULL;
+}
+
 void ir_fold(ir_function_t* function) {
     for (int i = 0; i < function->block_count; i++) {
         ir_block_t* block = function->blocks[i];
@@ -12,8 +165,8 @@ void ir_fold(ir_function_t* function) {
                 || instr->op == IR_MOD || instr->op == IR_GT || instr->op == IR_LT || instr->op == IR_EQ
                 || instr->op == IR_POW
             ) {
-                ir_instruction_t* l = ir_fetch(block, instr->generic.operands[0]);
-                ir_instruction_t* r = ir_fetch(block, instr->generic.operands[1]);
+                ir_instruction_t* l = ir_fetch(function, instr->generic.operands[0]);
+                ir_instruction_t* r = ir_fetch(function, instr->generic.operands[1]);
 
                 if (!l || !r) continue;
                 if (!ir_is_constant(l) || !ir_is_constant(r)) continue;
@@ -36,12 +189,12 @@ void ir_fold(ir_function_t* function) {
                     default: continue;
                 }
 
-                ir_to_const(instr, result);
+                ir_to_const(function, instr, result);
             } else if (
                 instr->op == IR_LENGTH || instr->op == IR_BOX || instr->op == IR_ASCII  || instr->op == IR_NOT || instr->op == IR_NEG
                 || instr->op == IR_PRIME || instr->op == IR_ULTIMATE
             ) {
-                ir_instruction_t* operand = ir_fetch(block, instr->generic.operands[0]);
+                ir_instruction_t* operand = ir_fetch(function, instr->generic.operands[0]);
                 if (!operand || !ir_is_constant(operand)) continue;
 
                 v_t value = operand->constant.value;
@@ -58,11 +211,11 @@ void ir_fold(ir_function_t* function) {
                     default: continue;
                 }
 
-                ir_to_const(instr, result);
+                ir_to_const(function, instr, result);
             } else if (instr->op == IR_GET) {
-                ir_instruction_t* value = ir_fetch(block, instr->generic.operands[0]);
-                ir_instruction_t* index = ir_fetch(block, instr->generic.operands[1]);
-                ir_instruction_t* range = ir_fetch(block, instr->generic.operands[2]);
+                ir_instruction_t* value = ir_fetch(function, instr->generic.operands[0]);
+                ir_instruction_t* index = ir_fetch(function, instr->generic.operands[1]);
+                ir_instruction_t* range = ir_fetch(function, instr->generic.operands[2]);
 
                 if (!value || !index || !range || !ir_is_constant(value) || !ir_is_constant(index) || !ir_is_constant(range)) {
                     continue;
@@ -73,184 +226,771 @@ void ir_fold(ir_function_t* function) {
                 v_t r = range->constant.value;
 
                 v_t result = vm_get(v, idx, r);
-                ir_to_const(instr, result);
+                ir_to_const(function, instr, result);
             }
         }
     }
 }
 
-void ir_drop(ir_function_t* function) {
-    for (int b = 0; b < function->block_count; b++) {
-        ir_block_t* block = function->blocks[b];
+static int ir_type_operand(ir_function_t* function, char* pending, ir_id_t value) {
+    ir_instruction_t* def = ir_fetch(function, value);
+    if (!def) return IR_TYPE_ANY;
 
-        int count = 0;
-        for (int i = 0; i < block->instruction_count; i++) {
-            ir_instruction_t* instr = &block->instructions[i];
-            int preserve =
-                instr->op == IR_OUTPUT ||
-                instr->op == IR_DUMP   ||
-                instr->op == IR_STORE  ||
-                instr->op == IR_RETURN ||
-                instr->op == IR_BRANCH ||
-                instr->op == IR_JUMP   ||
-                instr->op == IR_CALL   ||
-                instr->op == IR_QUIT   ||
-                instr->op == IR_SAVE   ||
-                instr->op == IR_RESTORE;
-            if (ir_first_use(function, instr->result) || preserve) {
-                if (count != i) block->instructions[count] = block->instructions[i];
-                count++;
+    return pending[value] ? -1 : (int) def->type;
+}
+
+/* Result type of an instruction, or -1 while an operand is still unknown */
+static int ir_type_transfer(ir_function_t* function, char* pending, int* vars, ir_instruction_t* instr) {
+    int left = -1;
+    if (ir_operand_count(instr) > 0 && instr->op != IR_PHI) {
+        left = ir_type_operand(function, pending, *ir_operand(instr, 0));
+    }
+
+    switch (instr->op) {
+        case IR_CONST_NUMBER: case IR_RANDOM: case IR_LENGTH:
+        case IR_SUB: case IR_DIV: case IR_MOD: case IR_NEG:
+            return IR_TYPE_NUMBER;
+        case IR_CONST_STRING:
+            return IR_TYPE_STRING;
+        case IR_CONST_BOOLEAN: case IR_LT: case IR_GT: case IR_EQ: case IR_NOT:
+            return IR_TYPE_BOOLEAN;
+        case IR_CONST_NULL:
+            return IR_TYPE_NULL;
+        case IR_CONST_ARRAY: case IR_BOX:
+            return IR_TYPE_ARRAY;
+        case IR_BLOCK:
+            return IR_TYPE_BLOCK;
+        case IR_LOAD:
+            return vars[instr->var.var_id];
+        case IR_ADD: case IR_MUL:
+            if (left == IR_TYPE_NUMBER || left == IR_TYPE_STRING || left == IR_TYPE_ARRAY || left == -1) return left;
+            return IR_TYPE_ANY;
+        case IR_POW:
+            if (left == -1) return -1;
+            if (left == IR_TYPE_NUMBER) return IR_TYPE_NUMBER;
+            return left == IR_TYPE_ARRAY ? IR_TYPE_STRING : IR_TYPE_ANY;
+        case IR_ASCII:
+            if (left == -1) return -1;
+            if (left == IR_TYPE_NUMBER) return IR_TYPE_STRING;
+            return left == IR_TYPE_STRING ? IR_TYPE_NUMBER : IR_TYPE_ANY;
+        case IR_PRIME:
+            if (left == -1) return -1;
+            return left == IR_TYPE_STRING ? IR_TYPE_STRING : IR_TYPE_ANY;
+        case IR_BUILD: case IR_FINISH:
+            return left;
+        case IR_ULTIMATE: case IR_GET: case IR_SET:
+            if (left == IR_TYPE_STRING || left == IR_TYPE_ARRAY || left == -1) return left;
+            return IR_TYPE_ANY;
+        case IR_PHI: {
+            int type = -1;
+            for (int k = 0; k < instr->phi.phi_count; k++) {
+                int entry = ir_type_operand(function, pending, instr->phi.phi_values[k]);
+                if (entry == -1) continue;
+                if (type != -1 && type != entry) return IR_TYPE_ANY;
+                type = entry;
             }
+
+            return type;
         }
-        block->instruction_count = count;
+        default:
+            return IR_TYPE_ANY;
     }
 }
 
-opt_liveness_t* ir_ranges(ir_function_t* function) {
+/*
+ * Infer the type of every value. A LOAD can only produce something that
+ * was stored to its variable, so variables get the join of their STOREs.
+ * Loop PHIs and variables start out unknown and only widen, so a counter
+ * that stays a number is proven one.
+ */
+void ir_types(ir_function_t* function) {
     int n = function->next_value_id;
-    opt_liveness_t* tracked = malloc(sizeof(opt_liveness_t) * n);
-    if (!tracked) panic("Failed to allocate memory for liveness analysis");
+    char* pending = malloc(n + 1);
+    int* vars = malloc(sizeof(int) * (function->var_id + 1));
+    if (!pending || !vars) panic("Failed to allocate memory for type inference");
 
-    for (int i = 0; i < n; i++) {
-        tracked[i].start = -1;
-        tracked[i].end = -1;
-        tracked[i].id = i;
+    memset(pending, 1, n + 1);
+    for (int v = 0; v <= function->var_id; v++) {
+        vars[v] = -1;
+    }
+
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+
+        for (int b = 0; b < function->block_count; b++) {
+            ir_block_t* block = function->blocks[b];
+
+            for (int i = 0; i < block->instruction_count; i++) {
+                ir_instruction_t* instr = &block->instructions[i];
+
+                if (instr->op == IR_STORE) {
+                    int value = ir_type_operand(function, pending, instr->var.value);
+                    int* var = &vars[instr->var.var_id];
+
+                    if (value != -1 && *var != value && *var != IR_TYPE_ANY) {
+                        *var = *var == -1 ? value : IR_TYPE_ANY;
+                        changed = 1;
+                    }
+                }
+
+                int type = ir_type_transfer(function, pending, vars, instr);
+                if (type == -1) continue;
+
+                if (pending[instr->result] || instr->type != (ir_type_t) type) {
+                    pending[instr->result] = 0;
+                    instr->type = type;
+                    changed = 1;
+                }
+            }
+        }
+    }
+
+    for (int b = 0; b < function->block_count; b++) {
+        ir_block_t* block = function->blocks[b];
+
+        for (int i = 0; i < block->instruction_count; i++) {
+            if (pending[block->instructions[i].result]) block->instructions[i].type = IR_TYPE_ANY;
+        }
     }
 
+    free(pending);
+    free(vars);
+}
+
+static inline int ir_is_number(ir_function_t* function, ir_id_t value, v_number_t number) {
+    ir_instruction_t* def = ir_fetch(function, value);
+    return def && def->op == IR_CONST_NUMBER && (v_number_t) def->constant.value >> 3 == number;
+}
+
+static inline int ir_is_constant_value(ir_function_t* function, ir_id_t value) {
+    ir_instruction_t* def = ir_fetch(function, value);
+    return def && ir_is_constant(def);
+}
+
+static inline ir_type_t ir_type(ir_function_t* function, ir_id_t value) {
+    ir_instruction_t* def = ir_fetch(function, value);
+    return def ? def->type : IR_TYPE_ANY;
+}
+
+static void ir_simplify_to(ir_function_t* function, ir_instruction_t* instr, ir_id_t value) {
+    ir_replace_uses(function, instr->result, value);
+}
+
+/*
+ * Algebraic identities and strength reduction on proven types. Knight
+ * coerces the right operand to the type of the left one, so a rewrite
+ * that drops an operation only applies when the kept operand already has
+ * the type the operation would produce.
+ */
+void ir_simplify(ir_function_t* function) {
+    ir_types(function);
+
     for (int b = 0; b < function->block_count; b++) {
         ir_block_t* block = function->blocks[b];
 
         for (int i = 0; i < block->instruction_count; i++) {
             ir_instruction_t* instr = &block->instructions[i];
-            ir_id_t id = instr->result;
 
-            if (id >= 0 && id < n) {
-                if (tracked[id].start == -1)
-                    tracked[id].start = id;
-                tracked[id].end = id;
+            if (instr->op == IR_BRANCH) {
+                ir_instruction_t* condition = ir_fetch(function, instr->branch.condition);
+                if (!condition || condition->op != IR_NOT) continue;
+
+                ir_block_t* truthy = instr->branch.truthy;
+                instr->branch.truthy = instr->branch.falsey;
+                instr->branch.falsey = truthy;
+                ir_index_replace(function, instr, 0, condition->generic.operands[0]);
+                continue;
             }
 
+            if (instr->op == IR_NOT) {
+                ir_instruction_t* inner = ir_fetch(function, instr->generic.operands[0]);
+                if (inner && inner->op == IR_NOT && ir_type(function, inner->generic.operands[0]) == IR_TYPE_BOOLEAN) {
+                    ir_simplify_to(function, instr, inner->generic.operands[0]);
+                }
+                continue;
+            }
+
+            if (instr->op < IR_ADD || instr->op > IR_EQ || instr->op == IR_NEG) continue;
+
+            ir_id_t l = instr->generic.operands[0];
+            ir_id_t r = instr->generic.operands[1];
+            ir_type_t lt = ir_type(function, l);
+            ir_type_t rt = ir_type(function, r);
+            int numbers = lt == IR_TYPE_NUMBER && rt == IR_TYPE_NUMBER;
+
             switch (instr->op) {
-                case IR_ADD: case IR_SUB: case IR_MUL: case IR_DIV:
-                case IR_MOD: case IR_POW: case IR_GT: case IR_LT:
-                case IR_EQ: case IR_AND: case IR_OR: case IR_NOT:
-                case IR_NEG: case IR_LENGTH: case IR_BOX:
-                case IR_ASCII: case IR_PRIME: case IR_ULTIMATE:
-                case IR_GET: case IR_SET: case IR_CALL:
-                case IR_OUTPUT: case IR_DUMP: case IR_QUIT:
-                    for (int j = 0; j < instr->generic.operand_count; j++) {
-                        ir_id_t operand = instr->generic.operands[j];
-                        if (operand >= 0 && operand < n) {
-                            if (tracked[operand].start == -1)
-                                tracked[operand].start = operand;
-                            tracked[operand].end = id;
-                        }
+                case IR_ADD:
+                    if (lt == IR_TYPE_NUMBER && ir_is_number(function, r, 0)) ir_simplify_to(function, instr, l);
+                    else if (rt == IR_TYPE_NUMBER && ir_is_number(function, l, 0)) ir_simplify_to(function, instr, r);
+                    break;
+                case IR_SUB:
+                    if (lt == IR_TYPE_NUMBER && ir_is_number(function, r, 0)) ir_simplify_to(function, instr, l);
+                    else if (lt == IR_TYPE_NUMBER && l == r) ir_to_const(function, instr, (v_t) TYPE_NUMBER);
+                    break;
+                case IR_MUL:
+                    if (lt == IR_TYPE_NUMBER && ir_is_number(function, r, 1)) ir_simplify_to(function, instr, l);
+                    else if (rt == IR_TYPE_NUMBER && ir_is_number(function, l, 1)) ir_simplify_to(function, instr, r);
+                    else if (numbers && (ir_is_number(function, r, 0) || ir_is_number(function, l, 0))) {
+                        ir_to_const(function, instr, (v_t) TYPE_NUMBER);
+                    } else if (lt == IR_TYPE_NUMBER && ir_is_number(function, r, 2)) {
+                        instr->op = IR_ADD;
+                        ir_index_replace(function, instr, 1, l);
                     }
                     break;
-                case IR_STORE:
-                    if (instr->var.value >= 0 && instr->var.value < n) {
-                        if (tracked[instr->var.value].start == -1)
-                            tracked[instr->var.value].start = instr->var.value;
-                        tracked[instr->var.value].end = id;
+                case IR_DIV:
+                    if (lt == IR_TYPE_NUMBER && ir_is_number(function, r, 1)) ir_simplify_to(function, instr, l);
+                    break;
+                case IR_POW:
+                    if (lt != IR_TYPE_NUMBER) break;
+
+                    if (ir_is_number(function, r, 1)) ir_simplify_to(function, instr, l);
+                    else if (ir_is_number(function, r, 0)) ir_to_const(function, instr, (v_t) (1 << 3) | TYPE_NUMBER);
+                    else if (ir_is_number(function, r, 2)) {
+                        instr->op = IR_MUL;
+                        ir_index_replace(function, instr, 1, l);
                     }
                     break;
-                case IR_BRANCH:
-                    if (instr->branch.condition >= 0 && instr->branch.condition < n) {
-                        if (tracked[instr->branch.condition].start == -1)
-                            tracked[instr->branch.condition].start = instr->branch.condition;
-                        tracked[instr->branch.condition].end = id;
+                case IR_EQ:
+                    if (l == r) {
+                        ir_to_const(function, instr, (v_t) (1 << 3) | TYPE_BOOLEAN);
+                        break;
                     }
+
+                    // Equality never coerces, keep constants on the right
+                    if (ir_is_constant_value(function, l) && !ir_is_constant_value(function, r)) {
+                        instr->generic.operands[0] = r;
+                        instr->generic.operands[1] = l;
+                    }
+                    break;
+                case IR_LT:
+                case IR_GT:
+                    if (lt != rt || (lt != IR_TYPE_NUMBER && lt != IR_TYPE_STRING && lt != IR_TYPE_BOOLEAN)) break;
+
+                    if (l == r) {
+                        ir_to_const(function, instr, (v_t) TYPE_BOOLEAN);
+                    } else if (ir_is_constant_value(function, l) && !ir_is_constant_value(function, r)) {
+                        instr->op = instr->op == IR_LT ? IR_GT : IR_LT;
+                        instr->generic.operands[0] = r;
+                        instr->generic.operands[1] = l;
+                    }
+                    break;
+                default:
                     break;
-                case IR_RETURN:
-                    if (instr->generic.operand_count > 0 && instr->generic.operands[0] >= 0 && instr->generic.operands[0] < n) {
-                        if (tracked[instr->generic.operands[0]].start == -1)
-                            tracked[instr->generic.operands[0]].start = instr->generic.operands[0];
-                        tracked[instr->generic.operands[0]].end = id;
+            }
+        }
+    }
+}
+
+/*
+ * Keep variables in registers within a block: a LOAD after a STORE or
+ * LOAD of the same variable reuses that value, unless a CALL in between
+ * may write the variable. Dead LOADs are left for ir_drop.
+ */
+void ir_forward(ir_function_t* function, call_summary_t* summary) {
+    int vars = function->var_id + 1;
+    ir_id_t* known = malloc(sizeof(ir_id_t) * vars);
+    int* stamp = calloc(vars, sizeof(int));
+    if (!known || !stamp) panic("Failed to allocate memory for load forwarding");
+
+    int current = 0;
+    for (int b = 0; b < function->block_count; b++) {
+        ir_block_t* block = function->blocks[b];
+        if (!block->region) continue;
+
+        current++;
+        for (int i = 0; i < block->instruction_count; i++) {
+            ir_instruction_t* instr = &block->instructions[i];
+            ir_var_t var = instr->var.var_id;
+
+            switch (instr->op) {
+                case IR_LOAD:
+                    if (stamp[var] == current) {
+                        ir_replace_uses(function, instr->result, known[var]);
+                        break;
                     }
+
+                    known[var] = instr->result;
+                    stamp[var] = current;
+                    break;
+                case IR_STORE:
+                    known[var] = instr->var.value;
+                    stamp[var] = current;
                     break;
-                case IR_PHI:
-                    for (int j = 0; j < instr->phi.phi_count; j++) {
-                        ir_id_t phi_value = instr->phi.phi_values[j];
-                        if (phi_value >= 0 && phi_value < n) {
-                            if (tracked[phi_value].start == -1)
-                                tracked[phi_value].start = phi_value;
-                            tracked[phi_value].end = id;
+                case IR_CALL: {
+                    uint64_t* writes = ir_call_effect(summary, instr->result)->writes;
+
+                    for (int w = 0; w < summary->var_words; w++) {
+                        uint64_t bits = writes[w];
+                        while (bits) {
+                            stamp[w * 64 + __builtin_ctzll(bits)] = 0;
+                            bits &= bits - 1;
                         }
                     }
                     break;
+                }
                 default:
                     break;
             }
         }
     }
 
+    free(known);
+    free(stamp);
+}
+
+static inline int ir_has_effect(ir_instruction_t* instr) {
+    return instr->op == IR_OUTPUT ||
+        instr->op == IR_DUMP   ||
+        instr->op == IR_STORE  ||
+        instr->op == IR_RETURN ||
+        instr->op == IR_BRANCH ||
+        instr->op == IR_JUMP   ||
+        instr->op == IR_CALL   ||
+        instr->op == IR_QUIT   ||
+        instr->op == IR_PROMPT ||
+        instr->op == IR_APPEND ||
+        instr->op == IR_SAVE   ||
+        instr->op == IR_RESTORE;
+}
+
+void ir_drop(ir_function_t* function) {
+    int n = function->next_value_id;
+    ir_id_t* worklist = malloc(sizeof(ir_id_t) * (n + 1));
+    char* dead = calloc(n + 1, 1);
+    if (!worklist || !dead) panic("Failed to allocate memory for dead code elimination");
+
+    int size = 0;
+    for (int b = 0; b < function->block_count; b++) {
+        ir_block_t* block = function->blocks[b];
+        for (int i = 0; i < block->instruction_count; i++) {
+            ir_instruction_t* instr = &block->instructions[i];
+            if (!ir_has_effect(instr) && !ir_use_count(function, instr->result)) {
+                dead[instr->result] = 1;
+                worklist[size++] = instr->result;
+            }
+        }
+    }
+
+    /* Removing an instruction may leave its operands without users */
+    while (size > 0) {
+        ir_instruction_t* instr = ir_fetch(function, worklist[--size]);
+
+        for (int k = 0; k < ir_operand_count(instr); k++) {
+            ir_id_t operand = *ir_operand(instr, k);
+            ir_index_unuse(function, operand, instr->result);
+
+            ir_instruction_t* def = ir_fetch(function, operand);
+            if (def && !dead[operand] && !ir_has_effect(def) && !ir_use_count(function, operand)) {
+                dead[operand] = 1;
+                worklist[size++] = operand;
+            }
+        }
+    }
+
+    for (int b = 0; b < function->block_count; b++) {
+        ir_block_t* block = function->blocks[b];
+
+        int count = 0;
+        for (int i = 0; i < block->instruction_count; i++) {
+            ir_instruction_t* instr = &block->instructions[i];
+            if (dead[instr->result]) {
+                function->index->defs[instr->result] = NULL;
+                function->index->owners[instr->result] = NULL;
+                continue;
+            }
+
+            if (count != i) block->instructions[count] = block->instructions[i];
+            count++;
+        }
+        block->instruction_count = count;
+        ir_index_block(function, block);
+    }
+
+    free(worklist);
+    free(dead);
+}
+
+static void ir_range_add(opt_liveness_t* live, int start, int end) {
+    // Ranges are built back to front, the earliest one is last
+    if (live->range_count > 0) {
+        opt_range_t* first = &live->ranges[live->range_count - 1];
+        if (first->start <= end) {
+            if (start < first->start) first->start = start;
+            if (end > first->end) first->end = end;
+            return;
+        }
+    }
+
+    if (live->range_count >= live->range_capacity) {
+        live->range_capacity = live->range_capacity ? live->range_capacity * 2 : 2;
+        live->ranges = realloc(live->ranges, sizeof(opt_range_t) * live->range_capacity);
+        if (!live->ranges) panic("Failed to allocate memory for live ranges");
+    }
+
+    live->ranges[live->range_count++] = (opt_range_t) { start, end };
+}
+
+static void ir_range_define(opt_liveness_t* live, int position) {
+    if (!live->range_count) {
+        ir_range_add(live, position, position + 1);
+        return;
+    }
+
+    live->ranges[live->range_count - 1].start = position;
+}
+
+static void ir_liveness_names(ir_function_t* function) {
+    int n = function->next_value_id;
+    ir_index_t* index = function->index;
+
+    free(function->live_names);
+    free(function->live_ids);
+
+    function->live_names = malloc(sizeof(int) * (n + 1));
+    function->live_ids = malloc(sizeof(ir_id_t) * (n + 1));
+    function->live_count = 0;
+    if (!function->live_names || !function->live_ids) panic("Failed to allocate memory for liveness");
+
+    for (int i = 0; i < n; i++) {
+        function->live_names[i] = -1;
+    }
+
+    for (int b = 0; b < function->block_count; b++) {
+        ir_block_t* block = function->blocks[b];
+
+        for (int i = 0; i < block->instruction_count; i++) {
+            ir_instruction_t* instr = &block->instructions[i];
+
+            for (int k = 0; k < ir_operand_count(instr); k++) {
+                ir_id_t value = *ir_operand(instr, k);
+                if (value < 0 || value >= n || function->live_names[value] != -1) continue;
+
+                if (instr->op == IR_PHI || index->owners[value] != block) {
+                    function->live_names[value] = function->live_count;
+                    function->live_ids[function->live_count++] = value;
+                }
+            }
+        }
+    }
+
+    function->live_words = (function->live_count + 63) / 64;
+}
+
+#define BIT_SET(set, bit) ((set)[(bit) / 64] |= (1ULL << ((bit) % 64)))
+#define BIT_GET(set, bit) (((set)[(bit) / 64] >> ((bit) % 64)) & 1)
+
+/*
+ * Backward dataflow liveness over the CFG followed by interval
+ * construction. Only values used outside of their defining block take
+ * part in the dataflow, everything else is resolved within its block.
+ * A PHI operand is live out of the matching predecessor, not live into
+ * the PHI's own block.
+ */
+opt_liveness_t* ir_liveness(ir_function_t* function) {
+    ir_cfg_order(function);
+
+    int n = function->next_value_id;
+    opt_liveness_t* tracked = calloc(n + 1, sizeof(opt_liveness_t));
+    if (!tracked) panic("Failed to allocate memory for liveness analysis");
+
+    for (int i = 0; i < n; i++) {
+        tracked[i].start = -1;
+        tracked[i].end = -1;
+        tracked[i].id = i;
+    }
+
+    int position = 0;
+    for (int o = 0; o < function->order_count; o++) {
+        ir_block_t* block = function->order[o];
+        block->from = position;
+
+        for (int i = 0; i < block->instruction_count; i++) {
+            block->instructions[i].position = position;
+            position += 2;
+        }
+
+        block->to = position;
+    }
+
+    ir_liveness_names(function);
+
+    int words = function->live_words;
+    int* names = function->live_names;
+    int blocks = function->order_count;
+
+    uint64_t* gen = calloc((size_t) blocks * words + 1, sizeof(uint64_t));
+    uint64_t* kill = calloc((size_t) blocks * words + 1, sizeof(uint64_t));
+    uint64_t* out = calloc(words + 1, sizeof(uint64_t));
+    if (!gen || !kill || !out) panic("Failed to allocate memory for liveness analysis");
+
+    for (int o = 0; o < blocks; o++) {
+        ir_block_t* block = function->order[o];
+        uint64_t* g = gen + (size_t) o * words;
+        uint64_t* k = kill + (size_t) o * words;
+
+        free(block->live_in);
+        free(block->live_out);
+        block->live_in = calloc(words + 1, sizeof(uint64_t));
+        block->live_out = calloc(words + 1, sizeof(uint64_t));
+        if (!block->live_in || !block->live_out) panic("Failed to allocate memory for liveness analysis");
+
+        for (int i = 0; i < block->instruction_count; i++) {
+            ir_instruction_t* instr = &block->instructions[i];
+
+            if (instr->op != IR_PHI) {
+                for (int j = 0; j < ir_operand_count(instr); j++) {
+                    ir_id_t value = *ir_operand(instr, j);
+                    if (value < 0 || value >= n || names[value] < 0) continue;
+                    if (!BIT_GET(k, names[value])) BIT_SET(g, names[value]);
+                }
+            }
+
+            if (names[instr->result] >= 0) BIT_SET(k, names[instr->result]);
+        }
+    }
+
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+
+        for (int o = blocks - 1; o >= 0; o--) {
+            ir_block_t* block = function->order[o];
+            uint64_t* g = gen + (size_t) o * words;
+            uint64_t* k = kill + (size_t) o * words;
+
+            memset(out, 0, sizeof(uint64_t) * words);
+
+            for (int s = 0; s < block->successor_count; s++) {
+                ir_block_t* succ = ir_block_find(function, block->successors[s]);
+                if (!succ) continue;
+
+                for (int w = 0; w < words; w++) {
+                    out[w] |= succ->live_in[w];
+                }
+
+                for (int i = 0; i < succ->instruction_count; i++) {
+                    ir_instruction_t* phi = &succ->instructions[i];
+                    if (phi->op != IR_PHI) continue;
+
+                    for (int j = 0; j < phi->phi.phi_count; j++) {
+                        ir_id_t value = phi->phi.phi_values[j];
+                        if (phi->phi.phi_blocks[j] == block && names[value] >= 0) BIT_SET(out, names[value]);
+                    }
+                }
+            }
+
+            for (int w = 0; w < words; w++) {
+                uint64_t in = g[w] | (out[w] & ~k[w]);
+
+                if (out[w] != block->live_out[w] || in != block->live_in[w]) {
+                    block->live_out[w] = out[w];
+                    block->live_in[w] = in;
+                    changed = 1;
+                }
+            }
+        }
+    }
+
+    for (int o = blocks - 1; o >= 0; o--) {
+        ir_block_t* block = function->order[o];
+
+        for (int w = 0; w < words; w++) {
+            uint64_t bits = block->live_out[w];
+            while (bits) {
+                int bit = __builtin_ctzll(bits);
+                bits &= bits - 1;
+                ir_range_add(&tracked[function->live_ids[w * 64 + bit]], block->from, block->to);
+            }
+        }
+
+        for (int i = block->instruction_count - 1; i >= 0; i--) {
+            ir_instruction_t* instr = &block->instructions[i];
+
+            if (instr->op == IR_PHI) {
+                ir_range_define(&tracked[instr->result], block->from);
+                continue;
+            }
+
+            ir_range_define(&tracked[instr->result], instr->position);
+
+            for (int j = 0; j < ir_operand_count(instr); j++) {
+                ir_id_t value = *ir_operand(instr, j);
+                if (value < 0 || value >= n) continue;
+
+                ir_range_add(&tracked[value], block->from, instr->position + 1);
+            }
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        opt_liveness_t* live = &tracked[i];
+        if (!live->range_count) continue;
+
+        for (int a = 0, b = live->range_count - 1; a < b; a++, b--) {
+            opt_range_t range = live->ranges[a];
+            live->ranges[a] = live->ranges[b];
+            live->ranges[b] = range;
+        }
+
+        live->start = live->ranges[0].start;
+        live->end = live->ranges[live->range_count - 1].end;
+    }
+
+    free(gen);
+    free(kill);
+    free(out);
+
     return tracked;
 }
 
-opt_liveness_t* ir_preserve(ir_function_t* function, opt_liveness_t* tracked) {
+void ir_liveness_free(ir_function_t* function, opt_liveness_t* liveness) {
+    if (!liveness) return;
+
+    for (int i = 0; i < function->next_value_id; i++) {
+        free(liveness[i].ranges);
+    }
+
+    free(liveness);
+}
+
+static void ir_preserve_compact(ir_function_t* function, ir_block_t* block) {
+    int count = 0;
+    for (int i = 0; i < block->instruction_count; i++) {
+        ir_instruction_t* instr = &block->instructions[i];
+
+        if ((instr->op == IR_SAVE || instr->op == IR_RESTORE) && !instr->generic.operand_count) {
+            ir_index_remove(function, instr);
+            continue;
+        }
+
+        if (count != i) block->instructions[count] = block->instructions[i];
+        count++;
+    }
+
+    block->instruction_count = count;
+    ir_index_block(function, block);
+}
+
+/*
+ * Fill in the SAVE/RESTORE pair around every CALL with the values that
+ * are live after the call returns and that the callee may overwrite, and
+ * drop pairs that end up empty. Constants and BLOCK values are
+ * rematerialized by the callee anyway. Compiled code shares machine
+ * registers between values, so there the callee may overwrite any of them.
+ */
+void ir_preserve(ir_function_t* function, opt_liveness_t* tracked, call_summary_t* summary) {
+    int shared = 0;
+    #ifndef JIT_OFF
+    shared = function->config && (function->config->flags & CONFIG_JIT);
+    #endif
+
+    int n = function->next_value_id;
+    int* mark = calloc(n + 1, sizeof(int));
+    ir_id_t* live = malloc(sizeof(ir_id_t) * (n + 1));
+    if (!mark || !live) panic("Failed to allocate memory for call preservation");
+
+    int stamp = 0;
     for (int b = 0; b < function->block_count; b++) {
         ir_block_t* block = function->blocks[b];
 
+        int calls = 0;
         for (int i = 0; i < block->instruction_count; i++) {
+            if (block->instructions[i].op == IR_CALL) calls++;
+        }
+
+        if (!calls) continue;
+
+        stamp++;
+        int count = 0;
+
+        for (int w = 0; w < function->live_words; w++) {
+            uint64_t bits = block->live_out[w];
+            while (bits) {
+                int bit = __builtin_ctzll(bits);
+                bits &= bits - 1;
+
+                ir_id_t value = function->live_ids[w * 64 + bit];
+                mark[value] = stamp;
+                live[count++] = value;
+            }
+        }
+
+        for (int i = block->instruction_count - 1; i >= 0; i--) {
             ir_instruction_t* instr = &block->instructions[i];
-            
-            if (instr->op == IR_CALL) {
+
+            if (instr->op == IR_CALL && i > 0 && i + 1 < block->instruction_count) {
                 ir_instruction_t* save = &block->instructions[i - 1];
                 ir_instruction_t* restore = &block->instructions[i + 1];
 
-                save->generic.operand_count = 0;
-                restore->generic.operand_count = 0;
-
-                for (int j = 0; j < i; j++) {
-                    ir_instruction_t* pre = &block->instructions[j];
-                    if (ir_is_constant(pre)) continue;
-                    opt_liveness_t lifetime = tracked[pre->result];
-
-                    if (lifetime.end > i && lifetime.start >= 0) {
-                        if (!save->generic.operand_count) {
-                            save->generic.operands = arena_alloc(function->arena, sizeof(ir_id_t));
-                            restore->generic.operands = arena_alloc(function->arena, sizeof(ir_id_t));
-
-                            save->generic.operands[0] = pre->result;
-                            restore->generic.operands[0] = pre->result;
-                        } else {
-                            save->generic.operands = arena_realloc(function->arena, save->generic.operands, sizeof(ir_id_t) * save->generic.operand_count + 1);
-                            restore->generic.operands = arena_realloc(function->arena, restore->generic.operands, sizeof(ir_id_t) * restore->generic.operand_count + 1);
-                        
-                            save->generic.operands[save->generic.operand_count] = pre->result;
-                            restore->generic.operands[restore->generic.operand_count] = pre->result;
-                        }
+                if (save->op == IR_SAVE && restore->op == IR_RESTORE) {
+                    save->generic.operand_count = 0;
+                    save->generic.operands = arena_alloc(function->arena, sizeof(ir_id_t) * (count + 1));
 
-                        save->generic.operand_count++;
-                        restore->generic.operand_count++;
-                    }
-                }
+                    for (int j = 0; j < count; j++) {
+                        ir_id_t value = live[j];
+                        if (mark[value] != stamp || value == instr->result) continue;
 
-                if (!save->generic.operand_count) {
-                    for (int k = i; k < block->instruction_count; k++) {
-                        if (k == i - 1 || k == i + 1) continue;
-                        int target = k > i + 1 ? k - 2 : k - 1;
-                        block->instructions[target] = block->instructions[k];
+                        ir_instruction_t* def = ir_fetch(function, value);
+                        if (!def || ir_is_constant(def) || def->op == IR_BLOCK) continue;
+                        if (!ir_covers(&tracked[value], instr->position + 1)) continue;
+                        if (!shared && !ir_call_clobbers(function, summary, instr->result, value)) continue;
 
-                        free(tracked);
-                        tracked = ir_ranges(function);
+                        save->generic.operands[save->generic.operand_count++] = value;
                     }
 
-                    block->instruction_count -= 2;
-                    i -= 1;
+                    restore->generic.operands = save->generic.operands;
+                    restore->generic.operand_count = save->generic.operand_count;
                 }
             }
+
+            if (instr->op == IR_SAVE || instr->op == IR_RESTORE) continue;
+
+            mark[instr->result] = 0;
+            if (instr->op == IR_PHI) continue;
+
+            for (int k = 0; k < ir_operand_count(instr); k++) {
+                ir_id_t value = *ir_operand(instr, k);
+                if (value < 0 || value >= n || mark[value] == stamp) continue;
+
+                mark[value] = stamp;
+                live[count++] = value;
+            }
         }
+
+        ir_preserve_compact(function, block);
     }
 
-    return tracked;
+    free(mark);
+    free(live);
 }
 
+/*
+ * Build the index and CFG, run the pass pipeline (see opt_pipeline) and
+ * finish with liveness and the SAVE/RESTORE pairs, which every level
+ * needs.
+ */
 opt_liveness_t* ir_optimize(ir_function_t* function) {
-    ir_fold(function);
-    ir_drop(function);
+    ir_index_build(function);
+    ir_cfg_build(function);
+
+    opt_state_t state;
+    opt_begin(&state, function);
+    opt_pipeline(&state);
+
+    call_summary_t* summary = opt_summary(&state);
+
+    double start = opt_clock();
+    int size = opt_size(function);
+    opt_liveness_t* liveness = ir_liveness(function);
+    opt_report(&state, "(liveness)", start, size, function->block_count);
+
+    start = opt_clock();
+    size = opt_size(function);
+    ir_preserve(function, liveness, summary);
+    opt_report(&state, "preserve", start, size, function->block_count);
 
-    opt_liveness_t* liveness = ir_preserve(function, ir_ranges(function));
+    opt_end(&state);
 
     #ifndef JIT_OFF
     
@@ -2,74 +2,105 @@
 #define OPT_H
 
 #include "ir.h"
+#include "cfg.h"
+#include "call.h"
 #include "vm.h"
 
+typedef struct opt_range {
+    int start;
+    int end;
+} opt_range_t;
+
+/*
+ * Live interval of a value over the linearized block order. start and
+ * end bound the whole interval, ranges holds the disjoint pieces in
+ * ascending order, with holes where the value is not live.
+ */
 typedef struct opt_liveness {
     int start;
     int end;
 
     ir_id_t id;
+
+    opt_range_t* ranges;
+    int range_count;
+    int range_capacity;
 } opt_liveness_t;
 
-static inline ir_instruction_t* ir_fetch(ir_block_t* block, ir_id_t result) {
-    for (int i = 0; i < block->instruction_count; ++i) {
-        ir_instruction_t* instr = &block->instructions[i];
-        if (instr->result == result) {
-            return instr;
-        }
+void ir_index_build(ir_function_t* function);
+void ir_index_free(ir_function_t* function);
+void ir_index_block(ir_function_t* function, ir_block_t* block);
+void ir_index_add(ir_function_t* function, ir_block_t* block, ir_instruction_t* instr);
+void ir_index_remove(ir_function_t* function, ir_instruction_t* instr);
+void ir_index_use(ir_function_t* function, ir_id_t value, ir_id_t user);
+void ir_index_unuse(ir_function_t* function, ir_id_t value, ir_id_t user);
+void ir_index_replace(ir_function_t* function, ir_instruction_t* instr, int k, ir_id_t value);
+void ir_replace_uses(ir_function_t* function, ir_id_t from, ir_id_t to);
+
+/*
+ * Operands are every value an instruction reads. SAVE and RESTORE are
+ * not counted, they only shuffle values that are already live.
+ */
+static inline int ir_operand_count(ir_instruction_t* instr) {
+    switch (instr->op) {
+        case IR_ADD: case IR_SUB: case IR_MUL: case IR_DIV:
+        case IR_MOD: case IR_POW: case IR_GT: case IR_LT: case IR_EQ:
+        case IR_AND: case IR_OR: case IR_NOT: case IR_NEG:
+        case IR_LENGTH: case IR_BOX: case IR_ASCII:
+        case IR_PRIME: case IR_ULTIMATE:
+        case IR_GET: case IR_SET:
+        case IR_BUILD: case IR_APPEND: case IR_FINISH:
+        case IR_CALL: case IR_OUTPUT: case IR_DUMP:
+        case IR_QUIT: case IR_RETURN:
+            return instr->generic.operand_count;
+        case IR_STORE:
+        case IR_BRANCH:
+            return 1;
+        case IR_PHI:
+            return instr->phi.phi_count;
+        default:
+            return 0;
+    }
+}
+
+static inline ir_id_t* ir_operand(ir_instruction_t* instr, int k) {
+    switch (instr->op) {
+        case IR_STORE:
+            return &instr->var.value;
+        case IR_BRANCH:
+            return &instr->branch.condition;
+        case IR_PHI:
+            return &instr->phi.phi_values[k];
+        default:
+            return &instr->generic.operands[k];
     }
+}
 
-    return NULL;
+static inline ir_instruction_t* ir_fetch(ir_function_t* function, ir_id_t result) {
+    ir_index_t* index = function->index;
+    if (result < 0 || result >= index->size) return NULL;
+
+    return index->defs[result];
+}
+
+static inline int ir_use_count(ir_function_t* function, ir_id_t result) {
+    ir_index_t* index = function->index;
+    if (result < 0 || result >= index->size) return 0;
+
+    return index->use_count[result];
 }
 
 static inline ir_instruction_t* ir_first_use(ir_function_t* function, ir_id_t result) {
-    for (int i = 0; i < function->block_count; ++i) {
-        ir_block_t* block = function->blocks[i];
-        for (int j = 0; j < block->instruction_count; ++j) {
-            ir_instruction_t* instr = &block->instructions[j];
-            
-            switch (instr->op) {
-                case IR_ADD: case IR_SUB: case IR_MUL: case IR_DIV:
-                case IR_MOD: case IR_POW: case IR_GT: case IR_LT: case IR_EQ:
-                case IR_AND: case IR_OR: case IR_NOT: case IR_NEG:
-                case IR_LENGTH: case IR_BOX: case IR_ASCII:
-                case IR_PRIME: case IR_ULTIMATE:
-                case IR_GET: case IR_SET:
-                case IR_CALL: case IR_OUTPUT: case IR_DUMP:
-                case IR_QUIT:
-                    for (int k = 0; k < instr->generic.operand_count; ++k) {
-                        if (instr->generic.operands[k] == result)
-                            return instr;
-                    }
-                    break;
-                case IR_STORE:
-                    if (instr->var.value == result)
-                        return instr;
-                    break;
-                case IR_BRANCH:
-                    if (instr->branch.condition == result)
-                        return instr;
-                    break;
-                case IR_RETURN:
-                    if (instr->generic.operands[0] == result)
-                        return instr;
-                    break;
-                case IR_PHI:
-                    for (int k = 0; k < instr->phi.phi_count; ++k) {
-                        if (instr->phi.phi_values[k] == result)
-                            return instr;
-                    }
-                    break;
-                default:
-                    break;
-            }
-        }
-    }
+    if (!ir_use_count(function, result)) return NULL;
 
-    return NULL;
+    return ir_fetch(function, function->index->uses[result][0]);
 }
 
-static inline void ir_to_const(ir_instruction_t* instr, v_t result) {
+static inline void ir_to_const(ir_function_t* function, ir_instruction_t* instr, v_t result) {
+    for (int k = 0; k < ir_operand_count(instr); ++k) {
+        ir_index_unuse(function, *ir_operand(instr, k), instr->result);
+    }
+
     instr->generic.operands = 0;
     instr->generic.operand_count = 0;
 
@@ -99,6 +130,30 @@ static inline int ir_is_constant(ir_instruction_t* instr) {
         || instr->op == IR_CONST_NUMBER || instr->op == IR_CONST_STRING;
 }
 
+static inline int ir_live_out(ir_function_t* function, ir_block_t* block, ir_id_t value) {
+    int name = function->live_names[value];
+    if (name < 0 || !block->live_out) return 0;
+
+    return (block->live_out[name / 64] >> (name % 64)) & 1;
+}
+
+static inline int ir_covers(opt_liveness_t* live, int position) {
+    for (int i = 0; i < live->range_count; i++) {
+        if (live->ranges[i].start > position) return 0;
+        if (live->ranges[i].end > position) return 1;
+    }
+
+    return 0;
+}
+
+void ir_types(ir_function_t* function);
+void ir_fold(ir_function_t* function);
+void ir_simplify(ir_function_t* function);
+void ir_forward(ir_function_t* function, call_summary_t* summary);
+void ir_drop(ir_function_t* function);
+opt_liveness_t* ir_liveness(ir_function_t* function);
+void ir_liveness_free(ir_function_t* function, opt_liveness_t* liveness);
+void ir_preserve(ir_function_t* function, opt_liveness_t* tracked, call_summary_t* summary);
 opt_liveness_t* ir_optimize(ir_function_t* function);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,333 @@
+#include "partial.h"
+#include "cfg.h"
+#include "opt.h"
+#include "vm.h"
+
+static long ir_partial_size(v_t value) {
+    if (V_IS_STRING(value)) return ((v_string_t) (value & VALUE_MASK))->length;
+    if (V_IS_LIST(value)) return ((v_list_t) (value & VALUE_MASK))->length;
+
+    return 0;
+}
+
+/*
+ * Run one instruction the way vm_run would. Returns 0, leaving the
+ * state untouched, for anything that reads input, has an effect or
+ * leaves the main program.
+ */
+static int ir_partial_step(ir_instruction_t* instr, v_t* registers, v_t* variables, ir_block_t* previous) {
+    ir_id_t* operands = instr->generic.operands;
+    ir_id_t result = instr->result;
+
+    switch (instr->op) {
+        case IR_CONST_NUMBER: case IR_CONST_STRING: case IR_CONST_BOOLEAN:
+        case IR_CONST_NULL: case IR_CONST_ARRAY:
+            registers[result] = instr->constant.value;
+            break;
+        case IR_LOAD:
+            registers[result] = variables[instr->var.var_id];
+            break;
+        case IR_STORE:
+            variables[instr->var.var_id] = registers[instr->var.value];
+            break;
+        case IR_BLOCK:
+            registers[result] = (v_t) instr->block.function | TYPE_BLOCK;
+            break;
+        case IR_PHI:
+            registers[result] = vm_phi(previous, instr->phi.phi_values, instr->phi.phi_blocks, instr->phi.phi_count, registers);
+            break;
+        case IR_NOT:
+            registers[result] = v_coerce_to_boolean(registers[operands[0]]) ^ (1 << 3);
+            break;
+        case IR_NEG:
+            registers[result] = ((v_number_t) v_coerce_to_number(registers[operands[0]])) * -1;
+            break;
+        case IR_LENGTH:
+            registers[result] = vm_length(registers[operands[0]]);
+            break;
+        case IR_ASCII:
+            registers[result] = vm_ascii(registers[operands[0]]);
+            break;
+        case IR_BOX:
+            registers[result] = vm_box(registers[operands[0]]);
+            break;
+        case IR_PRIME:
+            registers[result] = vm_prime(registers[operands[0]]);
+            break;
+        case IR_ULTIMATE:
+            registers[result] = vm_ultimate(registers[operands[0]]);
+            break;
+        case IR_ADD:
+            registers[result] = vm_add(registers[operands[0]], registers[operands[1]]);
+            break;
+        case IR_SUB:
+            registers[result] = vm_sub(registers[operands[0]], registers[operands[1]]);
+            break;
+        case IR_MUL:
+            registers[result] = vm_mul(registers[operands[0]], registers[operands[1]]);
+            break;
+        case IR_DIV:
+            registers[result] = vm_div(registers[operands[0]], registers[operands[1]]);
+            break;
+        case IR_MOD:
+            registers[result] = vm_mod(registers[operands[0]], registers[operands[1]]);
+            break;
+        case IR_POW:
+            registers[result] = vm_pow(registers[operands[0]], registers[operands[1]]);
+            break;
+        case IR_GT:
+            registers[result] = vm_gt(registers[operands[0]], registers[operands[1]]);
+            break;
+        case IR_LT:
+            registers[result] = vm_lt(registers[operands[0]], registers[operands[1]]);
+            break;
+        case IR_EQ:
+            registers[result] = vm_eq(registers[operands[0]], registers[operands[1]]);
+            break;
+        case IR_GET:
+            registers[result] = vm_get(registers[operands[0]], registers[operands[1]], registers[operands[2]]);
+            break;
+        case IR_SET:
+            registers[result] = vm_set(registers[operands[0]], registers[operands[1]], registers[operands[2]], registers[operands[3]]);
+            break;
+        default:
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Whether block had run by the time execution reached point */
+static int ir_partial_ran(partial_point_t* point, int* seq, int size, ir_block_t* block) {
+    if (block->id >= size || seq[block->id] < 0) return 0;
+    if (point->index == 0 && block == point->block) return 0;
+
+    return seq[block->id] < point->limit;
+}
+
+/*
+ * Whether point is safe to resume from: nothing that ran before it can
+ * run again afterwards, so every value computed so far is final. That
+ * rules out any point inside a loop other than the header's first
+ * entry, which the new entry then reaches through the preheader's edge.
+ */
+static int ir_partial_final(ir_function_t* function, partial_point_t* point, int* seq, int size, char* seen, ir_block_t** stack) {
+    memset(seen, 0, function->next_block_id);
+
+    // Re-entering a block from itself, the PHIs still need that edge
+    if (point->index == 0 && point->previous == point->block) return 0;
+
+    int count = 0;
+    if (point->index == 0) {
+        seen[point->block->id] = 1;
+        stack[count++] = point->block;
+    } else {
+        for (int s = 0; s < point->block->successor_count; s++) {
+            ir_block_t* succ = ir_block_find(function, point->block->successors[s]);
+            if (succ && !seen[succ->id]) {
+                seen[succ->id] = 1;
+                stack[count++] = succ;
+            }
+        }
+    }
+
+    while (count > 0) {
+        ir_block_t* block = stack[--count];
+        if (ir_partial_ran(point, seq, size, block)) return 0;
+
+        for (int s = 0; s < block->successor_count; s++) {
+            ir_block_t* succ = ir_block_find(function, block->successors[s]);
+            if (succ && !seen[succ->id]) {
+                seen[succ->id] = 1;
+                stack[count++] = succ;
+            }
+        }
+    }
+
+    return 1;
+}
+
+static ir_id_t ir_partial_constant(ir_function_t* function, ir_block_t* entry, v_t value) {
+    if (!V_IS_BLOCK(value)) {
+        ir_instruction_t* instr = ir_emit(IR_CONST_NULL, function, entry);
+        ir_to_const(function, instr, value);
+        return instr->result;
+    }
+
+    // Block values stay BLOCK instructions so their bodies are still found
+    ir_block_t* body = (ir_block_t*) (value & VALUE_MASK);
+    ir_instruction_t* instr = ir_emit(IR_BLOCK, function, entry);
+    instr->block.function = body;
+
+    for (int b = 0; b < function->block_count; b++) {
+        ir_block_t* block = function->blocks[b];
+        for (int i = 0; i < block->instruction_count; i++) {
+            ir_instruction_t* def = &block->instructions[i];
+            if (def->op == IR_BLOCK && def->block.function == body) instr->block.result_id = def->block.result_id;
+        }
+    }
+
+    return instr->result;
+}
+
+/*
+ * Replace the prefix with a new entry block that stores the variables
+ * as they were at point and jumps to where it stopped. Values the rest
+ * of the program reads from the prefix become constants in the entry.
+ */
+static void ir_partial_resume(ir_function_t* function, partial_point_t* point, v_t* registers, int* seq, int size) {
+    ir_index_t* index = function->index;
+    int n = function->next_value_id;
+
+    ir_block_t* resume = point->index > 0 ? ir_block_split(function, point->block, point->index) : point->block;
+    ir_block_t* entry = ir_create_block(function);
+
+    // Unset variables read as the number 0 too, but a store is what tells later passes the value
+    for (ir_var_t var = 1; var <= function->var_id; var++) {
+        ir_id_t value = ir_partial_constant(function, entry, point->variables[var]);
+        ir_instruction_t* store = ir_emit(IR_STORE, function, entry);
+        store->var.var_id = var;
+        store->var.value = value;
+    }
+
+    ir_id_t* constants = malloc(sizeof(ir_id_t) * (n + 1));
+    if (!constants) panic("Failed to allocate memory for partial evaluation");
+
+    for (int i = 0; i < n; i++) {
+        constants[i] = -1;
+    }
+
+    for (int b = 0; b < function->block_count; b++) {
+        ir_block_t* block = function->blocks[b];
+        if (block == entry || ir_partial_ran(point, seq, size, block)) continue;
+
+        for (int i = 0; i < block->instruction_count; i++) {
+            ir_instruction_t* instr = &block->instructions[i];
+
+            for (int k = 0; k < ir_operand_count(instr); k++) {
+                ir_id_t value = *ir_operand(instr, k);
+                if (value < 0 || value >= n || !index->owners[value]) continue;
+                if (!ir_partial_ran(point, seq, size, index->owners[value])) continue;
+
+                if (constants[value] == -1) constants[value] = ir_partial_constant(function, entry, registers[value]);
+                ir_index_replace(function, instr, k, constants[value]);
+            }
+        }
+    }
+
+    free(constants);
+
+    // The edge execution took into resume now comes from the entry
+    for (int i = 0; point->index == 0 && i < resume->instruction_count; i++) {
+        ir_instruction_t* phi = &resume->instructions[i];
+        if (phi->op != IR_PHI) break;
+
+        for (int k = 0; k < phi->phi.phi_count; k++) {
+            if (phi->phi.phi_blocks[k] == point->previous) phi->phi.phi_blocks[k] = entry;
+        }
+    }
+
+    ir_instruction_t* jump = ir_emit(IR_JUMP, function, entry);
+    jump->jump.block = resume;
+
+    for (int i = 0; i < entry->instruction_count; i++) {
+        ir_index_add(function, entry, &entry->instructions[i]);
+    }
+
+    memmove(function->blocks + 1, function->blocks, sizeof(ir_block_t*) * (function->block_count - 1));
+    function->blocks[0] = entry;
+    function->block = entry;
+}
+
+/*
+ * Run the main program at compile time for as long as it does not
+ * depend on input or produce output, within PARTIAL_STEPS instructions
+ * and PARTIAL_BYTES of strings and lists. It stops at the first CALL,
+ * the bodies are left to run normally. The program then resumes from
+ * the latest point that nothing before it can be reached again from,
+ * with the variables it had there stored up front. Returns whether the
+ * program changed, the CFG needs simplifying when it did.
+ */
+int ir_partial(ir_function_t* function) {
+    int size = function->next_block_id;
+    int vars = function->var_id + 1;
+
+    v_t* registers = calloc(function->next_value_id + 1, sizeof(v_t));
+    v_t* variables = calloc(vars, sizeof(v_t));
+    int* seq = malloc(sizeof(int) * (size + 1));
+    char* seen = malloc(size + 1);
+    ir_block_t** stack = malloc(sizeof(ir_block_t*) * (size + 1));
+    partial_point_t* points = malloc(sizeof(partial_point_t) * (size + 1));
+    if (!registers || !variables || !seq || !seen || !stack || !points) panic("Failed to allocate memory for partial evaluation");
+
+    for (int b = 0; b < size; b++) {
+        seq[b] = -1;
+    }
+
+    ir_block_t* block = function->block;
+    ir_block_t* previous = NULL;
+    int index = 0;
+    int visits = 0;
+    long steps = 0;
+    long bytes = 0;
+
+    while (1) {
+        // Every block's first entry is a point to fall back to
+        if (index == 0 && seq[block->id] < 0) {
+            partial_point_t* point = &points[visits];
+            point->block = block;
+            point->previous = previous;
+            point->index = 0;
+            point->limit = visits;
+            point->variables = malloc(sizeof(v_t) * vars);
+            if (!point->variables) panic("Failed to allocate memory for partial evaluation");
+
+            memcpy(point->variables, variables, sizeof(v_t) * vars);
+            seq[block->id] = visits++;
+        }
+
+        if (index >= block->instruction_count || steps++ >= PARTIAL_STEPS || bytes > PARTIAL_BYTES) break;
+
+        ir_instruction_t* instr = &block->instructions[index];
+        if (instr->op == IR_JUMP || instr->op == IR_BRANCH) {
+            previous = block;
+            block = instr->op == IR_JUMP ? instr->jump.block
+                : v_coerce_to_boolean(registers[instr->branch.condition]) >> 3 ? instr->branch.truthy : instr->branch.falsey;
+            index = 0;
+            continue;
+        }
+
+        if (!ir_partial_step(instr, registers, variables, previous)) break;
+
+        bytes += ir_partial_size(registers[instr->result]);
+        index++;
+    }
+
+    partial_point_t stop = { block, previous, index, visits, variables };
+    partial_point_t* chosen = NULL;
+
+    if ((stop.index > 0 || stop.limit > 1) && ir_partial_final(function, &stop, seq, size, seen, stack)) chosen = &stop;
+
+    // The first point is the start of the program, nothing to save there
+    for (int p = visits - 1; p > 0 && !chosen; p--) {
+        if (ir_partial_final(function, &points[p], seq, size, seen, stack)) chosen = &points[p];
+    }
+
+    if (chosen) {
+        info((*function->config), "Evaluated %ld instructions ahead of time, resuming at block %d", steps, chosen->block->id);
+        ir_partial_resume(function, chosen, registers, seq, size);
+    }
+
+    for (int p = 0; p < visits; p++) {
+        free(points[p].variables);
+    }
+
+    free(registers);
+    free(variables);
+    free(seq);
+    free(seen);
+    free(stack);
+    free(points);
+
+    return chosen != NULL;
+}
@@ -0,0 +1,25 @@
+#ifndef PARTIAL_H
+#define PARTIAL_H
+
+#include "ir.h"
+
+// Instructions run and bytes of strings and lists built before the prefix is cut short
+#define PARTIAL_STEPS (1 << 20)
+#define PARTIAL_BYTES (1 << 24)
+
+/*
+ * A point the program can resume from: instruction index of block,
+ * entered from previous. Blocks first entered before limit have run,
+ * variables holds what the variables were at that point.
+ */
+typedef struct partial_point {
+    ir_block_t* block;
+    ir_block_t* previous;
+    int index;
+    int limit;
+    v_t* variables;
+} partial_point_t;
+
+int ir_partial(ir_function_t* function);
+
+#endif
@@ -0,0 +1,472 @@
+#define _POSIX_C_SOURCE 199309L
+#include <time.h>
+
+#include "pass.h"
+#include "cfg.h"
+#include "opt.h"
+#include "bounds.h"
+#include "escape.h"
+#include "memo.h"
+#include "partial.h"
+
+static void opt_inline(opt_state_t* state) {
+    ir_inline(state->function);
+    ir_cfg_simplify(state->function);
+}
+
+static void opt_partial(opt_state_t* state) {
+    if (ir_partial(state->function)) ir_cfg_simplify(state->function);
+}
+
+static void opt_forward(opt_state_t* state) {
+    ir_forward(state->function, opt_summary(state));
+}
+
+static void opt_fold(opt_state_t* state) {
+    ir_fold(state->function);
+}
+
+static void opt_simplify(opt_state_t* state) {
+    ir_simplify(state->function);
+}
+
+static void opt_drop(opt_state_t* state) {
+    ir_drop(state->function);
+}
+
+static void opt_cfg(opt_state_t* state) {
+    ir_cfg_simplify(state->function);
+}
+
+static void opt_induction(opt_state_t* state) {
+    ir_induction(state->function, opt_loops(state), opt_summary(state));
+}
+
+static void opt_builder(opt_state_t* state) {
+    ir_builder(state->function, opt_loops(state), opt_summary(state));
+}
+
+static void opt_unroll(opt_state_t* state) {
+    if (ir_unroll(state->function, opt_loops(state), opt_summary(state))) ir_cfg_simplify(state->function);
+}
+
+static void opt_bounds(opt_state_t* state) {
+    ir_bounds(state->function, opt_summary(state));
+}
+
+static void opt_sink(opt_state_t* state) {
+    ir_sink(state->function);
+}
+
+static void opt_memo(opt_state_t* state) {
+    ir_memo(state->function, opt_summary(state));
+}
+
+static opt_pass_t opt_passes[] = {
+    { "inline", opt_inline, 1, 0, PASS_CFG | PASS_CALLS },
+    { "partial", opt_partial, PASS_OPT_IN, CONFIG_PARTIAL, PASS_CFG | PASS_CALLS },
+    { "forward", opt_forward, 1, 0, 0 },
+    { "fold", opt_fold, 1, 0, 0 },
+    { "simplify", opt_simplify, 2, 0, 0 },
+    { "drop", opt_drop, 1, 0, 0 },
+    { "cfg", opt_cfg, 1, 0, PASS_CFG },
+    { "induction", opt_induction, 2, 0, 0 },
+    { "builder", opt_builder, 2, 0, 0 },
+    { "unroll", opt_unroll, 2, 0, PASS_CFG },
+    { "bounds", opt_bounds, 2, 0, 0 },
+    { "sink", opt_sink, 2, 0, 0 },
+    { "memo", opt_memo, PASS_OPT_IN, CONFIG_MEMO, 0 },
+};
+
+#define PASS_COUNT ((int) (sizeof(opt_passes) / sizeof(opt_passes[0])))
+
+double opt_clock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+int opt_size(ir_function_t* function) {
+    int size = 0;
+    for (int b = 0; b < function->block_count; b++) {
+        size += function->blocks[b]->instruction_count;
+    }
+
+    return size;
+}
+
+void opt_report(opt_state_t* state, const char* name, double start, int instructions, int blocks) {
+    ir_function_t* function = state->function;
+    if (!(function->config->flags & CONFIG_TIME_PASSES)) return;
+
+    double elapsed = opt_clock() - start;
+    state->total += elapsed;
+
+    fprintf(
+        stderr, "  %-12s %10.3f %8d -> %-8d %6d -> %-6d\n",
+        name, elapsed, instructions, opt_size(function), blocks, function->block_count
+    );
+}
+
+/*
+ * Fingerprint of the instructions, to tell whether a pass changed
+ * anything without every pass having to report it.
+ */
+static uint64_t opt_hash(ir_function_t* function) {
+    uint64_t hash = 1469598103934665603ULL;
+    #define OPT_MIX(x) (hash = (hash ^ (uint64_t) (x)) * 1099511628211ULL)
+
+    for (int b = 0; b < function->block_count; b++) {
+        ir_block_t* block = function->blocks[b];
+        OPT_MIX(block->id);
+
+        for (int i = 0; i < block->instruction_count; i++) {
+            ir_instruction_t* instr = &block->instructions[i];
+            OPT_MIX(instr->op);
+            OPT_MIX(instr->result);
+            OPT_MIX(instr->flags);
+
+            for (int k = 0; k < ir_operand_count(instr); k++) {
+                OPT_MIX(*ir_operand(instr, k));
+            }
+
+            if (ir_is_constant(instr)) OPT_MIX(instr->constant.value);
+            if (instr->op == IR_LOAD || instr->op == IR_STORE) OPT_MIX(instr->var.var_id);
+            if (instr->op == IR_JUMP) OPT_MIX(instr->jump.block->id);
+            if (instr->op == IR_BRANCH) {
+                OPT_MIX(instr->branch.truthy->id);
+                OPT_MIX(instr->branch.falsey->id);
+            }
+        }
+    }
+
+    #undef OPT_MIX
+    return hash;
+}
+
+#ifdef DEBUG
+/*
+ * Check that the index matches the blocks, that every operand is
+ * defined and knows about its use, and that control flow only leaves a
+ * block at its end and only to blocks that still exist.
+ */
+static void opt_verify(ir_function_t* function, const char* after) {
+    ir_index_t* index = function->index;
+
+    for (int b = 0; b < function->block_count; b++) {
+        ir_block_t* block = function->blocks[b];
+        if (ir_block_find(function, block->id) != block) panic("IR verification failed after %s: block %d is not in the block table", after, block->id);
+
+        for (int i = 0; i < block->instruction_count; i++) {
+            ir_instruction_t* instr = &block->instructions[i];
+            ir_id_t result = instr->result;
+
+            if (ir_fetch(function, result) != instr || index->owners[result] != block) {
+                panic("IR verification failed after %s: value %d in block %d is not indexed", after, result, block->id);
+            }
+
+            if (instr->op == IR_PHI && i > 0 && block->instructions[i - 1].op != IR_PHI) {
+                panic("IR verification failed after %s: PHI %d in block %d follows other instructions", after, result, block->id);
+            }
+
+            if ((instr->op == IR_BRANCH || instr->op == IR_JUMP || instr->op == IR_RETURN) && i != block->instruction_count - 1) {
+                panic("IR verification failed after %s: terminator %d in block %d is not last", after, result, block->id);
+            }
+
+            ir_block_t* targets[2] = {
+                instr->op == IR_BRANCH ? instr->branch.truthy : instr->op == IR_JUMP ? instr->jump.block : NULL,
+                instr->op == IR_BRANCH ? instr->branch.falsey : NULL
+            };
+
+            for (int t = 0; t < 2; t++) {
+                if (targets[t] && ir_block_find(function, targets[t]->id) != targets[t]) {
+                    panic("IR verification failed after %s: block %d jumps to removed block %d", after, block->id, targets[t]->id);
+                }
+            }
+
+            for (int k = 0; k < ir_operand_count(instr); k++) {
+                ir_id_t value = *ir_operand(instr, k);
+                if (!ir_fetch(function, value)) {
+                    panic("IR verification failed after %s: value %d uses undefined value %d", after, result, value);
+                }
+
+                int used = 0;
+                for (int u = 0; u < index->use_count[value] && !used; u++) {
+                    used = index->uses[value][u] == result;
+                }
+
+                if (!used) panic("IR verification failed after %s: use of %d by %d is not indexed", after, value, result);
+            }
+        }
+    }
+}
+#endif
+
+call_summary_t* opt_summary(opt_state_t* state) {
+    if (state->summary) return state->summary;
+
+    ir_function_t* function = state->function;
+    double start = opt_clock();
+    int size = opt_size(function);
+
+    ir_cfg_order(function);
+    ir_cfg_dominators(function);
+    state->summary = ir_call_summary(function);
+
+    opt_report(state, "(summary)", start, size, function->block_count);
+    state->analyses += opt_clock() - start;
+    return state->summary;
+}
+
+ir_loops_t* opt_loops(opt_state_t* state) {
+    if (state->loops) return state->loops;
+
+    call_summary_t* summary = opt_summary(state);
+    ir_function_t* function = state->function;
+    double start = opt_clock();
+    int size = opt_size(function);
+
+    state->loops = ir_loops(function, summary);
+
+    opt_report(state, "(loops)", start, size, function->block_count);
+    state->analyses += opt_clock() - start;
+    return state->loops;
+}
+
+static int opt_listed(const char* list, const char* name) {
+    if (!list) return 0;
+
+    size_t length = strlen(name);
+    for (const char* at = list; *at; at++) {
+        if ((at == list || at[-1] == ',') && strncmp(at, name, length) == 0 && (at[length] == ',' || at[length] == '\0')) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static opt_pass_t* opt_find(const char* name, size_t length) {
+    for (int p = 0; p < PASS_COUNT; p++) {
+        if (strlen(opt_passes[p].name) == length && strncmp(opt_passes[p].name, name, length) == 0) {
+            return &opt_passes[p];
+        }
+    }
+
+    panic("Unknown pass '%.*s'", (int) length, name);
+}
+
+/*
+ * Passes given with --passes always run. Otherwise a pass runs from its
+ * level up, or when its own option or --enable asks for it. --disable
+ * wins over everything.
+ */
+static int opt_enabled(cli_config_t* config, opt_pass_t* pass) {
+    if (opt_listed(config->disable, pass->name)) return 0;
+    if (config->passes) return 1;
+    if (opt_listed(config->enable, pass->name) || (config->flags & pass->enable)) return 1;
+
+    return config->level >= pass->level;
+}
+
+static int opt_run(opt_state_t* state, opt_pass_t* pass) {
+    ir_function_t* function = state->function;
+    if (!opt_enabled(function->config, pass)) return 0;
+
+    if (state->budget >= 0 && state->work++ == state->budget) {
+        info((*function->config), "Optimization budget spent, skipping %s and the passes after it", pass->name);
+    }
+
+    if (state->budget >= 0 && state->work > state->budget) return 0;
+
+    double start = opt_clock();
+    int size = opt_size(function);
+    int blocks = function->block_count;
+    uint64_t before = opt_hash(function);
+    double analyses = state->analyses;
+
+    pass->run(state);
+
+    // Analyses the pass asked for are reported on their own
+    opt_report(state, pass->name, start + (state->analyses - analyses), size, blocks);
+
+    #ifdef DEBUG
+    opt_verify(function, pass->name);
+    #endif
+
+    if (opt_hash(function) == before) return 0;
+
+    if (pass->flags & (PASS_CFG | PASS_CALLS)) {
+        if (state->loops) ir_loops_free(state->loops);
+        state->loops = NULL;
+    }
+
+    if (pass->flags & PASS_CALLS) {
+        if (state->summary) ir_call_summary_free(state->summary);
+        state->summary = NULL;
+    }
+
+    return 1;
+}
+
+/*
+ * Pick the level for a program run without -O. Loops, found as back
+ * edges in the block order, and calls made from BLOCK bodies are what
+ * can make a program run long. Without either, every instruction runs
+ * about once, so optimizing or compiling it costs more than it saves
+ * and it runs as is in the VM. Recursive or deeply looping programs
+ * get -O3 unless they are very large. No level chosen here reaches
+ * PASS_OPT_IN, so partial and memo still need -p, -m or --enable, and
+ * no more than ADAPT_PASSES passes run.
+ */
+static void opt_adapt(opt_state_t* state) {
+    ir_function_t* function = state->function;
+    cli_config_t* config = function->config;
+
+    ir_cfg_order(function);
+
+    int* headers = malloc(sizeof(int) * (function->block_count + 1));
+    int* latches = malloc(sizeof(int) * (function->block_count + 1));
+    if (!headers || !latches) panic("Failed to allocate memory for pipeline selection");
+
+    int loops = 0;
+    int calls = 0;
+
+    for (int o = 0; o < function->order_count; o++) {
+        ir_block_t* block = function->order[o];
+        if (!block->region) continue;
+
+        for (int s = 0; s < block->successor_count; s++) {
+            ir_block_t* succ = ir_block_find(function, block->successors[s]);
+            if (!succ || succ->region != block->region || succ->order > block->order) continue;
+
+            headers[loops] = succ->order;
+            latches[loops++] = block->order;
+        }
+
+        for (int i = 0; i < block->instruction_count && block->region != function->block; i++) {
+            if (block->instructions[i].op == IR_CALL) calls++;
+        }
+    }
+
+    // Loop bodies follow their header in the order, so nesting is containment
+    int depth = 0;
+    for (int l = 0; l < loops; l++) {
+        int nested = 0;
+        for (int m = 0; m < loops; m++) {
+            nested += headers[m] <= headers[l] && latches[l] <= latches[m];
+        }
+
+        if (nested > depth) depth = nested;
+    }
+
+    free(headers);
+    free(latches);
+
+    int size = opt_size(function);
+    if (!loops && !calls) {
+        config->level = 0;
+        config->flags &= ~CONFIG_JIT;
+    } else if (size < ADAPT_LARGE && (calls || depth > 1)) {
+        config->level = 3;
+    } else {
+        config->level = PASS_LEVEL;
+    }
+
+    state->budget = ADAPT_PASSES;
+
+    info(
+        (*config), "Program has %d instructions, %d loops nested %d deep and %d calls from blocks, using -O%d%s",
+        size, loops, depth, calls, config->level, config->flags & CONFIG_JIT ? "" : " in the VM"
+    );
+}
+
+void opt_begin(opt_state_t* state, ir_function_t* function) {
+    state->function = function;
+    state->summary = NULL;
+    state->loops = NULL;
+    state->total = 0;
+    state->analyses = 0;
+    state->work = 0;
+    state->budget = -1;
+
+    #ifdef DEBUG
+    opt_verify(function, "building the IR");
+    #endif
+
+    if (function->config->level == PASS_AUTO) opt_adapt(state);
+
+    if (function->config->flags & CONFIG_TIME_PASSES) {
+        fprintf(stderr, "  %-12s %10s %20s %16s\n", "pass", "time (ms)", "instructions", "blocks");
+    }
+}
+
+/*
+ * Run the pipeline from --passes, or the default one, with groups in
+ * brackets repeated until a whole round leaves the IR as it was.
+ */
+void opt_pipeline(opt_state_t* state) {
+    cli_config_t* config = state->function->config;
+    const char* list = config->passes ? config->passes : PASS_PIPELINE;
+
+    opt_pass_t* steps[256];
+    int groups[256];
+    int count = 0;
+    int group = 0;
+
+    for (const char* at = list; *at;) {
+        if (*at == ',') {
+            at++;
+            continue;
+        }
+
+        if (*at == '[') {
+            group = count + 1;
+            at++;
+        }
+
+        const char* end = at;
+        while (*end && *end != ',' && *end != ']') end++;
+        if (count == 256) panic("Too many passes in pipeline");
+
+        groups[count] = group;
+        steps[count++] = opt_find(at, end - at);
+
+        at = end;
+        if (*at == ']') {
+            group = 0;
+            at++;
+        }
+    }
+
+    for (int s = 0; s < count;) {
+        if (!groups[s]) {
+            opt_run(state, steps[s++]);
+            continue;
+        }
+
+        int last = s;
+        while (last + 1 < count && groups[last + 1] == groups[s]) last++;
+
+        for (int round = 0; round < PASS_ROUNDS; round++) {
+            int changed = 0;
+            for (int g = s; g <= last; g++) {
+                changed |= opt_run(state, steps[g]);
+            }
+
+            if (!changed) break;
+        }
+
+        s = last + 1;
+    }
+}
+
+void opt_end(opt_state_t* state) {
+    if (state->loops) ir_loops_free(state->loops);
+    if (state->summary) ir_call_summary_free(state->summary);
+
+    if (state->function->config->flags & CONFIG_TIME_PASSES) {
+        fprintf(stderr, "  %-12s %10.3f\n", "total", state->total);
+    }
+}
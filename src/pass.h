@@ -0,0 +1,72 @@
+#ifndef PASS_H
+#define PASS_H
+
+#include "ir.h"
+#include "call.h"
+#include "loop.h"
+
+/*
+ * Order the optional passes run in unless --passes gives another one.
+ * A bracketed group is repeated until it no longer changes the IR, at
+ * most PASS_ROUNDS times.
+ */
+#define PASS_PIPELINE "inline,partial,forward,[fold,simplify,drop,cfg],induction,builder,drop,unroll,[forward,fold,drop,cfg],bounds,sink,drop,memo"
+#define PASS_ROUNDS 8
+
+// Level of -O2, and the marker for choosing one per program when no -O is given (see opt_adapt)
+#define PASS_LEVEL 2
+#define PASS_AUTO -1
+// Above every -O level, passes registered here only run when their option or --enable asks
+#define PASS_OPT_IN 4
+
+// Without -O, programs this large are not given the -O3 passes
+#define ADAPT_LARGE 20000
+// and at most this many passes run, fixed point groups included
+#define ADAPT_PASSES 48
+
+// The pass may change blocks, loops are found again afterwards
+#define PASS_CFG (1 << 0)
+// The pass may change calls or BLOCK bodies, the call summary is rebuilt
+#define PASS_CALLS (1 << 1)
+
+/*
+ * Analyses shared between passes. They are computed when a pass first
+ * asks for them and dropped when a pass changes what they describe.
+ */
+typedef struct opt_state {
+    ir_function_t* function;
+    call_summary_t* summary;
+    ir_loops_t* loops;
+
+    // Wall time spent in passes, and in analyses they asked for, for --time-passes
+    double total;
+    double analyses;
+
+    // Passes run so far, and how many may run, or -1
+    int work;
+    int budget;
+} opt_state_t;
+
+typedef struct opt_pass {
+    const char* name;
+    void (*run)(opt_state_t* state);
+
+    // Lowest -O level the pass runs at, and the option that enables it below that
+    int level;
+    flags_t enable;
+
+    int flags;
+} opt_pass_t;
+
+void opt_begin(opt_state_t* state, ir_function_t* function);
+void opt_pipeline(opt_state_t* state);
+void opt_end(opt_state_t* state);
+
+call_summary_t* opt_summary(opt_state_t* state);
+ir_loops_t* opt_loops(opt_state_t* state);
+
+double opt_clock();
+void opt_report(opt_state_t* state, const char* name, double start, int instructions, int blocks);
+int opt_size(ir_function_t* function);
+
+#endif
@@ -7,6 +7,7 @@ vm_t* vm_init(ir_function_t* function, arena_t* arena) {
 
     vm->block = function->block;
     vm->function = function;
+    vm->recorder = NULL;
     vm->variables = arena_alloc(arena, sizeof(v_t*) * (function->var_id + 1));
     vm->registers = arena_alloc(arena, sizeof(v_t*) * function->next_value_id);
 
@@ -17,6 +18,19 @@ vm_t* vm_init(ir_function_t* function, arena_t* arena) {
         panic("Failed to allocate memory for VM");
     }
 
+    vm->memos = arena_alloc(arena, sizeof(vm_memo_t) * (function->memo_count + 1));
+    for (int m = 0; m < function->memo_count; m++) {
+        vm_memo_t* memo = &vm->memos[m];
+
+        memo->info = &function->memos[m];
+        memo->capacity = 64;
+        memo->count = 0;
+        memo->hits = 0;
+        memo->misses = 0;
+        memo->slots = calloc(memo->capacity, sizeof(vm_memo_entry_t*));
+        if (!memo->slots) panic("Failed to allocate memory for memo table");
+    }
+
     return vm;
 }
 
@@ -40,6 +54,9 @@ void vm_constants(ir_function_t* function, v_t* registers) {
                 case IR_OUTPUT:
                     registers[result] = TYPE_NULL;
                     break;
+                case IR_BLOCK:
+                    registers[result] = (v_t) instruction->block.function | TYPE_BLOCK;
+                    break;
                 default:
                     break;
             }
@@ -48,7 +65,7 @@ void vm_constants(ir_function_t* function, v_t* registers) {
 }
 
 static inline ir_block_t* vm_call(
-    ir_block_t* origin, ir_block_t* previous, int index, ir_id_t result, v_t block, vm_stack_t* stack
+    ir_block_t* origin, ir_block_t* previous, int index, ir_id_t result, v_t block, vm_stack_t* stack, int memoized
 ) {
     ir_block_t* target = (ir_block_t*) (block & VALUE_MASK);
     if (!V_IS_BLOCK(block)) panic("Expected a block type for call, got %s", v_type(block));
@@ -57,11 +74,101 @@ static inline ir_block_t* vm_call(
     vm_push(stack, (v_t) result);
     vm_push(stack, (v_t) origin);
     vm_push(stack, (v_t) previous);
-    vm_push(stack, (v_t) index);
+    vm_push(stack, (v_t) index | (memoized ? VM_MEMO_FRAME : 0));
 
     return target;
 }
 
+static inline uint64_t vm_memo_hash(ir_memo_t* info, v_t* variables) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (int k = 0; k < info->var_count; k++) {
+        hash = (hash ^ variables[info->vars[k]]) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+static void vm_memo_grow(vm_memo_t* memo) {
+    int capacity = memo->capacity * 2;
+    vm_memo_entry_t** slots = calloc(capacity, sizeof(vm_memo_entry_t*));
+    if (!slots) panic("Failed to allocate memory for memo table");
+
+    for (int i = 0; i < memo->capacity; i++) {
+        vm_memo_entry_t* entry = memo->slots[i];
+        if (!entry) continue;
+
+        int slot = entry->hash & (capacity - 1);
+        while (slots[slot]) slot = (slot + 1) & (capacity - 1);
+        slots[slot] = entry;
+    }
+
+    free(memo->slots);
+    memo->slots = slots;
+    memo->capacity = capacity;
+}
+
+/*
+ * The entry for the current values of the body's variables. A new one
+ * is added, not yet ready, on a miss. Returns NULL when the call should
+ * run without the table: it is full, or the same call is already running.
+ */
+static vm_memo_entry_t* vm_memo_lookup(vm_memo_t* memo, v_t* variables) {
+    ir_memo_t* info = memo->info;
+    uint64_t hash = vm_memo_hash(info, variables);
+
+    int slot = hash & (memo->capacity - 1);
+    for (vm_memo_entry_t* entry; (entry = memo->slots[slot]); slot = (slot + 1) & (memo->capacity - 1)) {
+        if (entry->hash != hash) continue;
+
+        int same = 1;
+        for (int k = 0; k < info->var_count && same; k++) {
+            same = entry->values[k] == variables[info->vars[k]];
+        }
+
+        if (!same) continue;
+        if (!entry->ready) return NULL;
+
+        memo->hits++;
+        return entry;
+    }
+
+    memo->misses++;
+    if (memo->count >= MEMO_LIMIT) return NULL;
+
+    vm_memo_entry_t* entry = malloc(sizeof(vm_memo_entry_t) + sizeof(v_t) * (info->var_count + info->write_count));
+    if (!entry) panic("Failed to allocate memory for memo entry");
+
+    entry->memo = memo;
+    entry->hash = hash;
+    entry->ready = 0;
+    for (int k = 0; k < info->var_count; k++) {
+        entry->values[k] = variables[info->vars[k]];
+    }
+
+    memo->slots[slot] = entry;
+    if (++memo->count * 2 > memo->capacity) vm_memo_grow(memo);
+
+    return entry;
+}
+
+static inline void vm_memo_fill(vm_memo_entry_t* entry, v_t* variables, v_t result) {
+    ir_memo_t* info = entry->memo->info;
+
+    entry->result = result;
+    entry->ready = 1;
+    for (int k = 0; k < info->write_count; k++) {
+        entry->values[info->var_count + k] = variables[info->vars[k]];
+    }
+}
+
+static inline void vm_memo_replay(vm_memo_entry_t* entry, v_t* variables) {
+    ir_memo_t* info = entry->memo->info;
+
+    for (int k = 0; k < info->write_count; k++) {
+        variables[info->vars[k]] = entry->values[info->var_count + k];
+    }
+}
+
 static inline void vm_dump(v_t value) {
     if (V_IS_LIST(value)) {
         v_list_t list = (v_list_t)(value & VALUE_MASK);
@@ -96,18 +203,135 @@ static inline void vm_dump(v_t value) {
     }
 }
 
-static inline v_t vm_phi(ir_block_t* previous, ir_id_t* phi_values, ir_block_t** phi_blocks, int phi_count, v_t* registers) {
-    for (int i = 0; i < phi_count; ++i) {
-        if (phi_blocks[i] == previous) {
-            return registers[phi_values[i]];
+/*
+ * OUTPUT of a concatenation that was never built, see ir_sink. The
+ * trailing backslash belongs to the last piece that is not empty.
+ */
+static inline void vm_output(v_t* registers, ir_id_t* operands, int count) {
+    v_string_t pieces[count];
+    int last = -1;
+
+    for (int i = 0; i < count; i++) {
+        pieces[i] = (v_string_t) (v_coerce_to_string(registers[operands[i]]) & VALUE_MASK);
+        if (pieces[i]->length > 0) last = i;
+    }
+
+    int newline = last < 0 || pieces[last]->data[pieces[last]->length - 1] != '\\';
+    for (int i = 0; i <= last; i++) {
+        size_t length = pieces[i]->length - (i == last && !newline);
+        fwrite(pieces[i]->data, 1, length, stdout);
+    }
+
+    if (newline) putchar('\n');
+}
+
+#ifndef JIT_OFF
+// Throw out a root trace and its side traces, the loop goes back to the VM until it is hot again
+static void vm_evict(trace_recorder_t* recorder, trace_t* root) {
+    for (trace_t* trace = root; trace; trace = trace->next) {
+        recorder->size -= trace->size;
+    }
+
+    recorder->traces[root->header->id] = NULL;
+    recorder->hits[root->header->id] = -TRACE_BACKOFF;
+    trace_free(root);
+}
+
+static void vm_record_end(ir_function_t* function, trace_recorder_t* recorder, int keep) {
+    if (keep && recorder->from && recorder->from->trace->root->side_count >= TRACE_SIDES) {
+        vm_evict(recorder, recorder->from->trace->root);
+    } else if (keep) {
+        trace_t* trace = trace_compile(function, recorder->steps, recorder->count, recorder->from);
+        recorder->size += trace->size;
+
+        if (recorder->from) recorder->from->link = trace->code;
+        else recorder->traces[recorder->header->id] = trace;
+
+        if (recorder->size > TRACE_CACHE) {
+            for (int id = 0; id < function->next_block_id; id++) {
+                if (recorder->traces[id]) vm_evict(recorder, recorder->traces[id]);
+            }
         }
+    } else if (recorder->from) {
+        recorder->from->hits = -TRACE_BACKOFF;
+    } else {
+        recorder->hits[recorder->header->id] = -TRACE_BACKOFF;
     }
 
-    panic("No matching predecessor block found for PHI instruction");
+    recorder->header = NULL;
+    recorder->from = NULL;
 }
 
-vm_t* vm_run(ir_function_t* function, arena_t* arena) {
-    vm_t* vm = vm_init(function, arena);
+/*
+ * Add the instruction just run to the trace being recorded. The trace
+ * ends once the VM is back at the top of the loop, and is given up on
+ * if it calls a BLOCK, goes around another loop or gets too long.
+ */
+static void vm_record(
+    ir_function_t* function, trace_recorder_t* recorder, ir_block_t* current, ir_block_t* previous,
+    ir_instruction_t* instruction, v_t* registers, ir_block_t* block, int index
+) {
+    switch (instruction->op) {
+        case IR_CALL: case IR_RETURN: case IR_SAVE: case IR_RESTORE:
+            vm_record_end(function, recorder, 0);
+            return;
+        case IR_OUTPUT:
+            if (instruction->generic.operand_count > 1) {
+                vm_record_end(function, recorder, 0);
+                return;
+            }
+            break;
+        case IR_PHI:
+            // The VM may enter the loop from elsewhere, a root trace does not know which PHI input to take
+            if (recorder->count == 0 && !recorder->from) {
+                vm_record_end(function, recorder, 0);
+                return;
+            }
+            break;
+        default:
+            break;
+    }
+
+    trace_step_t* step = &recorder->steps[recorder->count++];
+    step->block = current;
+    step->instruction = instruction;
+    step->types[0] = step->types[1] = TYPE_NULL;
+    step->taken = 0;
+    step->phi = -1;
+
+    switch (instruction->op) {
+        case IR_ADD: case IR_SUB: case IR_MUL: case IR_LT: case IR_GT: case IR_EQ:
+            step->types[0] = V_TYPE(registers[instruction->generic.operands[0]]);
+            step->types[1] = V_TYPE(registers[instruction->generic.operands[1]]);
+            break;
+        case IR_BRANCH:
+            step->taken = block == instruction->branch.truthy;
+            break;
+        case IR_PHI:
+            for (int k = 0; k < instruction->phi.phi_count; k++) {
+                if (instruction->phi.phi_blocks[k] == previous) step->phi = instruction->phi.phi_values[k];
+            }
+            break;
+        default:
+            break;
+    }
+
+    if (index == 0 && block == recorder->header) {
+        vm_record_end(function, recorder, 1);
+    } else if (index == 0 && block->order <= current->order) {
+        vm_record_end(function, recorder, 0);
+    } else if (recorder->count >= TRACE_LIMIT) {
+        vm_record_end(function, recorder, 0);
+    }
+}
+#endif
+
+/*
+ * Run from instruction index of vm->block until the main program ends.
+ * PHIs of that block must already have been run if index is past them.
+ */
+static void vm_execute(vm_t* vm, arena_t* arena, int index) {
+    ir_function_t* function = vm->function;
 
     vm_stack_t* stack = arena_alloc(arena, sizeof(vm_stack_t));
     stack->items = malloc(sizeof(v_t) * 4096);
@@ -119,11 +343,15 @@ vm_t* vm_run(ir_function_t* function, arena_t* arena) {
     ir_block_t* block = vm->block;
     ir_block_t* previous = NULL;
 
-    int index = 0;
-
-    vm_constants(function, registers);
+    #ifndef JIT_OFF
+    trace_recorder_t* recorder = vm->recorder;
+    #endif
 
     while (block->instruction_count > index) {
+        #ifndef JIT_OFF
+        ir_block_t* current = block;
+        #endif
+
         ir_instruction_t* instruction = &block->instructions[index++];
         ir_id_t result = instruction->result;
         ir_op_t op = instruction->op;
@@ -151,14 +379,37 @@ vm_t* vm_run(ir_function_t* function, arena_t* arena) {
                 registers[result] = (v_t) instruction->block.function | TYPE_BLOCK;
                 break;
             case IR_CALL:
-                block = vm_call(block, previous, index, result, registers[instruction->generic.operands[0]], stack);
+                v_t callee = registers[instruction->generic.operands[0]];
+                ir_block_t* target = (ir_block_t*) (callee & VALUE_MASK);
+                vm_memo_entry_t* entry = NULL;
+
+                if (V_IS_BLOCK(callee) && target && target->memo >= 0) {
+                    entry = vm_memo_lookup(&vm->memos[target->memo], variables);
+
+                    if (entry && entry->ready) {
+                        vm_memo_replay(entry, variables);
+                        registers[result] = entry->result;
+                        break;
+                    }
+
+                    if (entry) vm_push(stack, (v_t) entry);
+                }
+
+                block = vm_call(block, previous, index, result, callee, stack, entry != NULL);
                 index = 0;
                 break;
             case IR_RETURN:
-                index = vm_pop(stack);
+                v_t frame = vm_pop(stack);
+                index = frame & ~VM_MEMO_FRAME;
                 previous = (ir_block_t*) vm_pop(stack);
                 block = (ir_block_t*) vm_pop(stack);
-                registers[vm_pop(stack)] = registers[instruction->generic.operands[0]];
+
+                ir_id_t into = vm_pop(stack);
+                registers[into] = registers[instruction->generic.operands[0]];
+
+                if (frame & VM_MEMO_FRAME) {
+                    vm_memo_fill((vm_memo_entry_t*) vm_pop(stack), variables, registers[into]);
+                }
                 break;
             case IR_NOT:
                 registers[result] = v_coerce_to_boolean(registers[instruction->generic.operands[0]]) ^ (1 << 3);
@@ -209,6 +460,11 @@ vm_t* vm_run(ir_function_t* function, arena_t* arena) {
                 registers[result] = vm_eq(registers[instruction->generic.operands[0]], registers[instruction->generic.operands[1]]);
                 break;
             case IR_OUTPUT:
+                if (instruction->generic.operand_count > 1) {
+                    vm_output(registers, instruction->generic.operands, instruction->generic.operand_count);
+                    break;
+                }
+
                 v_t string = v_coerce_to_string(registers[instruction->generic.operands[0]]);
                 v_string_t str = (v_string_t) (string & VALUE_MASK);
                 if (str->length > 0 && str->data[str->length - 1] == '\\') {
@@ -222,11 +478,30 @@ vm_t* vm_run(ir_function_t* function, arena_t* arena) {
                 vm_dump(registers[instruction->generic.operands[0]]);
                 break;
             case IR_GET:
+                if (instruction->flags & IR_FLAG_IN_BOUNDS) {
+                    registers[result] = vm_get_unchecked(registers[instruction->generic.operands[0]], registers[instruction->generic.operands[1]], registers[instruction->generic.operands[2]]);
+                    break;
+                }
+
                 registers[result] = vm_get(registers[instruction->generic.operands[0]], registers[instruction->generic.operands[1]], registers[instruction->generic.operands[2]]);
                 break;
             case IR_SET:
+                if (instruction->flags & IR_FLAG_IN_BOUNDS) {
+                    registers[result] = vm_set_unchecked(registers[instruction->generic.operands[0]], registers[instruction->generic.operands[1]], registers[instruction->generic.operands[2]], registers[instruction->generic.operands[3]]);
+                    break;
+                }
+
                 registers[result] = vm_set(registers[instruction->generic.operands[0]], registers[instruction->generic.operands[1]], registers[instruction->generic.operands[2]], registers[instruction->generic.operands[3]]);
                 break;
+            case IR_BUILD:
+                registers[result] = vm_build(registers[instruction->generic.operands[0]]);
+                break;
+            case IR_APPEND:
+                vm_append(registers[instruction->generic.operands[0]], registers[instruction->generic.operands[1]]);
+                break;
+            case IR_FINISH:
+                registers[result] = vm_finish(registers[instruction->generic.operands[0]]);
+                break;
             case IR_BRANCH:
                 previous = block;
                 v_t condition = v_coerce_to_boolean(registers[instruction->branch.condition]) >> 3;
@@ -257,7 +532,79 @@ vm_t* vm_run(ir_function_t* function, arena_t* arena) {
                 break;
             default: panic("Unknown IR operation %d", op);
         }
+
+        #ifndef JIT_OFF
+        if (recorder && recorder->header) {
+            vm_record(function, recorder, current, previous, instruction, registers, block, index);
+        } else if (recorder && index == 0 && (op == IR_JUMP || op == IR_BRANCH)) {
+            trace_t* trace = recorder->traces[block->id];
+
+            if (trace) {
+                trace_exit_t* out = ((trace_entry_t) trace->code)(registers, variables);
+                block = out->block;
+                previous = out->previous;
+                index = out->index;
+
+                // Record where a guard keeps failing, to go on in a side trace from then on
+                if (!out->link && ++out->hits >= TRACE_EXIT_HOT) {
+                    recorder->header = out->trace->root->header;
+                    recorder->from = out;
+                    recorder->count = 0;
+                }
+            } else if (block->order <= current->order && ++recorder->hits[block->id] >= TRACE_HOT) {
+                recorder->header = block;
+                recorder->count = 0;
+            }
+        }
+        #endif
     }
 
+    for (int m = 0; m < function->memo_count; m++) {
+        vm_memo_t* memo = &vm->memos[m];
+        info((*function->config), "Memo for block %d: %ld hits, %ld misses, %d entries", memo->info->region->id, memo->hits, memo->misses, memo->count);
+    }
+}
+
+vm_t* vm_run(ir_function_t* function, arena_t* arena) {
+    vm_t* vm = vm_init(function, arena);
+
+    #ifndef JIT_OFF
+    if (function->config->flags & CONFIG_TRACE) {
+        trace_recorder_t* recorder = arena_alloc(arena, sizeof(trace_recorder_t));
+        recorder->hits = calloc(function->next_block_id, sizeof(int));
+        recorder->traces = calloc(function->next_block_id, sizeof(trace_t*));
+        recorder->steps = malloc(sizeof(trace_step_t) * TRACE_LIMIT);
+        recorder->count = 0;
+        recorder->size = 0;
+        recorder->header = NULL;
+        recorder->from = NULL;
+
+        if (!recorder->hits || !recorder->traces || !recorder->steps) panic("Failed to allocate memory for trace recorder");
+        vm->recorder = recorder;
+    }
+    #endif
+
+    vm_constants(function, vm->registers);
+    vm_execute(vm, arena, 0);
+
+    return vm;
+}
+
+/*
+ * Continue the main program in the VM from instruction index of block,
+ * given the values and variables it had there. Only the values live at
+ * that point need to be set in registers, everything else is either a
+ * constant or written again before it is read.
+ */
+vm_t* vm_resume(ir_function_t* function, arena_t* arena, ir_block_t* block, int index, v_t* registers, v_t* variables) {
+    vm_t* vm = vm_init(function, arena);
+
+    memcpy(vm->registers, registers, sizeof(v_t) * function->next_value_id);
+    memcpy(vm->variables, variables, sizeof(v_t) * (function->var_id + 1));
+    vm_constants(function, vm->registers);
+
+    vm->block = block;
+    vm_execute(vm, arena, index);
+
     return vm;
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 
 #include "ir.h"
 #include "jit/value.h"
+#include "jit/trace.h"
 
 typedef struct vm_stack_item {
     ir_block_t* callee;
@@ -18,12 +19,60 @@ typedef struct vm_stack {
     int capacity;
 } vm_stack_t;
 
+/*
+ * Accumulator for a variable that a loop only appends to, see
+ * ir_builder. Strings and lists grow in place, anything else falls
+ * back to a plain ADD.
+ */
+typedef struct vm_builder {
+    v_type_t type;
+    size_t length;
+    size_t capacity;
+
+    char* data;
+    v_t* items;
+    v_t value;
+} vm_builder_t;
+
+// Entries kept per memoized BLOCK body, see ir_memo
+#define MEMO_LIMIT (1 << 16)
+
+// Set on the index a CALL pushes when its RETURN fills in a memo entry
+#define VM_MEMO_FRAME ((v_t) 1 << 62)
+
+/*
+ * Result of one memoized call. values holds the variables it was made
+ * with, then what the written ones held once it returned.
+ */
+typedef struct vm_memo_entry {
+    struct vm_memo* memo;
+    uint64_t hash;
+    int ready;
+    v_t result;
+    v_t values[];
+} vm_memo_entry_t;
+
+typedef struct vm_memo {
+    ir_memo_t* info;
+
+    vm_memo_entry_t** slots;
+    int capacity;
+    int count;
+
+    long hits;
+    long misses;
+} vm_memo_t;
+
 typedef struct vm {
     ir_block_t* block;
     ir_function_t* function;
 
     v_t* variables;
     v_t* registers;
+    vm_memo_t* memos;
+
+    // Set when hot loops are traced, see vm_record and trace_compile
+    trace_recorder_t* recorder;
 
     int index;
 } vm_t;
@@ -46,6 +95,16 @@ static inline v_t vm_pop(vm_stack_t* stack) {
     return stack->items[--stack->size];
 }
 
+static inline v_t vm_phi(ir_block_t* previous, ir_id_t* phi_values, ir_block_t** phi_blocks, int phi_count, v_t* registers) {
+    for (int i = 0; i < phi_count; ++i) {
+        if (phi_blocks[i] == previous) {
+            return registers[phi_values[i]];
+        }
+    }
+
+    panic("No matching predecessor block found for PHI instruction");
+}
+
 static inline v_t vm_prompt() {
     int capacity = 16;
     int length = 0;
@@ -622,6 +681,136 @@ static inline v_t vm_set(v_t value, v_t index, v_t range, v_t replace) {
     panic("Cannot set index %s with range %s on type %s", v_type(index), v_type(range), v_type(value));
 }
 
+static inline v_t vm_build(v_t initial) {
+    vm_builder_t* builder = calloc(1, sizeof(vm_builder_t));
+    if (!builder) panic("Failed to allocate memory for builder");
+
+    builder->type = V_TYPE(initial);
+    builder->value = initial;
+
+    if (V_IS_STRING(initial)) {
+        v_string_t str = (v_string_t) (initial & VALUE_MASK);
+
+        builder->length = str->length;
+        builder->capacity = str->length * 2 + 16;
+        builder->data = malloc(builder->capacity);
+        if (!builder->data) panic("Failed to allocate memory for builder");
+
+        memcpy(builder->data, str->data, str->length);
+    } else if (V_IS_LIST(initial)) {
+        v_list_t list = (v_list_t) (initial & VALUE_MASK);
+
+        builder->length = list->length;
+        builder->capacity = list->length * 2 + 16;
+        builder->items = malloc(sizeof(v_t) * builder->capacity);
+        if (!builder->items) panic("Failed to allocate memory for builder");
+
+        memcpy(builder->items, list->items, sizeof(v_t) * list->length);
+    }
+
+    return (v_t) builder;
+}
+
+static inline void vm_builder_grow(vm_builder_t* builder, size_t length, size_t size) {
+    if (builder->length + length <= builder->capacity) return;
+
+    while (builder->length + length > builder->capacity) builder->capacity *= 2;
+
+    if (builder->type == TYPE_STRING) {
+        builder->data = realloc(builder->data, builder->capacity * size);
+        if (!builder->data) panic("Failed to allocate memory for builder");
+    } else {
+        builder->items = realloc(builder->items, builder->capacity * size);
+        if (!builder->items) panic("Failed to allocate memory for builder");
+    }
+}
+
+static inline void vm_append(v_t value, v_t piece) {
+    vm_builder_t* builder = (vm_builder_t*) value;
+
+    if (builder->type == TYPE_STRING) {
+        v_string_t str = (v_string_t) (v_coerce(piece, TYPE_STRING) & VALUE_MASK);
+
+        vm_builder_grow(builder, str->length, 1);
+        memcpy(builder->data + builder->length, str->data, str->length);
+        builder->length += str->length;
+    } else if (builder->type == TYPE_LIST) {
+        v_list_t list = (v_list_t) (v_coerce(piece, TYPE_LIST) & VALUE_MASK);
+
+        vm_builder_grow(builder, list->length, sizeof(v_t));
+        memcpy(builder->items + builder->length, list->items, sizeof(v_t) * list->length);
+        builder->length += list->length;
+    } else {
+        builder->value = vm_add(builder->value, piece);
+    }
+}
+
+/* A copy of what was built so far, the builder may still be appended to */
+static inline v_t vm_finish(v_t value) {
+    vm_builder_t* builder = (vm_builder_t*) value;
+
+    if (builder->type == TYPE_STRING) {
+        return v_create_string(builder->data, builder->length);
+    } else if (builder->type == TYPE_LIST) {
+        v_list_t list = (v_list_t) (v_create_list(builder->length) & VALUE_MASK);
+
+        list->length = builder->length;
+        memcpy(list->items, builder->items, sizeof(v_t) * builder->length);
+        return (v_t) list | TYPE_LIST;
+    }
+
+    return builder->value;
+}
+
+/*
+ * GET and SET with a number index and range already proven in bounds,
+ * see ir_bounds. Anything that is not a string or list takes the
+ * checked path to report the error.
+ */
+static inline v_t vm_get_unchecked(v_t value, v_t index, v_t range) {
+    v_number_t idx = (v_number_t) index >> 3;
+    v_number_t len = (v_number_t) range >> 3;
+
+    if (V_IS_STRING(value)) {
+        v_string_t str = (v_string_t) (value & VALUE_MASK);
+        return v_create_string(str->data + idx, len);
+    } else if (V_IS_LIST(value)) {
+        v_list_t list = (v_list_t) (value & VALUE_MASK);
+        v_list_t sublist = (v_list_t) (v_create_list(len) & VALUE_MASK);
+
+        sublist->length = len;
+        if (len) memcpy(sublist->items, list->items + idx, sizeof(v_t) * len);
+        return (v_t) sublist | TYPE_LIST;
+    }
+
+    return vm_get(value, index, range);
+}
+
+static inline v_t vm_set_unchecked(v_t value, v_t index, v_t range, v_t replace) {
+    if (!V_IS_STRING(value) || !V_IS_STRING(replace)) {
+        return vm_set(value, index, range, replace);
+    }
+
+    v_number_t idx = (v_number_t) index >> 3;
+    v_number_t len = (v_number_t) range >> 3;
+    v_string_t str = (v_string_t) (value & VALUE_MASK);
+    v_string_t substr = (v_string_t) (replace & VALUE_MASK);
+
+    size_t new_length = str->length - len + substr->length;
+    v_string_box_t* box = malloc(sizeof(v_string_box_t) + new_length + 1);
+    if (!box) panic("Failed to allocate memory for modified string");
+
+    box->length = new_length;
+    box->data = (char*) (box + 1);
+    memcpy(box->data, str->data, idx);
+    memcpy(box->data + idx, substr->data, substr->length);
+    memcpy(box->data + idx + substr->length, str->data + idx + len, str->length - idx - len);
+    box->data[new_length] = '\0';
+
+    return (v_t) box | TYPE_STRING;
+}
+
 vm_t* vm_run(ir_function_t* function, arena_t* arena);
+vm_t* vm_resume(ir_function_t* function, arena_t* arena, ir_block_t* block, int index, v_t* registers, v_t* variables);
 
 #endif
\ No newline at end of file
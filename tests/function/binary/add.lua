@@ -24,6 +24,7 @@ return section("ADD", function()
 			test.assert("1234", "+ '' 1234")
 			test.assert("-123", "+ '' ~123")
 			test.assert("1\n2\n3", "+ '' +@123")
+			test.assert("a0", "; = s 'a' : + s 0")
 		end)
 
 		it("does not reuse the same integer buffer", function()
@@ -59,6 +60,7 @@ return section("ADD", function()
 			test.assert("0", "+ 0 FALSE")
 			test.assert("0", "+ 0 NULL")
 			test.assert("5", "+ 0 +@12345")
+			test.assert("12", "; = s '12' : + 0 s")
 		end)
 
 		it("errors on overflow", function()
@@ -20,6 +20,13 @@ return section("DIVIDE", function()
 		test.assert("-2", "/ ~7 3")
 	end)
 
+	it("rounds towards zero when dividing by a constant in a loop", function()
+		test.assert("-5,-5,-4,-3,-3,-2,-1,-1,0,0,1,1,2,3,3,4,5,5,", "; = n ~17 ; = o '' ; WHILE (< n 18) ; = o + + o (/ n 3) ',' = n + n 2 : o")
+		test.assert("-2,-2,-1,-1,-1,-1,0,0,0,0,0,0,1,1,1,1,2,2,", "; = n ~17 ; = o '' ; WHILE (< n 18) ; = o + + o (/ n 7) ',' = n + n 2 : o")
+		test.assert("3,3,2,2,1,1,1,0,0,0,0,-1,-1,-1,-2,-2,-3,-3,", "; = n ~17 ; = o '' ; WHILE (< n 18) ; = o + + o (/ n ~5) ',' = n + n 2 : o")
+		test.assert("-2,-1,-1,-1,-1,0,0,0,0,0,0,0,0,1,1,1,1,2,", "; = n ~17 ; = o '' ; WHILE (< n 18) ; = o + + o (/ n 8) ',' = n + n 2 : o")
+	end)
+
 	it("evaluates arguments in order", function()
 		test.assert("15", "/ (= n 45) (- n 42)")
 		test.assert("15", "/ (= n 15) (- n 14)")
@@ -11,6 +11,15 @@ return section("MODULO", function()
 		test.assert("3", "% 3 1234")
 	end)
 
+	it("modulos by a constant in a loop", function()
+		test.assert("0,1,2,0,1,2,0,1,2,0,1,2,0,1,2,0,1,2,", "; = n 0 ; = o '' ; WHILE (< n 18) ; = o + + o (% n 3) ',' = n + n 1 : o")
+		test.assert("0,1,2,3,4,5,6,0,1,2,3,4,5,6,0,1,2,3,", "; = n 0 ; = o '' ; WHILE (< n 18) ; = o + + o (% n 7) ',' = n + n 1 : o")
+		test.assert("0,1,2,3,4,5,6,7,0,1,2,3,4,5,6,7,0,1,", "; = n 0 ; = o '' ; WHILE (< n 18) ; = o + + o (% n 8) ',' = n + n 1 : o")
+		test.refute("; = n ~17 ; = o 0 ; WHILE (< n 18) ; = o + o (% n 3) = n + n 2 : o")
+		test.refute("; = n ~17 ; = o 0 ; WHILE (< n 18) ; = o + o (% n 7) = n + n 2 : o")
+		test.refute("; = n 17 ; = o 0 ; WHILE (> n 0) ; = o + o (% n ~5) = n - n 2 : o")
+	end)
+
 	it("converts other values to integers", function()
 		test.assert("1", "% 15 '2'")
 		test.assert("3", "% 91 '4'")
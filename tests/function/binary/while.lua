@@ -13,6 +13,27 @@ return section("WHILE", function()
 		test.assert("45", "; = i 0 ; = sum 0 ; WHILE (< i 10) ; = sum + sum i = i + i 1 : sum")
 	end)
 
+	it("runs every iteration of a counted loop", function()
+		test.assert("5253", "; = i 0 ; = sum 0 ; WHILE (< i 103) ; = sum + sum i = i + i 1 : sum")
+		test.assert("1717", "; = i 100 ; = sum 0 ; WHILE (> i 0) ; = sum + sum i = i - i 3 : sum")
+		test.assert("3", "; = i 0 ; = n 5 ; = c 0 ; WHILE (< i n) ; = c + c 1 = i + i 2 : c")
+	end)
+
+	it("sees every append to a string built in the loop", function()
+		test.assert("70", "; = s '' ; = i 0 ; WHILE (< i 40) ; = s + s i = i + i 1 : LENGTH s")
+		test.assert("64", "; = s '' ; = i 0 ; = n 0 ; WHILE (< i 40) ; = s + s 'a' ; IF (? 0 % i 10) (= n + n LENGTH s) NULL = i + i 1 : n")
+		test.assert("40", "; = l @ ; = i 0 ; WHILE (< i 40) ; = l + l ,i = i + i 1 : LENGTH l")
+	end)
+
+	it("keeps more variables live than there are registers", function()
+		test.assert("62130", "; = a 1 ; = b 2 ; = c 3 ; = d 4 ; = e 5 ; = f 6 ; = g 7 ; = h 8 ; = j 9 ; = k 10 ; = l 11 ; = m 12 ; = n 13 ; = p 14 ; = i 0 ; WHILE < i 20 ; = a % (+ a * b f) 1000 ; = b % (+ b * c g) 1000 ; = c % (+ c * d h) 1000 ; = d % (+ d * e j) 1000 ; = e % (+ e * f k) 1000 ; = f % (+ f * g l) 1000 ; = g % (+ g * h m) 1000 ; = h % (+ h * j n) 1000 ; = j % (+ j * k p) 1000 ; = k % (+ k * l a) 1000 ; = l % (+ l * m b) 1000 ; = m % (+ m * n c) 1000 ; = n % (+ n * p d) 1000 ; = p % (+ p * a e) 1000 = i + i 1 : + * 1 a + * 2 b + * 3 c + * 4 d + * 5 e + * 6 f + * 7 g + * 8 h + * 9 j + * 10 k + * 11 l + * 12 m + * 13 n * 14 p")
+	end)
+
+	it("swaps and rotates variables across iterations", function()
+		test.assert("21", "; = a 1 ; = b 2 ; = i 0 ; WHILE < i 3 ; = t a ; = a b ; = b t = i + i 1 : + * 10 a b")
+		test.assert("700", "; = a 1 ; = b 2 ; = c 3 ; = d 4 ; = e 5 ; = f 6 ; = g 7 ; = h 8 ; = j 9 ; = k 10 ; = l 11 ; = m 12 ; = n 13 ; = p 14 ; = i 0 ; WHILE < i 5 ; = t a ; = a b ; = b c ; = c d ; = d e ; = e f ; = f g ; = g h ; = h j ; = j k ; = k l ; = l m ; = m n ; = n p ; = p t = i + i 1 : + * 1 a + * 2 b + * 3 c + * 4 d + * 5 e + * 6 f + * 7 g + * 8 h + * 9 j + * 10 k + * 11 l + * 12 m + * 13 n * 14 p")
+	end)
+
 	it("will return NULL, regardless of the condition", function()
 		test.assert("null", "WHILE FALSE 1234")
 		test.assert("null", "; = i 0 : WHILE (< i 10) : = i + i 1")
@@ -11,4 +11,8 @@ return section("PROMPT", function()
 		test.assert("foo", "PROMPT", "foo\r\n")
 		test.assert("foo", "PROMPT", "foo\r\nbar")
 	end)
+
+	it("should consume a line even when the result is unused", function()
+		test.assert("bar", "; PROMPT PROMPT", "foo\nbar")
+	end)
 end)
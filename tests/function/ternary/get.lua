@@ -33,6 +33,12 @@ return section("GET", function()
 		end)
 	end)
 
+	it("indexes within a loop bounded by LENGTH", function()
+		test.assert("dcba", '; = s "abcd" ; = r "" ; = i 0 ; WHILE < i LENGTH s ; = r + GET s i 1 r : = i + i 1 : r')
+		test.assert("[3,2,1]", '; = s +@123 ; = r @ ; = i 0 ; WHILE < i LENGTH s ; = r + GET s i 1 r : = i + i 1 : r')
+		test.refute('; = s "abcd" ; = i 0 : WHILE < i LENGTH s ; = s "" ; OUTPUT GET s i 1 : = i + i 1')
+	end)
+
 	it("does not accept BLOCK values anywhere (strict types)", function()
 		test.refute("GET (BLOCK QUIT 0) 0 0")
 		test.refute("GET '0' (BLOCK QUIT 0) 0")
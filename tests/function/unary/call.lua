@@ -14,6 +14,23 @@ return section("CALL", function()
 		test.assert("15", "; = foo BLOCK * x 5 ; = x 3 : CALL foo")
 	end)
 
+	it("should keep values from earlier blocks across recursive calls", function()
+		test.assert("60", "; = f BLOCK + (* n 10) (IF (> n 0) (; = n - n 1 : CALL f) 0) ; = n 3 : CALL f")
+		test.assert("610", "; = fib BLOCK IF (< n 2) n (; = n - n 1 ; = r + (CALL fib) (; = n - n 1 CALL fib) ; = n + n 2 : r) ; = n 15 : CALL fib")
+	end)
+
+	it("should see variables written by the called block", function()
+		test.assert("3", "; = x 1 ; = g BLOCK = x 2 ; = f BLOCK CALL g ; = y x ; CALL f : + y x")
+		test.assert("3", "; = x 1 ; = f BLOCK = x + x 1 ; = b IF TRUE f f ; CALL b ; CALL b : x")
+	end)
+
+	it("should replay the variables a memoized block writes", function()
+		test.with("-m -j", function()
+			test.assert("37700", "; = fib BLOCK ; = seen n : IF (< n 2) n (; = n - n 1 ; = r + (CALL fib) (; = n - n 1 CALL fib) ; = n + n 2 : r) ; = n 14 ; = x CALL fib : + (* x 100) seen")
+			test.assert("61001", "; = fib BLOCK ; = seen n : IF (< n 2) n (; = n - n 1 ; = r + (CALL fib) (; = n - n 1 CALL fib) ; = n + n 2 : r) ; = n 15 ; = x CALL fib : + (* x 100) seen")
+		end)
+	end)
+
 	it("should only eval blocks (strict compliance)", function()
 		test.refute("CALL 1")
 		test.refute('CALL "1"')
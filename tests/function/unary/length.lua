@@ -39,6 +39,12 @@ return section("LENGTH", function()
 		test.assert("4", "LENGTH GET *,33 100 0 4")
 	end)
 
+	it("counts concatenations and tails without knowing their contents", function()
+		test.assert("5", "; = s + '' PROMPT : LENGTH + s 'xyz'", "ab")
+		test.assert("1", "; = s + '' PROMPT : LENGTH ] s", "ab")
+		test.assert("3", "; = s + '' PROMPT : LENGTH + ,s +@s", "ab")
+	end)
+
 	it("requires exactly one argument (argument count)", function()
 		test.refute("LENGTH")
 		test.must("LENGTH 1")
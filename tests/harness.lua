@@ -84,6 +84,10 @@ end
 -- Utility functions for the test harness
 local test = {}
 
+-- Command line options passed to the executable
+-- before the code, see `test.with`.
+local options = ""
+
 -- Expose a test spec to be used by the harness.
 function test.spec(specs)
 	if type(specs) ~= "table" then
@@ -120,7 +124,7 @@ function test.run(code, stdin)
 	code = code:gsub('"', '\\"')
 	local echo = stdin and 'echo "' .. stdin .. '" | ' or ""
 
-	local handle = io.popen(echo .. test_harness.executable .. ' -e "D ' .. code .. '"', "r")
+	local handle = io.popen(echo .. test_harness.executable .. options .. ' -e "D ' .. code .. '"', "r")
 	local stdout = handle:read("*a")
 	local _, _, exit = handle:close()
 	return stdout, exit
@@ -131,7 +135,7 @@ function test.refute(code, stdin)
 	code = code:gsub('"', '\\"')
 	local echo = stdin and 'echo "' .. stdin .. '" | ' or ""
 
-	local handle = io.popen(echo .. test_harness.executable .. ' -e "D ' .. code .. '" 2>' .. null(), "r")
+	local handle = io.popen(echo .. test_harness.executable .. options .. ' -e "D ' .. code .. '" 2>' .. null(), "r")
 	local stdout = handle:read("*a")
 	local _, _, exit = handle:close()
 	local pass = exit ~= 0
@@ -155,7 +159,7 @@ function test.must(code, stdin)
 	code = code:gsub('"', '\\"')
 	local echo = stdin and 'echo "' .. stdin .. '" | ' or ""
 
-	local handle = io.popen(echo .. test_harness.executable .. ' -e "D ' .. code .. '"', "r")
+	local handle = io.popen(echo .. test_harness.executable .. options .. ' -e "D ' .. code .. '"', "r")
 	local stdout = handle:read("*a")
 	local _, _, exit = handle:close()
 	local pass = exit == 0
@@ -192,6 +196,41 @@ function test.assert(stdout, code, stdin)
 	test_harness.total = test_harness.total + 1
 end
 
+-- Assert that the Knight code panics with
+-- a message containing the expected one.
+function test.panics(message, code, stdin)
+	code = code:gsub('"', '\\"')
+	local echo = stdin and 'echo "' .. stdin .. '" | ' or ""
+
+	local handle = io.popen(echo .. test_harness.executable .. options .. ' -e "D ' .. code .. '" 2>&1', "r")
+	local output = handle:read("*a"):gsub("\n$", "")
+	local _, _, exit = handle:close()
+	local pass = exit ~= 0 and output:find(message, 1, true) ~= nil
+
+	log.assert(pass, output, code, stdin, message)
+
+	if pass then
+		test_harness.passed = test_harness.passed + 1
+	else
+		test_harness.failed = test_harness.failed + 1
+	end
+
+	test_harness.total = test_harness.total + 1
+end
+
+-- Run the tests in the callback with extra
+-- command line options, such as "-O3".
+function test.with(extra, callback)
+	local previous = options
+	options = " " .. extra
+	local ok, err = pcall(callback)
+	options = previous
+
+	if not ok then
+		error(err, 0)
+	end
+end
+
 -- Mark a test as TODO.
 function test.todo(message)
 	log.todo(message)
@@ -0,0 +1,11 @@
+local test = require("tests/harness")
+
+return section("PARTIAL", function()
+	it("resumes with the variables set before the first output", function()
+		test.with("-p -O2", function()
+			test.assert("h\ne\nl\nl\no\nnull", '; = s "hello" ; = i 0 : WHILE < i LENGTH s ; OUTPUT GET s i 1 = i + i 1')
+			test.assert("x\n1", '; = c 0 ; OUTPUT "x" : + c 1')
+			test.assert("10", "; = i 0 ; = n 0 ; WHILE (< i 5) ; = n + n i = i + i 1 : n")
+		end)
+	end)
+end)
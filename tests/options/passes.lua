@@ -0,0 +1,27 @@
+local test = require("tests/harness")
+
+return section("PASSES", function()
+	it("runs a bracketed group of passes", function()
+		test.with("--passes '[forward,fold,drop],cfg'", function()
+			test.assert("45", "; = i 0 ; = sum 0 ; WHILE (< i 10) ; = sum + sum i = i + i 1 : sum")
+			test.assert("12", "; = a 3 : IF (= a 3) (+ a 9) (QUIT 1)")
+		end)
+	end)
+
+	it("rejects unknown pass names", function()
+		test.with("--passes '[fold,unknown],drop'", function()
+			test.panics("Unknown pass 'unknown'", "1")
+		end)
+	end)
+
+	it("adds and removes passes from the level with --enable and --disable", function()
+		test.with("-O1 --enable unroll,bounds", function()
+			test.assert("5253", "; = i 0 ; = sum 0 ; WHILE (< i 103) ; = sum + sum i = i + i 1 : sum")
+			test.assert("o", "; = s 'hello' ; = i 0 ; = c '' ; WHILE (< i LENGTH s) ; = c GET s i 1 = i + i 1 : c")
+		end)
+
+		test.with("-O2 --disable fold,cfg", function()
+			test.assert("45", "; = i 0 ; = sum 0 ; WHILE (< i 10) ; = sum + sum i = i + i 1 : sum")
+		end)
+	end)
+end)
@@ -0,0 +1,8 @@
+local harness = require("tests/harness")
+
+return harness.spec({
+	"partial",
+	"passes",
+	"speculate",
+	"trace",
+})
@@ -0,0 +1,16 @@
+local test = require("tests/harness")
+
+return section("SPECULATE", function()
+	it("falls back to the VM when a value is not a number", function()
+		test.with("-s", function()
+			test.assert("a11111", '; = i 0 ; = x 0 ; WHILE (< i 10) ; = x + (IF (? i 5) "a" x) 1 = i + i 1 : x')
+			test.assert("a61111", '; = x 0 ; = i 0 ; WHILE (< i 10) ; = x + x 1 ; IF (? i 5) (= x + "a" x) NULL = i + i 1 : x')
+			test.assert("30", "; = i 0 ; = n 0 ; WHILE (< i 4) ; = j 0 ; WHILE (< j 4) ; = n + n (IF (? (* i j) 6) TRUE 2) = j + j 1 = i + i 1 : n")
+			test.refute("; = i 0 ; = s 0 ; WHILE (< i 10) ; = s - s (/ i 3) ; IF (? i 5) (= s TRUE) NULL = i + i 1 : s")
+		end)
+
+		test.with("-s -O0", function()
+			test.assert("5555555555555555", '; = i 0 ; = x 0 ; WHILE (< i 8) ; = x * x 2 ; IF (? i 3) (= x "5") NULL = i + i 1 : x')
+		end)
+	end)
+end)
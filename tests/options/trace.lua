@@ -0,0 +1,16 @@
+local test = require("tests/harness")
+
+return section("TRACE", function()
+	it("runs hot loops through traces and their side exits", function()
+		test.with("-t", function()
+			test.assert("16661667", "; = i 0 ; = s 0 ; WHILE < i 10000 ; IF ? 0 % i 3 (= s + s i) (= s - s 1) = i + i 1 : s")
+			test.assert("135150", "; = i 0 ; = n 0 ; WHILE < i 300 ; = j 0 ; WHILE < j 300 ; = n + n (IF < j i 1 2) = j + j 1 = i + i 1 : n")
+			test.assert("xxxx", '; = i 0 ; = s "" ; WHILE < i 200 ; = s + s (IF ? 0 % i 50 "x" "") = i + i 1 : s')
+			test.assert("7111111111", '; = i 0 ; = x 0 ; WHILE < i 80 ; = x + x 1 ; IF ? i 70 (= x "7") NULL = i + i 1 : x')
+		end)
+
+		test.with("-t -O0", function()
+			test.assert("16661667", "; = i 0 ; = s 0 ; WHILE < i 10000 ; IF ? 0 % i 3 (= s + s i) (= s - s 1) = i + i 1 : s")
+		end)
+	end)
+end)
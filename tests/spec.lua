@@ -25,6 +25,7 @@ spec.scopes = {
 	"syntax",
 	"types",
 	"variable",
+	"options",
 }
 
 -- Each test should be the result of a file returning